@@ -9,8 +9,16 @@ nyn = 32
 nzn = 32
 
 
+# Files written with files:layout = series hold all steps in /values
+series = '/values' in filePhi
+if series:
+    steps = list(filePhi['/n'][:])
+
 for ts in range(int(sys.argv[2]),int(sys.argv[3]),int(sys.argv[4])):
-    phi = filePhi['/n=' + str(ts) + '.0']
+    if series:
+        phi = filePhi['/values'][steps.index(float(ts))]
+    else:
+        phi = filePhi['/n=' + str(ts) + '.0']
 
     phi = phi[:,:,:,0]
 
@@ -16,10 +16,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 #include <math.h>
 #include <hdf5.h>
 #include <gsl/gsl_rng.h>
+#include <gsl/gsl_linalg.h>
 #include "version.h"
 
 /******************************************************************************
@@ -67,7 +69,7 @@
  * to sum the energy across the subdomains and store it to an .h5-file.
  *
  * If a population h5 output file is created, the handler to this file is
- * stored in h5.
+ * stored in h5, along with how often and how many particles to write.
  */
 typedef struct{
 	double *pos;		///< Position
@@ -76,6 +78,9 @@ typedef struct{
 	long int *iStop;	///< First index not of specie s (nSpecies elements)
 	long int *objVicinity; ///< buffer of particle indecies close to objects
 	long int *collisions; ///< buffer of particle indecies that will collide with an object in the next timestep
+	double *intersections; ///< Where the particles in collisions hit the object (nDims per collision)
+	long int nVicinity;	///< Number of particles in objVicinity
+	long int nCollisions;	///< Number of particles in collisions
 	double *charge;		///< Charge (nSpecies elements)
 	double *mass;		///< Mass (nSpecies elements)
 	double *kinEnergy;	///< Kinetic energy (nSpecies+1 elements)
@@ -83,6 +88,11 @@ typedef struct{
 	int nSpecies;		///< Number of species
 	int nDims;			///< Number of dimensions (usually 3)
 	hid_t h5;			///< HDF5 file handler
+	int h5Interval;		///< Time steps between writes to h5
+	int h5Decimation;	///< Write one out of h5Decimation particles
+	bool h5Random;		///< Pick the particles to write randomly (otherwise by stride)
+	int h5Deflate;		///< Deflate level of h5 datasets (0 for none)
+	hid_t h5Type;		///< HDF5 type stored in file
 } Population;
 
 /**
@@ -112,6 +122,7 @@ typedef struct{
 typedef struct{
 	int mpiRank;				///< MPI rank
 	int mpiSize;				///< MPI size
+	MPI_Comm comm;				///< Communicator the subdomains belong to
 	int nDims;					///< Number of dimensions
 	int *subdomain;				///< MPI node (nDims elements)
 	int *nSubdomains;			///< Number of MPI nodes (nDims elements)
@@ -251,7 +262,7 @@ typedef enum{
  * dimension in the array.
  *
  * 'h5' is a HDF5 file identifier used to store the grid quantity to an .h5-file
- * and are used by gWriteH5(). The other two h5-variables are also used by
+ * and are used by gWriteH5(). The other h5-variables are also used by
  * gWriteH5() since they only needs to be computed once.
  *
  * 'slice' is a buffer which is large enough to store any slice cut through the
@@ -272,6 +283,11 @@ typedef struct{
 	hid_t h5;			///< HDF5 file handler
 	hid_t h5MemSpace;	///< HDF5 memory space description
 	hid_t h5FileSpace;	///< HDF5 file space description
+	int h5Interval;		///< Time steps between writes to h5
+	int h5Stride;		///< Stride between nodes written to h5
+	hid_t h5CreateProp;	///< HDF5 dataset creation properties (chunking)
+	hid_t h5Type;		///< HDF5 type stored in file
+	bool h5Series;		///< Append steps to one extendible dataset in h5
 
 	bndType *bnd;		///< Array storing boundary conditions
 } Grid;
@@ -477,5 +493,7 @@ typedef void (*funPtr)();
 #include "io.h"
 #include "aux.h"
 #include "units.h"
+#include "random.h"
+#include "diagnostics.h"
 
 #endif // CORE_H
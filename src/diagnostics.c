@@ -0,0 +1,505 @@
+/**
+ * @file		diagnostics.c
+ * @brief		In-situ diagnostics.
+ *
+ * Velocity histograms, coarse-grained moments, field spectra and probes
+ * computed while the simulation runs.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include "core.h"
+#include <math.h>
+#include <string.h>
+#include <mpi.h>
+#include <hdf5.h>
+#include "iniparser.h"
+
+/******************************************************************************
+ * LOCAL FUNCTION DECLARATIONS
+ *****************************************************************************/
+
+/**
+ * @brief	Queues a dataset to be created and written
+ * @param	file		H5-file
+ * @param	name		Name of dataset
+ * @param	rank		Rank of dataset
+ * @param	fileDims	Size of dataset
+ * @param	count		Size of the part written by this MPI node
+ * @param	offset		Offset of the part written by this MPI node
+ * @param	write		Whether this MPI node writes anything
+ * @param	val			Values to write (copied)
+ *
+ * Must be called by all MPI nodes.
+ */
+static void dSubmit(hid_t file, const char *name, int rank,
+					const hsize_t *fileDims, const hsize_t *count,
+					const hsize_t *offset, bool write, const double *val);
+
+static void dHistogram(Diagnostics *diag, const Population *pop, int s,
+					   const MpiInfo *mpiInfo, double n);
+static void dMoments(Diagnostics *diag, const Population *pop, int s,
+					 const Grid *E, double n);
+static void dSpectrum(Diagnostics *diag, const Grid *E, const MpiInfo *mpiInfo,
+					  double n);
+static void dProbes(Diagnostics *diag, const Grid *phi, const Grid *E,
+					const MpiInfo *mpiInfo, double n);
+
+/******************************************************************************
+ * GLOBAL FUNCTION DEFINITIONS
+ *****************************************************************************/
+
+Diagnostics *dAlloc(const dictionary *ini, const Units *units,
+					const MpiInfo *mpiInfo, hid_t history){
+
+	Diagnostics *diag = malloc(sizeof(*diag));
+	diag->interval = iniGetInt(ini,"diagnostics:interval");
+	if(!diag->interval) return diag;
+
+	int nDims = mpiInfo->nDims;
+	int nSpecies = mpiInfo->nSpecies;
+	int *subdomain = mpiInfo->subdomain;
+	int *trueSize = iniGetIntArr(ini,"grid:trueSize",nDims);
+	int *L = gGetGlobalSize(ini);
+
+	diag->nDims = nDims;
+	diag->nSpecies = nSpecies;
+	diag->history = history;
+
+	// Velocity histograms
+	diag->nBins = iniGetInt(ini,"diagnostics:velocityBins");
+	diag->maxVel = iniGetDouble(ini,"population:maxVel");
+	diag->histogram = malloc(nDims*diag->nBins*sizeof(*diag->histogram));
+
+	// Moments on coarse grid
+	int coarsening = iniGetInt(ini,"diagnostics:coarsening");
+	diag->coarsening = coarsening;
+	diag->coarseSize = malloc(nDims*sizeof(*diag->coarseSize));
+	diag->coarseOffset = malloc(nDims*sizeof(*diag->coarseOffset));
+	diag->coarseGlobalSize = malloc(nDims*sizeof(*diag->coarseGlobalSize));
+	diag->nCoarse = 1;
+	for(int d=0;d<nDims;d++){
+		if(coarsening<1 || trueSize[d]%coarsening)
+			msg(ERROR,"diagnostics:coarsening must divide grid:trueSize");
+		diag->coarseSize[d] = trueSize[d]/coarsening;
+		diag->coarseOffset[d] = subdomain[d]*diag->coarseSize[d];
+		diag->coarseGlobalSize[d] = L[d]/coarsening;
+		diag->nCoarse *= diag->coarseSize[d];
+	}
+	long int nCoarse = diag->nCoarse;
+	diag->count = malloc(nCoarse*sizeof(*diag->count));
+	diag->velSum = malloc(nDims*nCoarse*sizeof(*diag->velSum));
+	diag->velSqSum = malloc(nDims*nCoarse*sizeof(*diag->velSqSum));
+
+	// Fourier modes, tabulated for the nodes of this subdomain
+	int nModes = iniGetInt(ini,"diagnostics:nModes");
+	diag->nModes = malloc(nDims*sizeof(*diag->nModes));
+	diag->maxModes = 0;
+	int maxSize = 0;
+	for(int d=0;d<nDims;d++){
+		diag->nModes[d] = nModes<L[d]/2+1 ? nModes : L[d]/2+1;
+		if(diag->nModes[d]>diag->maxModes) diag->maxModes = diag->nModes[d];
+		if(trueSize[d]>maxSize) maxSize = trueSize[d];
+	}
+	int maxModes = diag->maxModes;
+	diag->modeCos = malloc(nDims*maxModes*maxSize*sizeof(*diag->modeCos));
+	diag->modeSin = malloc(nDims*maxModes*maxSize*sizeof(*diag->modeSin));
+	diag->modeSum = malloc(2*nDims*nDims*maxModes*sizeof(*diag->modeSum));
+	for(int d=0;d<nDims;d++){
+		for(int k=0;k<diag->nModes[d];k++){
+			for(int j=0;j<trueSize[d];j++){
+				double x = subdomain[d]*trueSize[d]+j;
+				double theta = 2*M_PI*k*x/L[d];
+				diag->modeCos[(d*maxModes+k)*maxSize+j] = cos(theta);
+				diag->modeSin[(d*maxModes+k)*maxSize+j] = sin(theta);
+			}
+		}
+	}
+
+	// Probes
+	char *probes = iniGetStr(ini,"diagnostics:probes");
+	if(!strcmp(probes,"none")){
+		diag->nProbes = 0;
+		diag->probes = NULL;
+	} else {
+		int nElements = iniGetNElements(ini,"diagnostics:probes");
+		if(nElements%nDims)
+			msg(ERROR,"diagnostics:probes needs %i elements per probe",nDims);
+		diag->nProbes = nElements/nDims;
+		diag->probes = iniGetIntArr(ini,"diagnostics:probes",nElements);
+		for(int i=0;i<nElements;i++){
+			int d = i%nDims;
+			if(diag->probes[i]<0 || diag->probes[i]>=L[d])
+				msg(ERROR,"diagnostics:probes has a node outside the domain");
+		}
+	}
+	free(probes);
+
+	char name[64];
+	for(int p=0;p<diag->nProbes;p++){
+
+		// Already there when restarting
+		sprintf(name,"/probe %i",p);
+		if(H5Lexists(history,name,H5P_DEFAULT)>0) continue;
+
+		sprintf(name,"/probe %i/phi",p);
+		xyCreateDataset(history,name);
+		for(int d=0;d<nDims;d++){
+			sprintf(name,"/probe %i/E/dim %i",p,d);
+			xyCreateDataset(history,name);
+		}
+	}
+
+	// Output file
+	hid_t file = openH5File(ini,"diagnostics","diag");
+	diag->h5 = file;
+
+	double range[] = {-diag->maxVel, diag->maxVel};
+	setH5Attr(file, "Velocity denormalization factor", &units->velocity, 1);
+	setH5Attr(file, "Energy denormalization factor", &units->energy, 1);
+	setH5Attr(file, "Velocity range", range, 2);
+
+	for(int s=0;s<nSpecies;s++){
+		sprintf(name,"/histogram/specie %i/",s);
+		createH5Group(file,name);
+		sprintf(name,"/density/specie %i/",s);
+		createH5Group(file,name);
+		sprintf(name,"/velocity/specie %i/",s);
+		createH5Group(file,name);
+		sprintf(name,"/temperature/specie %i/",s);
+		createH5Group(file,name);
+	}
+	for(int d=0;d<nDims;d++){
+		sprintf(name,"/spectrum/dim %i/",d);
+		createH5Group(file,name);
+	}
+
+	free(trueSize);
+	free(L);
+
+	return diag;
+}
+
+void dFree(Diagnostics *diag){
+
+	if(diag->interval){
+		h5AsyncWait();
+		H5Fclose(diag->h5);
+
+		free(diag->histogram);
+		free(diag->coarseSize);
+		free(diag->coarseOffset);
+		free(diag->coarseGlobalSize);
+		free(diag->count);
+		free(diag->velSum);
+		free(diag->velSqSum);
+		free(diag->nModes);
+		free(diag->modeCos);
+		free(diag->modeSin);
+		free(diag->modeSum);
+		free(diag->probes);
+	}
+
+	free(diag);
+}
+
+void dRun(Diagnostics *diag, const Population *pop, const Grid *phi,
+		  const Grid *E, const MpiInfo *mpiInfo, double n){
+
+	if(!diag->interval || (long int)n % diag->interval) return;
+
+	for(int s=0;s<diag->nSpecies;s++){
+		dHistogram(diag,pop,s,mpiInfo,n);
+		dMoments(diag,pop,s,E,n);
+	}
+
+	dSpectrum(diag,E,mpiInfo,n);
+	dProbes(diag,phi,E,mpiInfo,n);
+}
+
+/******************************************************************************
+ * LOCAL FUNCTION DEFINITIONS
+ *****************************************************************************/
+
+typedef struct{
+	hid_t file;
+	char name[64];
+	int rank;
+	hsize_t fileDims[4];
+	hsize_t count[4];
+	hsize_t offset[4];
+	bool write;
+	double *val;
+} DWriteJob;
+
+static void dWriteJob(void *data){
+
+	DWriteJob *job = (DWriteJob*)data;
+
+	hid_t fileSpace = H5Screate_simple(job->rank,job->fileDims,NULL);
+	hid_t memSpace = H5Screate_simple(job->rank,job->count,NULL);
+	if(job->write){
+		H5Sselect_hyperslab(fileSpace,H5S_SELECT_SET,job->offset,NULL,job->count,NULL);
+	} else {
+		H5Sselect_none(fileSpace);
+		H5Sselect_none(memSpace);
+	}
+
+	// Enable collective datawriting
+	hid_t pList = H5Pcreate(H5P_DATASET_XFER);
+	H5Pset_dxpl_mpio(pList, H5FD_MPIO_COLLECTIVE);
+
+	hid_t dataset = H5Dcreate(job->file,job->name,H5T_IEEE_F64LE,fileSpace,H5P_DEFAULT,H5P_DEFAULT,H5P_DEFAULT);
+	H5Dwrite(dataset, H5T_NATIVE_DOUBLE, memSpace, fileSpace, pList, job->val);
+
+	H5Dclose(dataset);
+	H5Pclose(pList);
+	H5Sclose(memSpace);
+	H5Sclose(fileSpace);
+
+	free(job->val);
+	free(job);
+}
+
+static void dSubmit(hid_t file, const char *name, int rank,
+					const hsize_t *fileDims, const hsize_t *count,
+					const hsize_t *offset, bool write, const double *val){
+
+	DWriteJob *job = malloc(sizeof(*job));
+	job->file = file;
+	strcpy(job->name,name);
+	job->rank = rank;
+	job->write = write;
+
+	long int size = 1;
+	for(int d=0;d<rank;d++){
+		job->fileDims[d] = fileDims[d];
+		job->count[d] = count[d];
+		job->offset[d] = offset[d];
+		size *= count[d];
+	}
+
+	job->val = malloc((size+1)*sizeof(*job->val));
+	if(write) memcpy(job->val,val,size*sizeof(*val));
+
+	h5AsyncSubmit(dWriteJob,job);
+}
+
+static void dHistogram(Diagnostics *diag, const Population *pop, int s,
+					   const MpiInfo *mpiInfo, double n){
+
+	int nDims = diag->nDims;
+	int nBins = diag->nBins;
+	double maxVel = diag->maxVel;
+	double *histogram = diag->histogram;
+	double binWidth = 2*maxVel/nBins;
+
+	for(int b=0;b<nDims*nBins;b++) histogram[b] = 0;
+
+	for(long int i=pop->iStart[s];i<pop->iStop[s];i++){
+		double *vel = &pop->vel[i*nDims];
+		for(int d=0;d<nDims;d++){
+			int b = (int)floor((vel[d]+maxVel)/binWidth);
+			if(b>=0 && b<nBins) histogram[d*nBins+b]++;
+		}
+	}
+
+	if(mpiInfo->mpiRank==0){
+		MPI_Reduce(MPI_IN_PLACE,histogram,nDims*nBins,MPI_DOUBLE,MPI_SUM,0,MPI_COMM_WORLD);
+	} else {
+		MPI_Reduce(histogram,histogram,nDims*nBins,MPI_DOUBLE,MPI_SUM,0,MPI_COMM_WORLD);
+	}
+
+	char name[64];
+	sprintf(name,"/histogram/specie %i/n=%.1f",s,n);
+	hsize_t dims[] = {nDims,nBins};
+	hsize_t offset[] = {0,0};
+	dSubmit(diag->h5,name,2,dims,dims,offset,mpiInfo->mpiRank==0,histogram);
+}
+
+static void dMoments(Diagnostics *diag, const Population *pop, int s,
+					 const Grid *E, double n){
+
+	int nDims = diag->nDims;
+	int coarsening = diag->coarsening;
+	int *coarseSize = diag->coarseSize;
+	long int nCoarse = diag->nCoarse;
+	double *count = diag->count;
+	double *velSum = diag->velSum;
+	double *velSqSum = diag->velSqSum;
+	int *nGhostLayers = E->nGhostLayers;
+
+	for(long int c=0;c<nCoarse;c++) count[c] = 0;
+	for(long int c=0;c<nDims*nCoarse;c++){
+		velSum[c] = 0;
+		velSqSum[c] = 0;
+	}
+
+	for(long int i=pop->iStart[s];i<pop->iStop[s];i++){
+
+		double *pos = &pop->pos[i*nDims];
+		double *vel = &pop->vel[i*nDims];
+
+		long int c = 0;
+		long int cProd = 1;
+		for(int d=0;d<nDims;d++){
+			int j = (int)(pos[d]-nGhostLayers[d+1])/coarsening;
+			if(j<0) j = 0;
+			if(j>=coarseSize[d]) j = coarseSize[d]-1;
+			c += j*cProd;
+			cProd *= coarseSize[d];
+		}
+
+		count[c]++;
+		for(int d=0;d<nDims;d++){
+			velSum[c*nDims+d] += vel[d];
+			velSqSum[c*nDims+d] += vel[d]*vel[d];
+		}
+	}
+
+	// Mean velocity replaces velSum, temperature the start of velSqSum (c is
+	// never ahead of c*nDims) and density replaces count.
+	double cellVolume = pow(coarsening,nDims);
+	double mass = pop->mass[s];
+	for(long int c=0;c<nCoarse;c++){
+		double N = count[c];
+		double temperature = 0;
+		for(int d=0;d<nDims;d++){
+			double mean = N ? velSum[c*nDims+d]/N : 0;
+			if(N) temperature += velSqSum[c*nDims+d]/N - mean*mean;
+			velSum[c*nDims+d] = mean;
+		}
+		velSqSum[c] = mass*temperature/nDims;
+		count[c] = N/cellVolume;
+	}
+
+	// HDF5 indices are reversed, and components come last, as for grids
+	hsize_t fileDims[4], dims[4], offset[4];
+	for(int d=0;d<nDims;d++){
+		fileDims[d] = diag->coarseGlobalSize[nDims-d-1];
+		dims[d] = coarseSize[nDims-d-1];
+		offset[d] = diag->coarseOffset[nDims-d-1];
+	}
+	fileDims[nDims] = nDims;
+	dims[nDims] = nDims;
+	offset[nDims] = 0;
+
+	char name[64];
+	sprintf(name,"/density/specie %i/n=%.1f",s,n);
+	dSubmit(diag->h5,name,nDims,fileDims,dims,offset,true,count);
+	sprintf(name,"/temperature/specie %i/n=%.1f",s,n);
+	dSubmit(diag->h5,name,nDims,fileDims,dims,offset,true,velSqSum);
+	sprintf(name,"/velocity/specie %i/n=%.1f",s,n);
+	dSubmit(diag->h5,name,nDims+1,fileDims,dims,offset,true,velSum);
+}
+
+static void dSpectrum(Diagnostics *diag, const Grid *E, const MpiInfo *mpiInfo,
+					  double n){
+
+	int nDims = diag->nDims;
+	int *nModes = diag->nModes;
+	int maxModes = diag->maxModes;
+	int *trueSize = E->trueSize;
+	int *nGhostLayers = E->nGhostLayers;
+	long int *sizeProd = E->sizeProd;
+	double *modeSum = diag->modeSum;
+	long int nSums = 2*nDims*nDims*maxModes;
+
+	int maxSize = 0;
+	long int nNodes = 1;
+	long int nGlobalNodes = 1;
+	for(int d=0;d<nDims;d++){
+		if(trueSize[d+1]>maxSize) maxSize = trueSize[d+1];
+		nNodes *= trueSize[d+1];
+		nGlobalNodes *= trueSize[d+1]*mpiInfo->nSubdomains[d];
+	}
+
+	for(long int i=0;i<nSums;i++) modeSum[i] = 0;
+
+	int *j = malloc(nDims*sizeof(*j));
+
+	for(long int node=0;node<nNodes;node++){
+
+		long int p = 0;
+		long int rest = node;
+		for(int d=0;d<nDims;d++){
+			j[d] = rest%trueSize[d+1];
+			rest /= trueSize[d+1];
+			p += (j[d]+nGhostLayers[d+1])*sizeProd[d+1];
+		}
+
+		const double *e = &E->val[p];
+		for(int d=0;d<nDims;d++){
+			for(int k=0;k<nModes[d];k++){
+				double c = diag->modeCos[(d*maxModes+k)*maxSize+j[d]];
+				double s = diag->modeSin[(d*maxModes+k)*maxSize+j[d]];
+				double *sum = &modeSum[2*nDims*(d*maxModes+k)];
+				for(int comp=0;comp<nDims;comp++){
+					sum[2*comp] += e[comp]*c;
+					sum[2*comp+1] -= e[comp]*s;
+				}
+			}
+		}
+	}
+
+	free(j);
+
+	if(mpiInfo->mpiRank==0){
+		MPI_Reduce(MPI_IN_PLACE,modeSum,nSums,MPI_DOUBLE,MPI_SUM,0,MPI_COMM_WORLD);
+	} else {
+		MPI_Reduce(modeSum,modeSum,nSums,MPI_DOUBLE,MPI_SUM,0,MPI_COMM_WORLD);
+	}
+
+	double *spectrum = malloc(maxModes*sizeof(*spectrum));
+
+	for(int d=0;d<nDims;d++){
+
+		for(int k=0;k<nModes[d];k++){
+			double *sum = &modeSum[2*nDims*(d*maxModes+k)];
+			spectrum[k] = 0;
+			for(int comp=0;comp<2*nDims;comp++)
+				spectrum[k] += pow(sum[comp]/nGlobalNodes,2);
+		}
+
+		char name[64];
+		sprintf(name,"/spectrum/dim %i/n=%.1f",d,n);
+		hsize_t dims[] = {nModes[d]};
+		hsize_t offset[] = {0};
+		dSubmit(diag->h5,name,1,dims,dims,offset,mpiInfo->mpiRank==0,spectrum);
+	}
+
+	free(spectrum);
+}
+
+static void dProbes(Diagnostics *diag, const Grid *phi, const Grid *E,
+					const MpiInfo *mpiInfo, double n){
+
+	int nDims = diag->nDims;
+	int *trueSize = phi->trueSize;
+	int *subdomain = mpiInfo->subdomain;
+	int *offset = mpiInfo->offset;
+
+	for(int p=0;p<diag->nProbes;p++){
+
+		// Only the node owning the probe contributes to the sum
+		int *probe = &diag->probes[p*nDims];
+		bool owner = true;
+		long int pPhi = 0;
+		long int pE = 0;
+		for(int d=0;d<nDims;d++){
+			int lower = subdomain[d]*trueSize[d+1];
+			if(probe[d]<lower || probe[d]>=lower+trueSize[d+1]) owner = false;
+			pPhi += (probe[d]-offset[d])*phi->sizeProd[d+1];
+			pE += (probe[d]-offset[d])*E->sizeProd[d+1];
+		}
+
+		char name[64];
+		sprintf(name,"/probe %i/phi",p);
+		xyWrite(diag->history,name,n,owner ? phi->val[pPhi] : 0,MPI_SUM);
+
+		for(int d=0;d<nDims;d++){
+			sprintf(name,"/probe %i/E/dim %i",p,d);
+			xyWrite(diag->history,name,n,owner ? E->val[pE+d] : 0,MPI_SUM);
+		}
+	}
+}
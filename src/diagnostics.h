@@ -0,0 +1,113 @@
+/**
+ * @file		diagnostics.h
+ * @brief		In-situ diagnostics.
+ *
+ * Core module for reduced quantities computed while the simulation runs, as a
+ * cheaper alternative to storing complete grids and populations.
+ */
+
+#ifndef DIAGNOSTICS_H
+#define DIAGNOSTICS_H
+
+/**
+ * @brief Settings and work arrays of the in-situ diagnostics
+ * @see dAlloc(), dRun()
+ */
+typedef struct{
+	int interval;			///< Time steps between diagnostics (0 for none)
+	hid_t h5;				///< HDF5 file handler of .diag.h5-file
+	hid_t history;			///< HDF5 file handler of .xy.h5-file for probes
+	int nDims;				///< Number of dimensions
+	int nSpecies;			///< Number of species
+
+	int nBins;				///< Bins in velocity histograms
+	double maxVel;			///< Histograms cover -maxVel to maxVel
+	double *histogram;		///< Velocity histogram (nDims*nBins elements)
+
+	int coarsening;			///< Nodes per coarse cell along each dimension
+	int *coarseSize;		///< Coarse cells in this subdomain (nDims elements)
+	int *coarseOffset;		///< Offset of these in the global coarse grid (nDims elements)
+	int *coarseGlobalSize;	///< Coarse cells in the whole domain (nDims elements)
+	long int nCoarse;		///< Coarse cells in this subdomain
+	double *count;			///< Particles per coarse cell (nCoarse elements)
+	double *velSum;			///< Sum of velocities (nDims*nCoarse elements)
+	double *velSqSum;		///< Sum of squared velocities (nDims*nCoarse elements)
+
+	int *nModes;			///< Fourier modes along each dimension (nDims elements)
+	int maxModes;			///< Largest element of nModes
+	double *modeCos;		///< cos(2*pi*k*j/L) along each dimension
+	double *modeSin;		///< sin(2*pi*k*j/L) along each dimension
+	double *modeSum;		///< Real and imaginary mode sums of all components
+
+	int nProbes;			///< Number of probes
+	int *probes;			///< Global node of each probe (nDims*nProbes elements)
+} Diagnostics;
+
+/**
+ * @brief	Allocates Diagnostics according to the "diagnostics" section
+ * @param	ini			Dictionary to input file
+ * @param	units		Units
+ * @param	mpiInfo		MpiInfo
+ * @param	history		.xy.h5-file to store probes in
+ * @return				Pointer to Diagnostics
+ * @see dRun()
+ *
+ * Nothing is allocated, and dRun() does nothing, if diagnostics:interval is
+ * zero. Otherwise a file whose name is as explained in openH5File() with
+ * fName "diagnostics" and fSubExt "diag" is opened, and datasets for the
+ * probes are created in history unless they exist from before (restart).
+ *
+ * The file has the attributes "Velocity denormalization factor", "Energy
+ * denormalization factor" and "Velocity range".
+ *
+ * Remember to free using dFree().
+ */
+Diagnostics *dAlloc(const dictionary *ini, const Units *units,
+					const MpiInfo *mpiInfo, hid_t history);
+
+/**
+ * @brief	Closes the .diag.h5-file and frees Diagnostics
+ * @param	diag	Diagnostics
+ * @return	void
+ */
+void dFree(Diagnostics *diag);
+
+/**
+ * @brief	Computes and stores the diagnostics of time step n
+ * @param	diag	Diagnostics
+ * @param	pop		Population
+ * @param	phi		Electric potential
+ * @param	E		Electric field
+ * @param	mpiInfo	MpiInfo
+ * @param	n		Time step
+ * @return	void
+ *
+ * Does nothing unless n is a multiple of diagnostics:interval. Otherwise the
+ * following is stored in the .diag.h5-file, with datasets named "n=<n>" as in
+ * .grid.h5-files:
+ *
+ *	- /histogram/specie <s>: Histogram of each velocity component (nDims x
+ *	  diagnostics:velocityBins), counting particles in equal bins between
+ *	  -population:maxVel and population:maxVel.
+ *	- /density/specie <s>, /velocity/specie <s> and /temperature/specie <s>:
+ *	  Particles per cell volume, mean velocity and temperature (kinetic energy
+ *	  of the thermal motion per degree of freedom) on a grid coarsened by
+ *	  diagnostics:coarsening along each dimension. The velocity has the
+ *	  components as the last dimension, as in .grid.h5-files.
+ *	- /spectrum/dim <d>: Energy of the Fourier modes 0, 1, ... of E along
+ *	  dimension d, averaged over the other dimensions. Mode k is
+ *	  sum_c |mean(E_c*exp(-2*pi*i*k*x_d/L_d))|^2. Up to diagnostics:nModes
+ *	  modes are stored.
+ *
+ * In addition phi and E at the nodes in diagnostics:probes are appended to the
+ * datasets "/probe <i>/phi" and "/probe <i>/E/dim <d>" in history.
+ *
+ * Only the small results are reduced across MPI nodes, and the moments are
+ * written in parallel without any reduction. The writes go through
+ * h5AsyncSubmit(). Call it when E is computed for step n, at which point the
+ * velocities are at step n+1/2.
+ */
+void dRun(Diagnostics *diag, const Population *pop, const Grid *phi,
+		  const Grid *E, const MpiInfo *mpiInfo, double n);
+
+#endif // DIAGNOSTICS_H
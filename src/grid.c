@@ -15,7 +15,8 @@
 #include <gsl/gsl_rng.h>
 #include <gsl/gsl_randist.h>
 
-
+#define TIME_CHUNK 256	// Time steps per chunk of /n in the series layout
+#define MAX_CHUNK_BYTES ((hsize_t)1<<31)	// HDF5 limits chunks to 4 GiB
 
 /******************************************************************************
  * LOCAL FUNCTION DECLARATIONS
@@ -333,6 +334,44 @@ void gFinDiff2nd3D(Grid *result, const  Grid *object){
  	return;
  }
 
+void gFinDiff4th3D(Grid *result, const  Grid *object){
+
+ 	// Load
+ 	int rank = object->rank;
+ 	long int *sizeProd = object->sizeProd;
+
+ 	double *resultVal = result->val;
+ 	double *objectVal = object->val;
+
+ 	long int sj = sizeProd[1];
+ 	long int sk = sizeProd[2];
+ 	long int sl = sizeProd[3];
+
+ 	// Index of first node having all 18 neighbours inside the array
+ 	long int g = sj + sk + sl;
+	long int end = sizeProd[rank] - 2*g;
+
+ 	// Compact (Mehrstellen) Laplacian
+ 	for(long int q = 0; q < end; q++){
+ 		double faces =	objectVal[g+sj] + objectVal[g-sj]
+ 						+objectVal[g+sk] + objectVal[g-sk]
+ 						+objectVal[g+sl] + objectVal[g-sl];
+
+ 		double edges =	objectVal[g+sj+sk] + objectVal[g+sj-sk]
+ 						+objectVal[g-sj+sk] + objectVal[g-sj-sk]
+ 						+objectVal[g+sj+sl] + objectVal[g+sj-sl]
+ 						+objectVal[g-sj+sl] + objectVal[g-sj-sl]
+ 						+objectVal[g+sk+sl] + objectVal[g+sk-sl]
+ 						+objectVal[g-sk+sl] + objectVal[g-sk-sl];
+
+ 		resultVal[g] = (2.*faces + edges - 24.*objectVal[g])/6.;
+
+ 		g++;
+ 	}
+
+ 	return;
+ }
+
 /******************************************************************************
  *	HALO FUNCTIONS
  *****************************************************************************/
@@ -357,16 +396,22 @@ void gHaloOpDim(funPtr sliceOp, Grid *grid, const MpiInfo *mpiInfo, int d, opDir
 	//Load
 	int rank = grid->rank;
 	int *size = grid->size;
+	int *nGhostLayers = grid->nGhostLayers;
 	long int *sizeProd = grid->sizeProd;
 	double *sendSlice = grid->sendSlice;
 	double *recvSlice = grid->recvSlice;
 
-	// dir=TOHALO=0: take 2nd outermost layer and place it outermost
-	// dir=FROMHALO=1: take outermost layer and place it 2nd outermost
-	int offsetUpperTake  = size[d]-2+dir;
-	int offsetUpperPlace = size[d]-1-dir;
-	int offsetLowerTake  =         1-dir;
-	int offsetLowerPlace =           dir;
+	// All ghost layers are exchanged in one message per direction.
+	// dir=TOHALO=0: take outermost true layers and place them in the halo
+	// dir=FROMHALO=1: take the halo and place it in the outermost true layers
+	int nLower = nGhostLayers[d];
+	int nUpper = nGhostLayers[d+rank];
+	int offsetUpperTake  = dir ? size[d]-nUpper : size[d]-nUpper-nLower;
+	int offsetUpperPlace = dir ? size[d]-nUpper-nLower : size[d]-nUpper;
+	int offsetLowerTake  = dir ? 0 : nLower;
+	int offsetLowerPlace = dir ? nLower : 0;
+	int nUpperLayers = dir ? nUpper : nLower;	// Layers sent upwards
+	int nLowerLayers = dir ? nLower : nUpper;	// Layers sent downwards
 
 	//Dimension used for subdomains, 1 less entry than grid dimensions
 	int dd = d - 1;
@@ -387,21 +432,25 @@ void gHaloOpDim(funPtr sliceOp, Grid *grid, const MpiInfo *mpiInfo, int d, opDir
 	// calls to gHaloOpDim(). I'm not quite sure why so this should be
 	// investigated further.
 
-	MPI_Barrier(MPI_COMM_WORLD);
+	MPI_Barrier(mpiInfo->comm);
 
 	// Send and recieve upper (tag 1)
-	getSlice(sendSlice, grid, d, offsetUpperTake);
-	MPI_Sendrecv(sendSlice, nSlicePoints, MPI_DOUBLE, upperSubdomain, 1,
-                 recvSlice, nSlicePoints, MPI_DOUBLE, lowerSubdomain, 1,
-                 MPI_COMM_WORLD, &status);
-	sliceOp(recvSlice, grid, d, offsetLowerPlace);
+	for(int i=0;i<nUpperLayers;i++)
+		getSlice(&sendSlice[i*nSlicePoints], grid, d, offsetUpperTake+i);
+	MPI_Sendrecv(sendSlice, nUpperLayers*nSlicePoints, MPI_DOUBLE, upperSubdomain, 1,
+                 recvSlice, nUpperLayers*nSlicePoints, MPI_DOUBLE, lowerSubdomain, 1,
+                 mpiInfo->comm, &status);
+	for(int i=0;i<nUpperLayers;i++)
+		sliceOp(&recvSlice[i*nSlicePoints], grid, d, offsetLowerPlace+i);
 
 	// Send and recieve lower (tag 0)
-	getSlice(sendSlice, grid, d, offsetLowerTake);
-	MPI_Sendrecv(sendSlice, nSlicePoints, MPI_DOUBLE, lowerSubdomain, 0,
-                 recvSlice, nSlicePoints, MPI_DOUBLE, upperSubdomain, 0,
-                 MPI_COMM_WORLD, &status);
-	sliceOp(recvSlice, grid, d, offsetUpperPlace);
+	for(int i=0;i<nLowerLayers;i++)
+		getSlice(&sendSlice[i*nSlicePoints], grid, d, offsetLowerTake+i);
+	MPI_Sendrecv(sendSlice, nLowerLayers*nSlicePoints, MPI_DOUBLE, lowerSubdomain, 0,
+                 recvSlice, nLowerLayers*nSlicePoints, MPI_DOUBLE, upperSubdomain, 0,
+                 mpiInfo->comm, &status);
+	for(int i=0;i<nLowerLayers;i++)
+		sliceOp(&recvSlice[i*nSlicePoints], grid, d, offsetUpperPlace+i);
 
 }
 
@@ -460,10 +509,12 @@ Grid *gAlloc(const dictionary *ini, int nValues){
 		if(nSlice>nSliceMax) nSliceMax = nSlice;
 	}
 
-	// Memory for values and a slice
+	// Memory for values and slices (all ghost layers of an edge at once)
+	int nLayersMax = aiMax(nGhostLayers,2*rank);
+	if(nLayersMax<1) nLayersMax = 1;
 	double *val = malloc(sizeProd[rank]*sizeof(*val));
-	double *sendSlice = malloc(nSliceMax*sizeof(*sendSlice));
-	double *recvSlice = malloc(nSliceMax*sizeof(*recvSlice));
+	double *sendSlice = malloc(nLayersMax*nSliceMax*sizeof(*sendSlice));
+	double *recvSlice = malloc(nLayersMax*nSliceMax*sizeof(*recvSlice));
 	double *bndSlice = malloc(2*rank*nSliceMax*sizeof(*bndSlice));
 	// Maybe seek a different solution where it is only stored where needed
 
@@ -535,6 +586,7 @@ MpiInfo *gAllocMpi(const dictionary *ini){
 	mpiInfo->posToSubdomain = posToSubdomain;
 	mpiInfo->mpiSize = mpiSize;
 	mpiInfo->mpiRank = mpiRank;
+	mpiInfo->comm = MPI_COMM_WORLD;
 
 	mpiInfo->nSpecies = nSpecies;
 	mpiInfo->nNeighbors = 0;	// Neighbourhood not created
@@ -741,8 +793,8 @@ void gNeutralizeGrid(Grid *grid, const MpiInfo *mpiInfo){
 					&nGhostLayers[2*rank-1],&trueSize[rank-1],&sizeProd[rank-1]);
 	double totCharge = 0;
 
-	MPI_Barrier(MPI_COMM_WORLD);
-	MPI_Allreduce(&myCharge, &totCharge, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+	MPI_Barrier(mpiInfo->comm);
+	MPI_Allreduce(&myCharge, &totCharge, 1, MPI_DOUBLE, MPI_SUM, mpiInfo->comm);
 
 	double avgCharge = totCharge/((double)aiProd(&trueSize[1] , rank-1)*mpiSize);
 
@@ -863,7 +915,7 @@ void gAssertNeutralGrid(const Grid *rho, const MpiInfo *mpiInfo){
 
 	double sum = gSumTruegrid(rho);
 	double totSum = 1.;
-	MPI_Allreduce(&sum, &totSum, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+	MPI_Allreduce(&sum, &totSum, 1, MPI_DOUBLE, MPI_SUM, mpiInfo->comm);
 
 	if( totSum < -0.001 || totSum > 0.001) msg(ERROR, "Total charge is %f", totSum);
 }
@@ -933,11 +985,12 @@ void gDirichlet(Grid *grid, const int boundary,  const  MpiInfo *mpiInfo){
 	//Load data
 	int rank = grid->rank;
 	int *size = grid->size;
+	int *nGhostLayers = grid->nGhostLayers;
 	double *bndSlice = grid->bndSlice;
 
 	//Compute dimensions and size of slice
 	int d = boundary%rank;
-	int offset = 1 + (boundary>rank)*(size[d]-2);
+	int offset = (boundary>rank) ? size[d]-nGhostLayers[boundary] : nGhostLayers[boundary];
 
 	//Number of elements in slice
 	long int nSliceMax = 0;
@@ -962,12 +1015,13 @@ void gNeumann(Grid *grid, const int boundary, const MpiInfo *mpiInfo){
 	//Load data
 	int rank = grid->rank;
 	int *size = grid->size;
+	int *nGhostLayers = grid->nGhostLayers;
 	double *bndSlice = grid->bndSlice;
 	double *slice = grid->sendSlice;
 
-	//Compute dimensions and slicesize
+	//Compute dimensions and slicesize (innermost ghost layer)
 	int d = boundary%rank;
-	int offset = (boundary>rank)*(size[d]-1);
+	int offset = (boundary>rank) ? size[d]-nGhostLayers[boundary] : nGhostLayers[boundary]-1;
 
 	//Number of elements in slice
 	long int nSliceMax = 0;
@@ -993,8 +1047,6 @@ void gBnd(Grid *grid, const MpiInfo *mpiInfo){
 
 	int rank = grid->rank;
 	bndType *bnd = grid->bnd;
-	int *subdomain = mpiInfo->subdomain;
-	int *nSubdomains = mpiInfo->nSubdomains;
 
 	//If periodic neutralize phi
 	int periodic = 0;
@@ -1003,6 +1055,18 @@ void gBnd(Grid *grid, const MpiInfo *mpiInfo){
 	}
 	if(periodic)	gPeriodic(grid, mpiInfo);
 
+	gBndEdges(grid, mpiInfo);
+
+	return;
+}
+
+void gBndEdges(Grid *grid, const MpiInfo *mpiInfo){
+
+	int rank = grid->rank;
+	bndType *bnd = grid->bnd;
+	int *subdomain = mpiInfo->subdomain;
+	int *nSubdomains = mpiInfo->nSubdomains;
+
 	//Lower edge
 	for(int d = 1; d < rank; d++){
 		if(subdomain[d-1] == 0){
@@ -1158,29 +1222,217 @@ void gDestroyNeighborhood(MpiInfo *mpiInfo){
  * H5 FUNCTIONS
  *****************************************************************************/
 
-void gWriteH5(const Grid *grid, const MpiInfo *mpiInfo, double n){
+/*
+ * Creates the memory and file space for writing every stride node of the true
+ * part of grid to its place in a global dataset. fileDims and count (rank
+ * elements) gets the size of the dataset and of the part of this subdomain,
+ * in HDF5 (reversed) order.
+ */
+static void gCreateH5Spaces(const Grid *grid, const MpiInfo *mpiInfo, int stride,
+							hid_t *memSpace, hid_t *fileSpace,
+							hsize_t *fileDims, hsize_t *count){
 
-	hid_t fileSpace = grid->h5FileSpace;
-	hid_t memSpace = grid->h5MemSpace;
-	hid_t file = grid->h5;
-	double *val = grid->val;
+	int rank = grid->rank;
+	int nDims = rank-1;
+	int *size = grid->size;
+	int *trueSize = grid->trueSize;
+	int	*nGhostLayers = grid->nGhostLayers;
+	int *nSubdomains = mpiInfo->nSubdomains;
+	int *subdomain = mpiInfo->subdomain;
 
-	// Enable collective datawriting
-	hid_t pList = H5Pcreate(H5P_DATASET_XFER);
-    H5Pset_dxpl_mpio(pList, H5FD_MPIO_COLLECTIVE);
+	hsize_t *memDims 	= malloc(rank*sizeof(*memDims));
+	hsize_t *memOffset 	= malloc(rank*sizeof(*memOffset));
+	hsize_t *fileOffset = malloc(rank*sizeof(*fileOffset));
+	hsize_t *memStride	= malloc(rank*sizeof(*memStride));
+
+	for(int d=0;d<rank;d++){
+		// HDF5 indices needs to be reversed compared to ours due to non-C ordering.
+		memDims[d]		= (hsize_t)size[rank-d-1];
+		memOffset[d]	= (hsize_t)nGhostLayers[rank-d-1];
+		memStride[d]	= (hsize_t)stride;
+		fileDims[d]		= (hsize_t)trueSize[rank-d-1]/stride*nSubdomains[rank-d-2];
+		fileOffset[d]	= (hsize_t)trueSize[rank-d-1]/stride*subdomain[rank-d-2];
+	}
+
+	fileDims[rank-1] = (hsize_t)trueSize[0];
+	fileOffset[rank-1] = (hsize_t)0.;
+	memStride[rank-1] = (hsize_t)1;
+
+	*memSpace = H5Screate_simple(rank,memDims,NULL);
+	for(int d=0;d<nDims;d++) count[d] = trueSize[rank-d-1]/stride;
+	count[rank-1] = trueSize[0];
+	H5Sselect_hyperslab(*memSpace,H5S_SELECT_SET,memOffset,memStride,count,NULL);
+
+	*fileSpace = H5Screate_simple(rank,fileDims,NULL);
+	H5Sselect_hyperslab(*fileSpace,H5S_SELECT_SET,fileOffset,NULL,count,NULL);
+
+	free(memDims);
+	free(memOffset);
+	free(fileOffset);
+	free(memStride);
+}
+
+/*
+ * Shrinks chunk (rank elements, HDF5 order) to at most MAX_CHUNK_BYTES. The
+ * slowest varying dimension not already 1 is divided by its smallest factor,
+ * so that the chunks still tile the subdomain.
+ */
+static void gLimitH5Chunk(int rank, hsize_t *chunk, size_t typeSize){
+
+	hsize_t bytes = typeSize;
+	for(int d=0;d<rank;d++) bytes *= chunk[d];
+
+	for(int d=0;d<rank && bytes>MAX_CHUNK_BYTES;){
+
+		if(chunk[d]==1){
+			d++;
+			continue;
+		}
+
+		hsize_t factor = 2;
+		while(chunk[d]%factor) factor++;
+		chunk[d] /= factor;
+		bytes /= factor;
+	}
+}
 
+typedef struct{
+	hid_t file;
+	hid_t memSpace;
+	hid_t fileSpace;
+	hid_t createProp;
+	hid_t type;
 	char name[64];
-	sprintf(name,"/n=%.1f",n);
+	double n;
+	double *val;
+	bool staged;		// val is a copy to be freed after writing
+	bool series;		// Append to /values instead of creating a dataset
+} GWriteJob;
+
+/*
+ * Selects the part of step i of /values (or /n if fileSpace is negative)
+ * belonging to this subdomain. Only MPI rank 0 writes to /n.
+ */
+static hid_t gSelectSeriesStep(hid_t dataset, hid_t fileSpace, hsize_t i){
 
-	hid_t dataset = H5Dcreate(file,name,H5T_IEEE_F64LE,fileSpace,H5P_DEFAULT,H5P_DEFAULT,H5P_DEFAULT);
-	H5Dwrite(dataset, H5T_NATIVE_DOUBLE, memSpace, fileSpace, pList, val);
+	hid_t space = H5Dget_space(dataset);
+	int rank = H5Sget_simple_extent_ndims(space);
 
+	hsize_t *start = malloc(rank*sizeof(*start));
+	hsize_t *count = malloc(rank*sizeof(*count));
+	start[0] = i;
+	count[0] = 1;
+
+	if(fileSpace<0){
+		int mpiRank;
+		MPI_Comm_rank(MPI_COMM_WORLD,&mpiRank);
+		if(mpiRank==0) H5Sselect_hyperslab(space,H5S_SELECT_SET,start,NULL,count,NULL);
+		else H5Sselect_none(space);
+	} else {
+		hsize_t *end = malloc(rank*sizeof(*end));
+		H5Sget_select_bounds(fileSpace,&start[1],&end[1]);
+		for(int d=1;d<rank;d++) count[d] = end[d]-start[d]+1;
+		H5Sselect_hyperslab(space,H5S_SELECT_SET,start,NULL,count,NULL);
+		free(end);
+	}
+
+	free(start);
+	free(count);
+
+	return space;
+}
+
+// Appends one step to /values and /n
+static void gWriteH5Series(GWriteJob *job, hid_t pList){
+
+	hid_t dataset = H5Dopen(job->file,"/values",H5P_DEFAULT);
+	hid_t times = H5Dopen(job->file,"/n",H5P_DEFAULT);
+
+	// Extend by one step (must be done on all MPI nodes)
+	hid_t space = H5Dget_space(times);
+	hsize_t nSteps;
+	H5Sget_simple_extent_dims(space,&nSteps,NULL);
+	H5Sclose(space);
+	nSteps++;
+	H5Dset_extent(times,&nSteps);
+
+	space = H5Dget_space(dataset);
+	int rank = H5Sget_simple_extent_ndims(space);
+	hsize_t *dims = malloc(rank*sizeof(*dims));
+	H5Sget_simple_extent_dims(space,dims,NULL);
+	H5Sclose(space);
+	dims[0] = nSteps;
+	H5Dset_extent(dataset,dims);
+	free(dims);
+
+	space = gSelectSeriesStep(dataset,job->fileSpace,nSteps-1);
+	H5Dwrite(dataset, H5T_NATIVE_DOUBLE, job->memSpace, space, pList, job->val);
+	H5Sclose(space);
+
+	hsize_t one = 1;
+	hid_t memSpace = H5Screate_simple(1,&one,NULL);
+	space = gSelectSeriesStep(times,-1,nSteps-1);
+	if(H5Sget_select_npoints(space)==0) H5Sselect_none(memSpace);
+	H5Dwrite(times, H5T_NATIVE_DOUBLE, memSpace, space, pList, &job->n);
+	H5Sclose(space);
+	H5Sclose(memSpace);
+
+	H5Dclose(times);
 	H5Dclose(dataset);
+}
+
+static void gWriteH5Job(void *data){
+
+	GWriteJob *job = (GWriteJob*)data;
+
+	// Enable collective datawriting
+	hid_t pList = H5Pcreate(H5P_DATASET_XFER);
+    H5Pset_dxpl_mpio(pList, H5FD_MPIO_COLLECTIVE);
+
+	if(job->series){
+		gWriteH5Series(job,pList);
+	} else {
+		hid_t dataset = H5Dcreate(job->file,job->name,job->type,job->fileSpace,H5P_DEFAULT,job->createProp,H5P_DEFAULT);
+		H5Dwrite(dataset, H5T_NATIVE_DOUBLE, job->memSpace, job->fileSpace, pList, job->val);
+		H5Dclose(dataset);
+	}
+
 	H5Pclose(pList);
+
+	if(job->staged) free(job->val);
+	free(job);
+}
+
+void gWriteH5(const Grid *grid, const MpiInfo *mpiInfo, double n){
+
+	if((long int)n % grid->h5Interval) return;
+
+	GWriteJob *job = malloc(sizeof(*job));
+	job->file = grid->h5;
+	job->memSpace = grid->h5MemSpace;
+	job->fileSpace = grid->h5FileSpace;
+	job->createProp = grid->h5CreateProp;
+	job->type = grid->h5Type;
+	job->val = grid->val;
+	job->staged = h5AsyncActive();
+	job->series = grid->h5Series;
+	job->n = n;
+	sprintf(job->name,"/n=%.1f",n);
+
+	// Snapshot the values so the simulation may continue while writing
+	if(job->staged){
+		long int nElements = grid->sizeProd[grid->rank];
+		job->val = malloc(nElements*sizeof(*job->val));
+		memcpy(job->val,grid->val,nElements*sizeof(*job->val));
+	}
+
+	h5AsyncSubmit(gWriteH5Job,job);
 }
 
 void gReadH5(Grid *grid, const MpiInfo *mpiInfo, double n){
 
+	h5AsyncWait();
+
 	hid_t fileSpace = grid->h5FileSpace;
 	hid_t memSpace = grid->h5MemSpace;
 	hid_t file = grid->h5;
@@ -1190,33 +1442,167 @@ void gReadH5(Grid *grid, const MpiInfo *mpiInfo, double n){
 	hid_t pList = H5Pcreate(H5P_DATASET_XFER);
     H5Pset_dxpl_mpio(pList, H5FD_MPIO_COLLECTIVE);
 
-	char name[64];
-	sprintf(name,"/n=%.1f",n);
+	if(grid->h5Series){
 
-	hid_t dataset = H5Dopen(file,name,H5P_DEFAULT);
-	H5Dread(dataset, H5T_NATIVE_DOUBLE, memSpace, fileSpace, pList, val);
+		// Look up the step in the time index
+		hid_t times = H5Dopen(file,"/n",H5P_DEFAULT);
+		hid_t space = H5Dget_space(times);
+		hsize_t nSteps;
+		H5Sget_simple_extent_dims(space,&nSteps,NULL);
+		H5Sclose(space);
+
+		double *steps = malloc((nSteps+1)*sizeof(*steps));
+		H5Dread(times, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, steps);
+		H5Dclose(times);
+
+		hsize_t i = 0;
+		while(i<nSteps && fabs(steps[i]-n)>0.01) i++;
+		free(steps);
+		if(i==nSteps) msg(ERROR,"Time step %.1f not found in .h5-file",n);
+
+		hid_t dataset = H5Dopen(file,"/values",H5P_DEFAULT);
+		space = gSelectSeriesStep(dataset,fileSpace,i);
+		H5Dread(dataset, H5T_NATIVE_DOUBLE, memSpace, space, pList, val);
+		H5Sclose(space);
+		H5Dclose(dataset);
+
+	} else {
+
+		char name[64];
+		sprintf(name,"/n=%.1f",n);
+
+		hid_t dataset = H5Dopen(file,name,H5P_DEFAULT);
+		H5Dread(dataset, H5T_NATIVE_DOUBLE, memSpace, fileSpace, pList, val);
+		H5Dclose(dataset);
+	}
 
-	H5Dclose(dataset);
 	H5Pclose(pList);
 
 }
 
 void gCloseH5(Grid *grid){
+	h5AsyncWait();
 	H5Sclose(grid->h5MemSpace);
 	H5Sclose(grid->h5FileSpace);
+	H5Pclose(grid->h5CreateProp);
 	H5Fclose(grid->h5);
 }
 
+void gTruncateH5(const Grid *grid, double n){
+
+	if(!grid->h5Series){
+		truncateH5(grid->h5,n);
+		return;
+	}
+
+	h5AsyncWait();
+
+	hid_t dataset = H5Dopen(grid->h5,"/values",H5P_DEFAULT);
+	hid_t times = H5Dopen(grid->h5,"/n",H5P_DEFAULT);
+
+	hid_t space = H5Dget_space(times);
+	hsize_t nSteps;
+	H5Sget_simple_extent_dims(space,&nSteps,NULL);
+	H5Sclose(space);
+
+	double *steps = malloc((nSteps+1)*sizeof(*steps));
+	H5Dread(times, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, steps);
+
+	// Keep the outputs up to the first one after n
+	hsize_t nKeep = 0;
+	while(nKeep<nSteps && steps[nKeep]<=n) nKeep++;
+	free(steps);
+
+	if(nKeep<nSteps){
+		H5Dset_extent(times,&nKeep);
+
+		space = H5Dget_space(dataset);
+		int rank = H5Sget_simple_extent_ndims(space);
+		hsize_t *dims = malloc(rank*sizeof(*dims));
+		H5Sget_simple_extent_dims(space,dims,NULL);
+		H5Sclose(space);
+		dims[0] = nKeep;
+		H5Dset_extent(dataset,dims);
+		free(dims);
+	}
+
+	H5Dclose(times);
+	H5Dclose(dataset);
+}
+
+void gWriteCheckpoint(const Grid *grid, const MpiInfo *mpiInfo, hid_t file,
+					  const char *name){
+
+	hsize_t *fileDims = malloc(grid->rank*sizeof(*fileDims));
+	hsize_t *count = malloc(grid->rank*sizeof(*count));
+	hid_t memSpace, fileSpace;
+	gCreateH5Spaces(grid,mpiInfo,1,&memSpace,&fileSpace,fileDims,count);
+
+	hid_t pList = H5Pcreate(H5P_DATASET_XFER);
+	H5Pset_dxpl_mpio(pList, H5FD_MPIO_COLLECTIVE);
+
+	hid_t dataset = H5Dcreate(file,name,H5T_IEEE_F64LE,fileSpace,H5P_DEFAULT,H5P_DEFAULT,H5P_DEFAULT);
+	H5Dwrite(dataset, H5T_NATIVE_DOUBLE, memSpace, fileSpace, pList, grid->val);
+
+	H5Dclose(dataset);
+	H5Pclose(pList);
+	H5Sclose(memSpace);
+	H5Sclose(fileSpace);
+	free(fileDims);
+	free(count);
+}
+
+void gReadCheckpoint(Grid *grid, const MpiInfo *mpiInfo, hid_t file,
+					 const char *name){
+
+	hsize_t *fileDims = malloc(grid->rank*sizeof(*fileDims));
+	hsize_t *count = malloc(grid->rank*sizeof(*count));
+	hid_t memSpace, fileSpace;
+	gCreateH5Spaces(grid,mpiInfo,1,&memSpace,&fileSpace,fileDims,count);
+
+	hid_t dataset = H5Dopen(file,name,H5P_DEFAULT);
+
+	// The global grid must be the same, but not the decomposition
+	hid_t space = H5Dget_space(dataset);
+	hsize_t *dims = malloc(grid->rank*sizeof(*dims));
+	if(H5Sget_simple_extent_ndims(space)!=grid->rank)
+		msg(ERROR,"Dataset %s does not match the grid",name);
+	H5Sget_simple_extent_dims(space,dims,NULL);
+	for(int d=0;d<grid->rank;d++){
+		if(dims[d]!=fileDims[d]) msg(ERROR,"Dataset %s does not match the grid",name);
+	}
+	H5Sclose(space);
+	free(dims);
+
+	hid_t pList = H5Pcreate(H5P_DATASET_XFER);
+	H5Pset_dxpl_mpio(pList, H5FD_MPIO_COLLECTIVE);
+
+	H5Dread(dataset, H5T_NATIVE_DOUBLE, memSpace, fileSpace, pList, grid->val);
+
+	H5Dclose(dataset);
+	H5Pclose(pList);
+	H5Sclose(memSpace);
+	H5Sclose(fileSpace);
+	free(fileDims);
+	free(count);
+
+	gHaloOp(setSlice, grid, mpiInfo, TOHALO);
+}
+
 void gOpenH5(const dictionary *ini, Grid *grid, const MpiInfo *mpiInfo,
 			 const Units *units, double denorm, const char *fName){
 
 	int rank = grid->rank;
-	int nDims = rank-1;
-	int *size = grid->size;
 	int *trueSize = grid->trueSize;
-	int	*nGhostLayers = grid->nGhostLayers;
-	int *nSubdomains = mpiInfo->nSubdomains;
-	int *subdomain = mpiInfo->subdomain;
+
+	int interval, stride, deflate;
+	getH5Output(ini,fName,&interval,&stride);
+	hid_t type = getH5Compression(ini,fName,&deflate);
+
+	for(int d=1;d<rank;d++){
+		if(trueSize[d]%stride)
+			msg(ERROR,"Output stride of '%s' must divide the subdomain size",fName);
+	}
 
 	/*
 	 * CREATE FILE
@@ -1228,7 +1614,9 @@ void gOpenH5(const dictionary *ini, Grid *grid, const MpiInfo *mpiInfo,
 	 * CREATE ATTRIBUTES
 	 */
 
-	setH5Attr(file,"Axis denormalization factor",&units->length,1);
+	// The stride increases the node spacing in the file
+	double axisDenorm = units->length*stride;
+	setH5Attr(file,"Axis denormalization factor",&axisDenorm,1);
 	setH5Attr(file,"Quantity denormalization factor",&denorm,1);
 
 	/*
@@ -1237,35 +1625,79 @@ void gOpenH5(const dictionary *ini, Grid *grid, const MpiInfo *mpiInfo,
 
 	hsize_t *fileDims 	= malloc(rank*sizeof(*fileDims));
 	hsize_t *memDims 	= malloc(rank*sizeof(*memDims));
-	hsize_t *memOffset 	= malloc(rank*sizeof(*memOffset));
-	hsize_t *fileOffset = malloc(rank*sizeof(*fileOffset));
-
-	for(int d=0;d<rank;d++){
-		// HDF5 indices needs to be reversed compared to ours due to non-C ordering.
-		memDims[d]		= (hsize_t)size[rank-d-1];
-		memOffset[d]	= (hsize_t)nGhostLayers[rank-d-1];
-		fileDims[d]		= (hsize_t)trueSize[rank-d-1]*nSubdomains[rank-d-2];
-		fileOffset[d]	= (hsize_t)trueSize[rank-d-1]*subdomain[rank-d-2];
+	hid_t memSpace, fileSpace;
+	gCreateH5Spaces(grid,mpiInfo,stride,&memSpace,&fileSpace,fileDims,memDims);
+
+	// Compressed datasets need chunks, at most one per subdomain
+	hid_t createProp;
+	size_t typeSize = H5Tget_size(type);
+	if(deflate){
+		hsize_t *chunk = malloc(rank*sizeof(*chunk));
+		for(int d=0;d<rank;d++) chunk[d] = memDims[d];
+		gLimitH5Chunk(rank,chunk,typeSize);
+		createProp = createH5Chunked(rank,chunk,deflate);
+		free(chunk);
+	} else {
+		createProp = H5Pcreate(H5P_DATASET_CREATE);
 	}
 
-	fileDims[rank-1] = (hsize_t)trueSize[0];
-	fileOffset[rank-1] = (hsize_t)0.;
+	/*
+	 * TIME SERIES LAYOUT
+	 */
 
-	hid_t memSpace = H5Screate_simple(rank,memDims,NULL);
-	for(int d=0;d<nDims;d++) memDims[d] = trueSize[rank-d-1];
-	H5Sselect_hyperslab(memSpace,H5S_SELECT_SET,memOffset,NULL,memDims,NULL);
+	char *layout = iniGetStr(ini,"files:layout");
+	bool series = !strcmp(layout,"series");
+	if(!series && strcmp(layout,"steps"))
+		msg(ERROR,"files:layout = %s is not a valid option",layout);
+	free(layout);
 
-	hid_t fileSpace = H5Screate_simple(rank,fileDims,NULL);
-	H5Sselect_hyperslab(fileSpace,H5S_SELECT_SET,fileOffset,NULL,memDims,NULL);
+	if(series && !H5Lexists(file,"/values",H5P_DEFAULT)){
+
+		hsize_t *seriesDims = malloc((rank+1)*sizeof(*seriesDims));
+		hsize_t *seriesDimsMax = malloc((rank+1)*sizeof(*seriesDimsMax));
+		hsize_t *seriesChunk = malloc((rank+1)*sizeof(*seriesChunk));
+		seriesDims[0] = 0;
+		seriesDimsMax[0] = H5S_UNLIMITED;
+		seriesChunk[0] = 1;
+		for(int d=0;d<rank;d++){
+			seriesDims[d+1] = fileDims[d];
+			seriesDimsMax[d+1] = fileDims[d];
+			seriesChunk[d+1] = memDims[d];
+		}
+		gLimitH5Chunk(rank+1,seriesChunk,typeSize);
+
+		hid_t seriesProp = createH5Chunked(rank+1,seriesChunk,deflate);
+		hid_t space = H5Screate_simple(rank+1,seriesDims,seriesDimsMax);
+		hid_t dataset = H5Dcreate(file,"/values",type,space,H5P_DEFAULT,seriesProp,H5P_DEFAULT);
+		H5Dclose(dataset);
+		H5Sclose(space);
+		H5Pclose(seriesProp);
+
+		hsize_t timeChunk = TIME_CHUNK;
+		hsize_t timeMax = H5S_UNLIMITED;
+		seriesProp = createH5Chunked(1,&timeChunk,0);
+		space = H5Screate_simple(1,seriesDims,&timeMax);
+		dataset = H5Dcreate(file,"/n",H5T_IEEE_F64LE,space,H5P_DEFAULT,seriesProp,H5P_DEFAULT);
+		H5Dclose(dataset);
+		H5Sclose(space);
+		H5Pclose(seriesProp);
+
+		free(seriesDims);
+		free(seriesDimsMax);
+		free(seriesChunk);
+	}
 
 	free(fileDims);
 	free(memDims);
-	free(memOffset);
-	free(fileOffset);
 
 	grid->h5 = file;
 	grid->h5MemSpace = memSpace;
 	grid->h5FileSpace = fileSpace;
+	grid->h5Interval = interval;
+	grid->h5Stride = stride;
+	grid->h5CreateProp = createProp;
+	grid->h5Type = type;
+	grid->h5Series = series;
 
 }
 
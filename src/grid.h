@@ -134,7 +134,9 @@ void gFreeMpi(MpiInfo *mpiInfo);
  * If needed it should be quick to facilitate for more slice operations, in
  * addition to set and add.
  *
- * NB! Only works with 1 ghost layer.
+ * With more than 1 ghost layer all layers are exchanged, packed into a single
+ * message per direction. The subdomains must have at least as many true
+ * layers as ghost layers.
  * @see gHaloOp
  */
 void gHaloOpDim(funPtr sliceOp, Grid *grid, const MpiInfo *mpiInfo, int d, opDirection dir);
@@ -149,7 +151,8 @@ void gHaloOpDim(funPtr sliceOp, Grid *grid, const MpiInfo *mpiInfo, int d, opDir
  * A wrapper to the gHaloOpDim function, that is used when the user wants the
  * interaction in all the dimensions.
  *
- * NB! Only works with 1 ghost layer.
+ * Since the dimensions are exchanged one after another, including the halos of
+ * the previous dimensions, edges and corners of the halo are also filled.
  * @see gExchangeSlice
  * @see gHaloOpDim
  */
@@ -333,6 +336,17 @@ void gFinDiff2nd3D(Grid *phi,const Grid *rho);
  */
 void gFinDiff2ndND(Grid *phi,const Grid *rho);
 
+/**
+ * @brief Computes the 19-point compact (Mehrstellen) Laplacian on a 3D grid
+ * @param 	rho 	Value to do the finite differencing on
+ * @return	phi		Field returned after derivating
+ *
+ * (2*faces + edges - 24*center)/6, in units of the grid spacing. It is only
+ * fourth order accurate when the source it is equated to is transformed as
+ * rho + nabla^2 rho/12, see mgSolveRaw().
+ */
+void gFinDiff4th3D(Grid *phi,const Grid *rho);
+
  /**
  * @brief Normalize E-field
  * @param	ini		Input file dictionary
@@ -401,6 +415,19 @@ void gAssertNeutralGrid(const Grid *rho, const MpiInfo *mpiInfo);
  */
 void gBnd(Grid *grid, const MpiInfo *mpiInfo);
 
+/**
+ * @brief Applies Dirichlet and Neumann boundary conditions to edge
+ * @param 	grid		Grid to apply boundary conditions to
+ * @param	mpiInfo		Info about subdomain
+ *
+ * @return 	grid		Returns grid with changed boundary
+ *
+ * Same as gBnd() except that periodic boundaries are not neutralized. Unlike
+ * gBnd() it therefore involves no communication, and can be used in between
+ * halo exchanges.
+ */
+void gBndEdges(Grid *grid, const MpiInfo *mpiInfo);
+
 /**
  * @brief	Assign particles artificial positions suitable for debugging
  * @param			ini				Input file dictionary
@@ -446,6 +473,22 @@ void gValDebug(Grid *grid, const MpiInfo *mpiInfo);
  * denormalization factor", physical coordinates are obtained. "Axis
  * denormalization facotr" is basically the same as the step size in physical
  * units.
+ *
+ * How often the quantity is written, and whether only every stride node is
+ * written, is read from the "files" section by getH5Output(). The stride must
+ * divide the number of true nodes of the subdomain along each dimension. The
+ * "Axis denormalization factor" accounts for the stride.
+ *
+ * The datasets are compressed or stored in single precision as set by
+ * getH5Compression(). Uncompressed datasets are contiguous, whereas compressed
+ * ones are chunked with one chunk per subdomain, split further where needed
+ * to keep chunks below the 4 GiB limit of HDF5.
+ *
+ * With "files:layout = series" the file instead has a single extendible
+ * dataset "/values" where the first index is the output number, and a
+ * dataset "/n" holding the timestep of each output. This keeps the number of
+ * HDF5 objects constant and lets a time series be read contiguously. Being
+ * extendible, "/values" is always chunked as above, one output per chunk.
  */
 void gOpenH5(const dictionary *ini, Grid *grid, const MpiInfo *mpiInfo,
 			 const Units *units, double denorm, const char *fName);
@@ -462,6 +505,10 @@ void gOpenH5(const dictionary *ini, Grid *grid, const MpiInfo *mpiInfo,
  *
  * The function will fail ungracefully if trying to write to an existing
  * dataset (testing omitted for performance reasons).
+ *
+ * Nothing is written unless n is a multiple of the output interval set up by
+ * gOpenH5(). In the series layout the step is appended to "/values" and n to
+ * "/n".
  */
 void gWriteH5(const Grid *grid, const MpiInfo *mpiInfo, double n);
 
@@ -476,7 +523,8 @@ void gWriteH5(const Grid *grid, const MpiInfo *mpiInfo, double n);
  * (e.g. leapfrog). All but the most significant decimals are discarded.
  *
  * The function will fail ungracefully if trying to read from a non-existing
- * dataset (testing omitted for performance reasons).
+ * dataset (testing omitted for performance reasons). In the series layout the
+ * step is looked up in "/n", and it is an error if it is not there.
  */
 void gReadH5(Grid *grid, const MpiInfo *mpiInfo, double n);
 
@@ -487,6 +535,49 @@ void gReadH5(Grid *grid, const MpiInfo *mpiInfo, double n);
  */
 void gCloseH5(Grid *grid);
 
+/**
+ * @brief	Removes the output after time step n from .grid.h5-file
+ * @param	grid		Grid
+ * @param	n			Last time step to keep
+ * @return	void
+ * @see truncateH5()
+ *
+ * Used when restarting from a checkpoint at time step n, so that the steps
+ * after it can be written again. With "files:layout = steps" the datasets
+ * are removed, and with "files:layout = series" "/values" and "/n" are
+ * shrunk.
+ */
+void gTruncateH5(const Grid *grid, double n);
+
+/**
+ * @brief	Stores the true values of a Grid in a checkpoint file
+ * @param	grid			Grid
+ * @param	mpiInfo			MpiInfo
+ * @param	file			Open .h5-file
+ * @param	name			Dataset name
+ * @return	void
+ *
+ * Writes the global grid as one uncompressed double precision dataset,
+ * independent of the output settings in the "files" section.
+ */
+void gWriteCheckpoint(const Grid *grid, const MpiInfo *mpiInfo, hid_t file,
+					  const char *name);
+
+/**
+ * @brief	Reads a Grid stored by gWriteCheckpoint()
+ * @param	grid			Grid
+ * @param	mpiInfo			MpiInfo
+ * @param	file			Open .h5-file
+ * @param	name			Dataset name
+ * @return	void
+ *
+ * The global grid must have the same size, but may be decomposed into a
+ * different number of subdomains. Ghost layers are filled from the
+ * neighbours.
+ */
+void gReadCheckpoint(Grid *grid, const MpiInfo *mpiInfo, hid_t file,
+					 const char *name);
+
 /**
  * @brief Creates a neighborhood in MpiInfo
  * @param			ini		Dictionary to input file
@@ -22,6 +22,7 @@
 #include <math.h>
 #include <mpi.h>
 #include <hdf5.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include "iniparser.h"
@@ -563,7 +564,7 @@ void iniApplySuffix(dictionary *ini, const char *key,
  * DEFINING HDF5 FUNCTIONS (expanding HDF5 API)
  *****************************************************************************/
 
-hid_t openH5File(const dictionary *ini, const char *fName, const char *fSubExt){
+char *getH5FileName(const dictionary *ini, const char *fName, const char *fSubExt){
 
 	// Determine filename
 	char *fPrefix = iniGetStr(ini,"files:output");
@@ -576,6 +577,39 @@ hid_t openH5File(const dictionary *ini, const char *fName, const char *fSubExt){
 
 	char *fTotName = strCatAlloc(6,fPrefix,sep,fName,".",fSubExt,".h5");
 
+	free(fPrefix);
+
+	return fTotName;
+}
+
+hid_t createH5File(const dictionary *ini, const char *fName, const char *fSubExt){
+
+	h5AsyncWait();
+
+	char *fTotName = getH5FileName(ini,fName,fSubExt);
+
+	// Enable MPI-I/O access
+	hid_t pList = H5Pcreate(H5P_FILE_ACCESS);
+	H5Pset_fapl_mpio(pList,MPI_COMM_WORLD,MPI_INFO_NULL);
+
+	// Make sure parent folder exist
+	if(makePath(fTotName))
+		msg(ERROR,"Could not open or create folder for '%s'.",fTotName);
+
+	hid_t file = H5Fcreate(fTotName,H5F_ACC_TRUNC,H5P_DEFAULT,pList);
+
+	H5Pclose(pList);
+	free(fTotName);
+
+	return file;
+}
+
+hid_t openH5File(const dictionary *ini, const char *fName, const char *fSubExt){
+
+	h5AsyncWait();
+
+	char *fTotName = getH5FileName(ini,fName,fSubExt);
+
 	// Enable MPI-I/O access
 	hid_t pList = H5Pcreate(H5P_FILE_ACCESS);
 	H5Pset_fapl_mpio(pList,MPI_COMM_WORLD,MPI_INFO_NULL);
@@ -596,13 +630,86 @@ hid_t openH5File(const dictionary *ini, const char *fName, const char *fSubExt){
 	}
 
 	H5Pclose(pList);
-	free(fPrefix);
 	free(fTotName);
 
 	return file;
 
 }
 
+void getH5Output(const dictionary *ini, const char *fName, int *interval, int *stride){
+
+	int nQuantities = iniGetNElements(ini,"files:quantities");
+	char **quantities = iniGetStrArr(ini,"files:quantities",nQuantities);
+	int *intervals = iniGetIntArr(ini,"files:intervals",nQuantities);
+	int *strides = iniGetIntArr(ini,"files:strides",nQuantities);
+
+	*interval = 1;
+	*stride = 1;
+	for(int i=0;i<nQuantities;i++){
+		if(!strcmp(quantities[i],fName)){
+			*interval = intervals[i];
+			*stride = strides[i];
+		}
+	}
+
+	if(*interval<1 || *stride<1)
+		msg(ERROR,"Output interval and stride of '%s' must be positive",fName);
+
+	freeStrArr(quantities);
+	free(intervals);
+	free(strides);
+
+}
+
+hid_t getH5Compression(const dictionary *ini, const char *fName, int *deflate){
+
+	int nQuantities = iniGetNElements(ini,"files:quantities");
+	char **quantities = iniGetStrArr(ini,"files:quantities",nQuantities);
+	int *deflates = iniGetIntArr(ini,"files:deflate",nQuantities);
+	char **precisions = iniGetStrArr(ini,"files:precision",nQuantities);
+
+	*deflate = 0;
+	hid_t type = H5T_IEEE_F64LE;
+	for(int i=0;i<nQuantities;i++){
+		if(!strcmp(quantities[i],fName)){
+			*deflate = deflates[i];
+			if(!strcmp(precisions[i],"float")) type = H5T_IEEE_F32LE;
+			else if(strcmp(precisions[i],"double"))
+				msg(ERROR,"files:precision = %s is not a valid option",precisions[i]);
+		}
+	}
+
+	if(*deflate<0 || *deflate>9)
+		msg(ERROR,"Deflate level of '%s' must be between 0 and 9",fName);
+
+	freeStrArr(quantities);
+	freeStrArr(precisions);
+	free(deflates);
+
+	return type;
+}
+
+hid_t createH5Chunked(int rank, const hsize_t *chunkDims, int deflate){
+
+	hid_t pList = H5Pcreate(H5P_DATASET_CREATE);
+	H5Pset_chunk(pList, rank, chunkDims);
+	if(deflate){
+		H5Pset_shuffle(pList);
+		H5Pset_deflate(pList, deflate);
+	}
+
+	return pList;
+}
+
+void getH5Attr(hid_t h5, const char *name, double *value){
+
+	if(!H5Aexists(h5,name)) msg(ERROR,"Attribute \"%s\" not found",name);
+
+	hid_t attribute = H5Aopen(h5, name, H5P_DEFAULT);
+	H5Aread(attribute, H5T_NATIVE_DOUBLE, value);
+	H5Aclose(attribute);
+}
+
 void setH5Attr(hid_t h5, const char *name, const double *value, int size){
 
 	if(H5Aexists(h5,name)){
@@ -657,25 +764,137 @@ void createH5Group(hid_t h5, const char *name){
 
 }
 
+// Collects the names of all links in a file
+typedef struct{
+	char **names;
+	int nNames;
+} H5Links;
+
+static herr_t listH5Link(hid_t group, const char *name, const H5L_info_t *info,
+						 void *data){
+
+	H5Links *links = (H5Links*)data;
+	links->names = realloc(links->names,(links->nNames+1)*sizeof(*links->names));
+	links->names[links->nNames] = malloc((strlen(name)+1)*sizeof(**links->names));
+	strcpy(links->names[links->nNames],name);
+	links->nNames++;
+
+	return 0;
+}
+
+static H5Links listH5Links(hid_t h5){
+
+	H5Links links = {NULL, 0};
+	H5Lvisit(h5,H5_INDEX_NAME,H5_ITER_INC,listH5Link,&links);
+	return links;
+}
+
+static void freeH5Links(H5Links links){
+
+	for(int i=0;i<links.nNames;i++) free(links.names[i]);
+	free(links.names);
+}
+
+void truncateH5(hid_t h5, double n){
+
+	h5AsyncWait();
+
+	H5Links links = listH5Links(h5);
+
+	for(int i=0;i<links.nNames;i++){
+
+		char *base = strrchr(links.names[i],'/');
+		base = base==NULL ? links.names[i] : base+1;
+
+		double step;
+		char trailing;
+		if(sscanf(base,"n=%lf%c",&step,&trailing)==1 && step>n)
+			H5Ldelete(h5,links.names[i],H5P_DEFAULT);
+	}
+
+	freeH5Links(links);
+}
+
+
+/*
+ * Values given to xyWrite() are buffered per dataset until bufferSize values
+ * have been given to one of the datasets of the file. Then all datasets of
+ * the file are flushed with one reduction per kind of MPI_Op.
+ */
+typedef struct{
+	char *name;
+	MPI_Op op;
+	double *x;
+	double *y;
+	int n;
+} XyDataset;
+
+typedef struct{
+	hid_t h5;
+	int bufferSize;
+	XyDataset *datasets;
+	int nDatasets;
+} XyFile;
+
+static XyFile *xyFiles = NULL;
+static int nXyFiles = 0;
+
+static XyFile *xyGetFile(hid_t h5){
+
+	for(int f=0;f<nXyFiles;f++) if(xyFiles[f].h5==h5) return &xyFiles[f];
+	msg(ERROR,"The .xy.h5-file is not opened using xyOpenH5()");
+	return NULL;
+}
+
+// Returns the buffer of a dataset, setting it up if needed
+static XyDataset *xyGetDataset(XyFile *file, const char *name){
+
+	for(int s=0;s<file->nDatasets;s++){
+		if(!strcmp(file->datasets[s].name,name)) return &file->datasets[s];
+	}
+
+	file->datasets = realloc(file->datasets,(file->nDatasets+1)*sizeof(*file->datasets));
+	XyDataset *set = &file->datasets[file->nDatasets++];
+	set->name = malloc((strlen(name)+1)*sizeof(*set->name));
+	strcpy(set->name,name);
+	set->op = MPI_SUM;
+	set->x = malloc(file->bufferSize*sizeof(*set->x));
+	set->y = malloc(file->bufferSize*sizeof(*set->y));
+	set->n = 0;
+
+	return set;
+}
 
 hid_t xyOpenH5(const dictionary *ini, const char *fName){
 
-	return openH5File(ini,fName,"xy");
+	hid_t h5 = openH5File(ini,fName,"xy");
+
+	int bufferSize = iniGetInt(ini,"files:xyBuffer");
+	if(bufferSize<1) msg(ERROR,"files:xyBuffer must be positive");
+
+	xyFiles = realloc(xyFiles,(nXyFiles+1)*sizeof(*xyFiles));
+	XyFile *file = &xyFiles[nXyFiles++];
+	file->h5 = h5;
+	file->bufferSize = bufferSize;
+	file->datasets = NULL;
+	file->nDatasets = 0;
+
+	return h5;
 }
 
 void xyCreateDataset(hid_t h5, const char *name){
 
-	int mpiRank;
-	MPI_Comm_rank(MPI_COMM_WORLD,&mpiRank);
+	h5AsyncWait();
+
+	XyFile *file = xyGetFile(h5);
 
 	createH5Group(h5,name);	// Creates parent groups
 
 	const int arrSize=2;
 
 	// Enable chunking of data in order to use extendible (unlimited) datasets
-	hsize_t chunkDims[] = {1,2};
-	hid_t pList = H5Pcreate(H5P_DATASET_CREATE);
-    H5Pset_chunk(pList, arrSize, chunkDims);
+	hsize_t chunkDims[] = {file->bufferSize,2};
+	hid_t pList = createH5Chunked(arrSize, chunkDims, 0);
 
 	// Create dataspace for file initially empty but extendable
 	hsize_t fileDims[] = {0,2};
@@ -687,26 +906,35 @@ void xyCreateDataset(hid_t h5, const char *name){
 
 	H5Sclose(fileSpace);
 	H5Dclose(dataset);
+	H5Pclose(pList);
+
+	xyGetDataset(file,name);
 
 }
-void xyWrite(hid_t h5, const char* name, double x, double y, MPI_Op op){
 
+typedef struct{
+	hid_t h5;
+	char *name;
+	double *values;		// x and y of each row
+	int n;
 	int mpiRank;
-	MPI_Comm_rank(MPI_COMM_WORLD,&mpiRank);
+} XyJob;
 
-	// Reduce data across nodes
-	double yReduced;
-	MPI_Reduce(&y,&yReduced,1,MPI_DOUBLE,op,0,MPI_COMM_WORLD);
+static void xyWriteJob(void *data){
+
+	XyJob *job = (XyJob*)data;
+	hid_t h5 = job->h5;
+	int mpiRank = job->mpiRank;
 
 	// Load dataset
-	hid_t dataset = H5Dopen(h5,name,H5P_DEFAULT);
+	hid_t dataset = H5Dopen(h5,job->name,H5P_DEFAULT);
 
-	// Extend dataspace in file by one row (must be done on all MPI nodes)
+	// Extend dataspace in file by n rows (must be done on all MPI nodes)
 	const int arrSize=2;
 	hid_t fileSpace = H5Dget_space(dataset);
 	hsize_t fileDims[arrSize];
 	H5Sget_simple_extent_dims(fileSpace,fileDims,NULL);
-	fileDims[0]++;
+	fileDims[0] += job->n;
 	H5Dset_extent(dataset,fileDims);
 
 	// update fileSpace after change
@@ -716,28 +944,287 @@ void xyWrite(hid_t h5, const char* name, double x, double y, MPI_Op op){
 	// Write only from MPI rank 0
 	if(mpiRank==0){
 		// Select hyperslab to write to
-		hsize_t offset[] = {fileDims[0]-1,0};
-		hsize_t count[] = {1,1};
-		hsize_t memDims[] = {1,2};
-		H5Sselect_hyperslab(fileSpace,H5S_SELECT_SET,offset,NULL,count,memDims);
+		hsize_t offset[] = {fileDims[0]-job->n,0};
+		hsize_t memDims[] = {job->n,2};
+		H5Sselect_hyperslab(fileSpace,H5S_SELECT_SET,offset,NULL,memDims,NULL);
 
 		// Write to file
-		double data[] = {x,yReduced};
 		hid_t memSpace = H5Screate_simple(arrSize,memDims,NULL);
-		H5Dwrite(dataset, H5T_NATIVE_DOUBLE, memSpace, fileSpace, H5P_DEFAULT, data);
+		H5Dwrite(dataset, H5T_NATIVE_DOUBLE, memSpace, fileSpace, H5P_DEFAULT, job->values);
 		H5Sclose(memSpace);
 	}
 
 	H5Sclose(fileSpace);
 	H5Dclose(dataset);
 
+	free(job->values);
+	free(job->name);
+	free(job);
+
+}
+
+static void xyFlush(XyFile *file){
+
+	int mpiRank;
+	MPI_Comm_rank(MPI_COMM_WORLD,&mpiRank);
+
+	XyDataset *datasets = file->datasets;
+	int nDatasets = file->nDatasets;
+
+	long int nValues = 0;
+	for(int s=0;s<nDatasets;s++) nValues += datasets[s].n;
+	if(!nValues) return;
+
+	double *buffer = malloc(nValues*sizeof(*buffer));
+	double *reduced = malloc(nValues*sizeof(*reduced));
+
+	// Reduce all values with the same MPI_Op at once
+	bool *done = malloc(nDatasets*sizeof(*done));
+	for(int s=0;s<nDatasets;s++) done[s] = datasets[s].n==0;
+
+	for(int s=0;s<nDatasets;s++){
+		if(done[s]) continue;
+		MPI_Op op = datasets[s].op;
+
+		long int i = 0;
+		for(int t=s;t<nDatasets;t++){
+			if(done[t] || datasets[t].op!=op) continue;
+			for(int r=0;r<datasets[t].n;r++) buffer[i++] = datasets[t].y[r];
+		}
+
+		MPI_Reduce(buffer,reduced,i,MPI_DOUBLE,op,0,MPI_COMM_WORLD);
+
+		i = 0;
+		for(int t=s;t<nDatasets;t++){
+			if(done[t] || datasets[t].op!=op) continue;
+			for(int r=0;r<datasets[t].n;r++) datasets[t].y[r] = reduced[i++];
+			done[t] = true;
+		}
+	}
+
+	free(done);
+	free(buffer);
+	free(reduced);
+
+	for(int s=0;s<nDatasets;s++){
+		XyDataset *set = &datasets[s];
+		if(!set->n) continue;
+
+		XyJob *job = malloc(sizeof(*job));
+		job->h5 = file->h5;
+		job->name = malloc((strlen(set->name)+1)*sizeof(*job->name));
+		strcpy(job->name,set->name);
+		job->values = malloc(2*set->n*sizeof(*job->values));
+		for(int r=0;r<set->n;r++){
+			job->values[2*r] = set->x[r];
+			job->values[2*r+1] = set->y[r];
+		}
+		job->n = set->n;
+		job->mpiRank = mpiRank;
+		set->n = 0;
+
+		h5AsyncSubmit(xyWriteJob,job);
+	}
+
+}
+
+void xyWrite(hid_t h5, const char* name, double x, double y, MPI_Op op){
+
+	XyFile *file = xyGetFile(h5);
+	XyDataset *set = xyGetDataset(file,name);
+
+	set->op = op;
+	set->x[set->n] = x;
+	set->y[set->n] = y;
+	set->n++;
+
+	if(set->n==file->bufferSize) xyFlush(file);
+
+}
+
+void xyFlushH5(hid_t h5){
+
+	xyFlush(xyGetFile(h5));
+	h5AsyncWait();
+	H5Fflush(h5,H5F_SCOPE_LOCAL);
+}
+
+void xyTruncateH5(hid_t h5, double x){
+
+	h5AsyncWait();
+
+	H5Links links = listH5Links(h5);
+
+	for(int i=0;i<links.nNames;i++){
+
+		hid_t object = H5Oopen(h5,links.names[i],H5P_DEFAULT);
+		bool isDataset = H5Iget_type(object)==H5I_DATASET;
+		H5Oclose(object);
+		if(!isDataset) continue;
+
+		hid_t dataset = H5Dopen(h5,links.names[i],H5P_DEFAULT);
+		hid_t fileSpace = H5Dget_space(dataset);
+		hsize_t fileDims[2];
+		H5Sget_simple_extent_dims(fileSpace,fileDims,NULL);
+
+		double *values = malloc((2*fileDims[0]+1)*sizeof(*values));
+		H5Dread(dataset,H5T_NATIVE_DOUBLE,H5S_ALL,H5S_ALL,H5P_DEFAULT,values);
+
+		// The rows are in the order they were written
+		hsize_t nRows = 0;
+		while(nRows<fileDims[0] && values[2*nRows]<=x) nRows++;
+
+		if(nRows<fileDims[0]){
+			fileDims[0] = nRows;
+			H5Dset_extent(dataset,fileDims);
+		}
+
+		free(values);
+		H5Sclose(fileSpace);
+		H5Dclose(dataset);
+	}
+
+	freeH5Links(links);
 }
 
 void xyCloseH5(hid_t h5){
 
+	XyFile *file = xyGetFile(h5);
+	xyFlush(file);
+
+	for(int s=0;s<file->nDatasets;s++){
+		free(file->datasets[s].name);
+		free(file->datasets[s].x);
+		free(file->datasets[s].y);
+	}
+	free(file->datasets);
+
+	// Remove from the list of open files
+	*file = xyFiles[--nXyFiles];
+
+	h5AsyncWait();
 	H5Fclose(h5);
 }
 
+/******************************************************************************
+ * ASYNCHRONOUS H5 OUTPUT
+ *****************************************************************************/
+
+/*
+ * Writes are queued in submission order and carried out by one background
+ * thread. A job stays at the head of the queue while it is being written, so
+ * h5nQueued counts both waiting and running jobs.
+ */
+typedef struct H5Job{
+	void (*write)(void *data);
+	void *data;
+	struct H5Job *next;
+} H5Job;
+
+static pthread_t h5Thread;
+static pthread_mutex_t h5Mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t h5Cond = PTHREAD_COND_INITIALIZER;
+static H5Job *h5Head = NULL;
+static H5Job *h5Tail = NULL;
+static int h5nQueued = 0;
+static int h5MaxQueued = 0;		// Zero when writing synchronously
+static bool h5Stopping = false;
+
+static void *h5AsyncLoop(void *arg){
+
+	pthread_mutex_lock(&h5Mutex);
+	while(true){
+
+		while(!h5Head && !h5Stopping) pthread_cond_wait(&h5Cond,&h5Mutex);
+		if(!h5Head) break;
+
+		H5Job *job = h5Head;
+		pthread_mutex_unlock(&h5Mutex);
+		job->write(job->data);
+		pthread_mutex_lock(&h5Mutex);
+
+		h5Head = job->next;
+		if(!h5Head) h5Tail = NULL;
+		h5nQueued--;
+		free(job);
+		pthread_cond_broadcast(&h5Cond);
+	}
+	pthread_mutex_unlock(&h5Mutex);
+
+	return NULL;
+}
+
+void h5AsyncStart(const dictionary *ini){
+
+	int maxQueued = iniGetInt(ini,"files:asyncQueue");
+	if(maxQueued<=0) return;
+
+	int provided;
+	MPI_Query_thread(&provided);
+	if(provided<MPI_THREAD_MULTIPLE){
+		msg(WARNING,"MPI does not support MPI_THREAD_MULTIPLE. Writing .h5-files synchronously.");
+		return;
+	}
+
+	h5Stopping = false;
+	h5MaxQueued = maxQueued;
+	if(pthread_create(&h5Thread,NULL,h5AsyncLoop,NULL))
+		msg(ERROR,"Could not start thread for writing .h5-files");
+
+}
+
+void h5AsyncSubmit(void (*write)(void *data), void *data){
+
+	if(!h5MaxQueued){
+		write(data);
+		return;
+	}
+
+	H5Job *job = malloc(sizeof(*job));
+	job->write = write;
+	job->data = data;
+	job->next = NULL;
+
+	pthread_mutex_lock(&h5Mutex);
+	while(h5nQueued>=h5MaxQueued) pthread_cond_wait(&h5Cond,&h5Mutex);
+	if(h5Tail) h5Tail->next = job;
+	else h5Head = job;
+	h5Tail = job;
+	h5nQueued++;
+	pthread_cond_broadcast(&h5Cond);
+	pthread_mutex_unlock(&h5Mutex);
+
+}
+
+void h5AsyncWait(){
+
+	if(!h5MaxQueued) return;
+
+	pthread_mutex_lock(&h5Mutex);
+	while(h5nQueued) pthread_cond_wait(&h5Cond,&h5Mutex);
+	pthread_mutex_unlock(&h5Mutex);
+
+}
+
+bool h5AsyncActive(){
+
+	return h5MaxQueued>0;
+}
+
+void h5AsyncStop(){
+
+	if(!h5MaxQueued) return;
+
+	pthread_mutex_lock(&h5Mutex);
+	h5Stopping = true;
+	pthread_cond_broadcast(&h5Cond);
+	pthread_mutex_unlock(&h5Mutex);
+
+	pthread_join(h5Thread,NULL);
+	h5MaxQueued = 0;
+
+}
+
 /******************************************************************************
  * DEFINING LOCAL LIST PARSING FUNCTIONS
  *****************************************************************************/
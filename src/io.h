@@ -344,6 +344,79 @@ void freeStrArr(char** strArr);
  */
 hid_t openH5File(const dictionary* ini, const char *fName, const char *fSubExt);
 
+/**
+ * @brief Creates an .h5-file, truncating it if it already exists
+ * @param	ini			Input file dictionary
+ * @param	fName		Filename
+ * @param	fSubExt		Sub-extension (e.g. "grid")
+ * @return	HDF5 file identifier
+ *
+ * Same as openH5File() except that any existing file is overwritten.
+ */
+hid_t createH5File(const dictionary* ini, const char *fName, const char *fSubExt);
+
+/**
+ * @brief Returns the full name of an .h5-file
+ * @param	ini			Input file dictionary
+ * @param	fName		Filename
+ * @param	fSubExt		Sub-extension (e.g. "grid")
+ * @return	File name (free using free())
+ *
+ * The file name used by openH5File(), including the path and prefix given
+ * by "files:output".
+ */
+char *getH5FileName(const dictionary *ini, const char *fName, const char *fSubExt);
+
+/**
+ * @brief Reads how often and how densely to write an .h5-file
+ * @param		ini			Input file dictionary
+ * @param		fName		Name of the quantity (as given to openH5File())
+ * @param[out]	interval	Write every interval time step
+ * @param[out]	stride		Write every stride node or particle
+ * @return		void
+ *
+ * The quantities listed in "files:quantities" are written every
+ * "files:intervals" time step, and only every "files:strides" node along each
+ * dimension (for grids) or particle (for populations). Quantities not listed
+ * are written every time step at full resolution. Example:
+ *
+ * @code
+ *	quantities = rho, phi, E, pop
+ *	intervals = 1, 10, 10, 100
+ *	strides = 1, 2, 2, 16
+ * @endcode
+ *
+ * Used by gOpenH5() and pOpenH5().
+ */
+void getH5Output(const dictionary *ini, const char *fName, int *interval, int *stride);
+
+/**
+ * @brief Reads how to store a quantity in an .h5-file
+ * @param		ini			Input file dictionary
+ * @param		fName		Name of the quantity (as given to openH5File())
+ * @param[out]	deflate		Deflate (gzip) level, 0 for no compression
+ * @return		HDF5 file type (H5T_IEEE_F64LE or H5T_IEEE_F32LE)
+ *
+ * Like getH5Output() the settings are given per quantity listed in
+ * "files:quantities", by "files:deflate" (0-9) and "files:precision" ("double"
+ * or "float"). Storing as float halves the size at the cost of precision.
+ * Quantities not listed are stored uncompressed in double precision.
+ */
+hid_t getH5Compression(const dictionary *ini, const char *fName, int *deflate);
+
+/**
+ * @brief Creates dataset creation properties for a chunked dataset
+ * @param	rank		Number of dimensions of the dataset
+ * @param	chunkDims	Size of a chunk (rank elements)
+ * @param	deflate		Deflate level (0 for no compression)
+ * @return	Property list (close using H5Pclose())
+ *
+ * Compressed chunks are shuffled first, which usually compresses floating
+ * point data better. Parallel HDF5 (1.10.2 or later) can write compressed
+ * datasets, but only collectively.
+ */
+hid_t createH5Chunked(int rank, const hsize_t *chunkDims, int deflate);
+
 /**
  * @brief Sets array of double as attributes in h5-file
  * @param	h5		.h5-file identifier
@@ -358,6 +431,29 @@ hid_t openH5File(const dictionary* ini, const char *fName, const char *fSubExt);
  */
 void setH5Attr(hid_t h5, const char *name, const double *value, int size);
 
+/**
+ * @brief Reads an attribute written by setH5Attr()
+ * @param	h5		HDF5 identifier
+ * @param	name	Attribute name
+ * @param	value	Array to store the values in (large enough for all)
+ * @return	void
+ */
+void getH5Attr(hid_t h5, const char *name, double *value);
+
+/**
+ * @brief Removes the datasets of time steps after n from an .h5-file
+ * @param	h5		HDF5 file identifier
+ * @param	n		Last time step to keep
+ * @return	void
+ *
+ * Datasets anywhere in the file whose name is "n=<step>" (as written by
+ * gWriteH5() and pWriteH5()) with a step larger than n are removed. Used when
+ * restarting from a checkpoint, since the output of the earlier run may go
+ * beyond it. The file does not shrink, but the space may be reclaimed by
+ * h5repack.
+ */
+void truncateH5(hid_t h5, double n);
+
 /**
  * @brief Creates a group in a .h5-file recursively
  * @param	h5		.h5-file identifier
@@ -383,6 +479,9 @@ void createH5Group(hid_t h5, const char *name);
  * For conventions regarding the file name, see openH5File().
  * See xyWriteH5() for how to write (x,y) datapoits to the file.
  * Remember to close using xyCloseH5() or PINC will fail ungracefully.
+ *
+ * "files:xyBuffer" sets how many datapoints of each dataset are buffered
+ * before writing, see xyWrite().
  */
 hid_t xyOpenH5(const dictionary *ini, const char *fName);
 
@@ -390,9 +489,33 @@ hid_t xyOpenH5(const dictionary *ini, const char *fName);
  * @brief Closes a .xy.h5-file
  * @param	h5		Identifier to h5-file to close
  * @param			void
+ *
+ * Buffered datapoints are written before closing.
  */
 void xyCloseH5(hid_t h5);
 
+/**
+ * @brief Writes the buffered datapoints of a .xy.h5-file to disk
+ * @param	h5		Identifier to h5-file
+ * @return	void
+ *
+ * Waits for the write and flushes the file, so that everything given to
+ * xyWrite() so far is on disk, e.g. when writing a checkpoint.
+ */
+void xyFlushH5(hid_t h5);
+
+/**
+ * @brief Removes the datapoints with x larger than a value from a .xy.h5-file
+ * @param	h5		Identifier to h5-file
+ * @param	x		Largest x to keep
+ * @return	void
+ *
+ * Every dataset of the file is shrunk to the rows up to the first one with x
+ * larger than the given value. Used when restarting from a checkpoint, with
+ * the time step as x.
+ */
+void xyTruncateH5(hid_t h5, double x);
+
 /**
  * @brief Writes an (x,y) datapoint to a dataset in an H5-file
  * @param	h5		.h5-file identifier
@@ -411,6 +534,12 @@ void xyCloseH5(hid_t h5);
  * all MPI nodes before writing to file. If the x value differs amongst the
  * nodes, the x-value of rank 0 is simply used.
  *
+ * The datapoints are buffered in memory, and written when "files:xyBuffer"
+ * points have been given to one of the datasets, or when the file is closed.
+ * All datasets of the file are then written at once, using one reduction for
+ * all values with the same MPI_Op. Use the same op for all points of a
+ * dataset, and write the datasets in the same order on all MPI nodes.
+ *
  * The dataset must be created beforehand by calling xyCreateDataset() and the
  * file is created by xyOpenH5(). Remember to close the H5 file using
  * xyCloseH5().
@@ -445,6 +574,59 @@ void xyWrite(hid_t h5, const char* name, double x, double y, MPI_Op op);
  */
 void xyCreateDataset(hid_t h5, const char *name);
 
+/**
+ * @brief Starts writing .h5-files on a background thread
+ * @param	ini		Input file dictionary
+ * @return	void
+ *
+ * If "files:asyncQueue" is larger than zero, gWriteH5(), pWriteH5() and
+ * xyWrite() copy their data to a staging buffer and return, while a
+ * background thread performs the (collective) HDF5 writes in the order they
+ * were submitted. At most "files:asyncQueue" writes may be pending; further
+ * writes wait for a slot, so it bounds the memory used by staging buffers.
+ *
+ * Requires MPI initialized with MPI_THREAD_MULTIPLE. Otherwise, or if
+ * "files:asyncQueue" is zero, all writes are synchronous as before.
+ *
+ * The HDF5 library is only called from one thread at a time: Functions
+ * opening, reading or closing .h5-files wait for the pending writes using
+ * h5AsyncWait(), and so must any other code calling HDF5 after
+ * h5AsyncStart(). Stop with h5AsyncStop() before closing the files.
+ */
+void h5AsyncStart(const dictionary *ini);
+
+/**
+ * @brief Queues a write to be performed by the background thread
+ * @param	write	Function performing the write
+ * @param	data	Argument to write (typically freed by it)
+ * @return	void
+ *
+ * Calls write(data) immediately if the background thread is not running. All
+ * MPI nodes must submit collective writes in the same order.
+ */
+void h5AsyncSubmit(void (*write)(void *data), void *data);
+
+/**
+ * @brief Waits until all queued writes are done
+ * @return	void
+ */
+void h5AsyncWait();
+
+/**
+ * @brief Whether writes are performed on a background thread
+ * @return	true if h5AsyncStart() started the thread
+ *
+ * Writers use this to decide whether their data must be copied to a staging
+ * buffer before submitting it.
+ */
+bool h5AsyncActive();
+
+/**
+ * @brief Waits for the queued writes and stops the background thread
+ * @return	void
+ */
+void h5AsyncStop();
+
 /**
  * @brief Writes grid structs to a parsefile
  * @param ini 		dictionary of the input file
@@ -21,7 +21,9 @@ int main(int argc, char *argv[]){
 	/*
 	 * INITIALIZE PINC
 	 */
-	MPI_Init(&argc,&argv);
+	// Threads may call MPI if .h5-files are written asynchronously
+	int mpiThreadLevel;
+	MPI_Init_thread(&argc,&argv,MPI_THREAD_MULTIPLE,&mpiThreadLevel);
 	dictionary *ini = iniOpen(argc,argv); // No printing before this
 	msg(STATUS, "PINC %s started.", VERSION);    // Needs MPI
 	MPI_Barrier(MPI_COMM_WORLD);
@@ -32,6 +34,7 @@ int main(int argc, char *argv[]){
 	void (*run)() = select(ini,"methods:mode",	regular_set,
 												mgMode_set,
 												mgModeErrorScaling_set,
+												mgModeCycles_set,
 												sMode_set);
 	run(ini);
 
@@ -47,6 +50,135 @@ int main(int argc, char *argv[]){
 	return 0;
 }
 
+/*
+ * Stores the state of a generator per MPI node in "/<name>". If sync is true
+ * the generator is the same on all nodes, and only one copy is stored.
+ */
+static void writeRng(hid_t file, const char *name, const gsl_rng *rng,
+					 bool sync, const MpiInfo *mpiInfo){
+
+	hsize_t stateSize = gsl_rng_size(rng);
+	hsize_t fileDims[] = {sync ? 1 : mpiInfo->mpiSize, stateSize};
+	hsize_t memDims[] = {1, stateSize};
+	hsize_t offset[] = {sync ? 0 : mpiInfo->mpiRank, 0};
+
+	hid_t fileSpace = H5Screate_simple(2,fileDims,NULL);
+	hid_t memSpace = H5Screate_simple(2,memDims,NULL);
+	H5Sselect_hyperslab(fileSpace,H5S_SELECT_SET,offset,NULL,memDims,NULL);
+	if(sync && mpiInfo->mpiRank){
+		H5Sselect_none(fileSpace);
+		H5Sselect_none(memSpace);
+	}
+
+	hid_t pList = H5Pcreate(H5P_DATASET_XFER);
+	H5Pset_dxpl_mpio(pList, H5FD_MPIO_COLLECTIVE);
+
+	hid_t dataset = H5Dcreate(file,name,H5T_NATIVE_UCHAR,fileSpace,H5P_DEFAULT,H5P_DEFAULT,H5P_DEFAULT);
+	H5Dwrite(dataset,H5T_NATIVE_UCHAR,memSpace,fileSpace,pList,gsl_rng_state(rng));
+
+	H5Dclose(dataset);
+	H5Pclose(pList);
+	H5Sclose(memSpace);
+	H5Sclose(fileSpace);
+}
+
+// Restores a generator stored by writeRng(), unless the MPI size changed
+static void readRng(hid_t file, const char *name, gsl_rng *rng, bool sync,
+					const MpiInfo *mpiInfo){
+
+	hid_t dataset = H5Dopen(file,name,H5P_DEFAULT);
+	hid_t fileSpace = H5Dget_space(dataset);
+	hsize_t fileDims[2];
+	H5Sget_simple_extent_dims(fileSpace,fileDims,NULL);
+
+	hsize_t stateSize = gsl_rng_size(rng);
+	hsize_t nStates = sync ? 1 : mpiInfo->mpiSize;
+	if(fileDims[0]!=nStates || fileDims[1]!=stateSize){
+		msg(WARNING,"Cannot restore %s on a different number of MPI nodes. "
+					"Keeping the initial seed.",name);
+	} else {
+		hsize_t memDims[] = {1, stateSize};
+		hsize_t offset[] = {sync ? 0 : mpiInfo->mpiRank, 0};
+		hid_t memSpace = H5Screate_simple(2,memDims,NULL);
+		H5Sselect_hyperslab(fileSpace,H5S_SELECT_SET,offset,NULL,memDims,NULL);
+		H5Dread(dataset,H5T_NATIVE_UCHAR,memSpace,fileSpace,H5P_DEFAULT,gsl_rng_state(rng));
+		H5Sclose(memSpace);
+	}
+
+	H5Sclose(fileSpace);
+	H5Dclose(dataset);
+}
+
+/*
+ * Stores everything needed to continue after time step n. It is written to
+ * checkpoint.part.h5 which then replaces checkpoint.chk.h5, so there is
+ * always a complete checkpoint even if the run is killed while writing. The
+ * buffered history is written first, so that it reaches time step n too.
+ */
+static void writeCheckpoint(const dictionary *ini, int n, Population *pop,
+							const Grid *phi, const Grid *E, const Grid *rhoObj,
+							const gsl_rng *rng, const gsl_rng *rngSync,
+							hid_t history, const MpiInfo *mpiInfo){
+
+	msg(STATUS,"Writing checkpoint at time-step %i",n);
+
+	xyFlushH5(history);
+
+	hid_t file = createH5File(ini,"checkpoint","part");
+
+	pWriteCheckpoint(pop,mpiInfo,file);
+	gWriteCheckpoint(phi,mpiInfo,file,"/phi");
+	gWriteCheckpoint(E,mpiInfo,file,"/E");
+	gWriteCheckpoint(rhoObj,mpiInfo,file,"/rhoObj");
+	writeRng(file,"/rng",rng,false,mpiInfo);
+	writeRng(file,"/rngSync",rngSync,true,mpiInfo);
+
+	double step = n;
+	setH5Attr(file,"n",&step,1);
+
+	H5Fclose(file);
+	MPI_Barrier(MPI_COMM_WORLD);
+
+	if(mpiInfo->mpiRank==0){
+		char *partName = getH5FileName(ini,"checkpoint","part");
+		char *name = getH5FileName(ini,"checkpoint","chk");
+		if(rename(partName,name)) msg(WARNING,"Could not replace %s",name);
+		free(partName);
+		free(name);
+	}
+	MPI_Barrier(MPI_COMM_WORLD);
+}
+
+// Restores the state written by writeCheckpoint() and returns its time step
+static int readCheckpoint(const dictionary *ini, Population *pop, Grid *phi,
+						  Grid *E, Grid *rhoObj, gsl_rng *rng, gsl_rng *rngSync,
+						  const MpiInfo *mpiInfo){
+
+	char *name = getH5FileName(ini,"checkpoint","chk");
+	FILE *fh = fopen(name,"r");
+	if(fh==NULL) msg(ERROR,"No checkpoint %s to restart from",name);
+	fclose(fh);
+	free(name);
+
+	hid_t file = openH5File(ini,"checkpoint","chk");
+
+	double step;
+	getH5Attr(file,"n",&step);
+
+	pReadCheckpoint(pop,mpiInfo,file);
+	gReadCheckpoint(phi,mpiInfo,file,"/phi");
+	gReadCheckpoint(E,mpiInfo,file,"/E");
+	gReadCheckpoint(rhoObj,mpiInfo,file,"/rhoObj");
+	readRng(file,"/rng",rng,false,mpiInfo);
+	readRng(file,"/rngSync",rngSync,true,mpiInfo);
+
+	H5Fclose(file);
+
+	msg(STATUS,"Restarting from time-step %i",(int)step);
+
+	return (int)step;
+}
+
 void regular(dictionary *ini){
 
 	/*
@@ -123,67 +255,111 @@ void regular(dictionary *ini){
     gOpenH5(ini, rhoObj, mpiInfo, units, denorm, "rhoObj");        // for capMatrix - objects
 	gOpenH5(ini, phi, mpiInfo, units, denorm, "phi");
 	gOpenH5(ini, E,   mpiInfo, units, denorm, "E");
-    oOpenH5(ini, obj, mpiInfo, units, denorm, "test");          // for capMatrix - objects
-    oReadH5(obj, mpiInfo);                                      // for capMatrix - objects
+
+    // Objects are left out altogether unless objects:method asks for them
+    char *objMethod = iniGetStr(ini, "objects:method");
+    bool objects = strcmp(objMethod, "none");
+    bool capacitance = !strcmp(objMethod, "capacitance");
+    if(objects){
+        oOpenH5(ini, obj, mpiInfo, units, denorm, "test");      // for capMatrix - objects
+        oReadH5(obj, mpiInfo);                                  // for capMatrix - objects
+    }
 
 
+	// Continue from the last checkpoint, where the datasets already exist
+	bool restart = iniGetInt(ini,"time:restart");
+	int checkpointInterval = iniGetInt(ini,"time:checkpointInterval");
+
 	hid_t history = xyOpenH5(ini,"history");
-	pCreateEnergyDatasets(history,pop);
+	if(!restart) pCreateEnergyDatasets(history,pop);
 
 	// Add more time series to history if you want
 	// xyCreateDataset(history,"/group/group/dataset");
 
+	// Reduced quantities computed in-situ (probes are stored in history)
+	Diagnostics *diag = dAlloc(ini, units, mpiInfo, history);
+
 	/*
 	 * INITIAL CONDITIONS
 	 */
 
-    //Compute capacitance matrix 
-    oComputeCapacitanceMatrix(obj, ini, mpiInfo);
+    // Either compute the capacitance matrix or embed the objects in multigrid
+    if(capacitance){
+        oComputeCapacitanceMatrix(obj, ini, mpiInfo);
+    } else if(!strcmp(objMethod, "multigrid")){
+        if(solve != mgSolve)
+            msg(ERROR, "objects:method = multigrid requires methods:poisson = mgSolver");
+        // The surface nodes hold the object charge, so they are conductor too
+        Grid *conductor = gAlloc(ini, SCALAR);
+        oFillConductor(conductor, obj, mpiInfo);
+        mgSetObjects((MultigridSolver*)solver, conductor, mpiInfo);
+        gFree(conductor);
+    } else if(strcmp(objMethod, "none")){
+        msg(ERROR, "objects:method = %s is not a valid option", objMethod);
+    }
+    free(objMethod);
     
-	// Initalize particles
-	// pPosUniform(ini, pop, mpiInfo, rngSync);
-	pPosLattice(ini, pop, mpiInfo);
-	pVelZero(pop);
-	
-	// pVelMaxwell(ini, pop, rng);
 	double maxVel = iniGetDouble(ini,"population:maxVel");
 
-	// Perturb particles
-	//pPosPerturb(ini, pop, mpiInfo);
+	int nStart = 0;
+	if(restart){
+		nStart = readCheckpoint(ini, pop, phi, E, rhoObj, rng, rngSync, mpiInfo);
+
+		// Discard what the earlier run wrote after the checkpoint. The
+		// velocities of step nStart are stored at nStart+0.5.
+		gTruncateH5(rho, nStart);
+		gTruncateH5(rhoObj, nStart);
+		gTruncateH5(phi, nStart);
+		gTruncateH5(E, nStart);
+		truncateH5(pop->h5, nStart+0.5);
+		if(diag->interval) truncateH5(diag->h5, nStart);
+		xyTruncateH5(history, nStart);
+	} else {
+
+		// Initalize particles
+		// pPosUniform(ini, pop, mpiInfo, rngSync);
+		pPosLattice(ini, pop, mpiInfo);
+		pVelZero(pop);
+	
+		// pVelMaxwell(ini, pop, mpiInfo, rngSync);
 
-	// Migrate those out-of-bounds due to perturbation
-	extractEmigrants(pop, mpiInfo);
+		// Perturb particles
+		//pPosPerturb(ini, pop, mpiInfo);
 
-	puMigrate(pop, mpiInfo, rho);
+		// Migrate those out-of-bounds due to perturbation
+		extractEmigrants(pop, mpiInfo);
 
-	/*
-	 * INITIALIZATION (E.g. half-step)
-	 */
+		puMigrate(pop, mpiInfo, rho);
+
+		/*
+		 * INITIALIZATION (E.g. half-step)
+		 */
 
-    // Clean objects from any charge first.
-    gZero(rhoObj);                                          // for capMatrix - objects
-    oCollectObjectCharge(pop, rhoObj, obj, mpiInfo);        // for capMatrix - objects
-    gZero(rhoObj);                                          // for capMatrix - objects
+	    // Clean objects from any charge first.
+	    gZero(rhoObj);                                          // for capMatrix - objects
+	    if(objects) oCollectObjectCharge(pop, rhoObj, obj, mpiInfo);    // for capMatrix - objects
+	    gZero(rhoObj);                                          // for capMatrix - objects
 
     
-	// Get initial charge density
-	distr(pop, rho);
-	gHaloOp(addSlice, rho, mpiInfo, FROMHALO);
-    gWriteH5(rho, mpiInfo, (double) 0);
+		// Get initial charge density
+		distr(pop, rho);
+		gHaloOp(addSlice, rho, mpiInfo, FROMHALO);
+	    gWriteH5(rho, mpiInfo, (double) 0);
 
-	// Get initial E-field
+		// Get initial E-field
 
-	solve(solver, rho, phi, mpiInfo); //sSolve, not MGSOLVE! 05/09/19
-    gWriteH5(phi, mpiInfo, (double) 0);
-	gFinDiff1st(phi, E);
-	gHaloOp(setSlice, E, mpiInfo, TOHALO);
-	gMul(E, -1.);
+		solve(solver, rho, phi, mpiInfo); //sSolve, not MGSOLVE! 05/09/19
+	    gWriteH5(phi, mpiInfo, (double) 0);
+		gFinDiff1st(phi, E);
+		gHaloOp(setSlice, E, mpiInfo, TOHALO);
+		gMul(E, -1.);
 
 
-	// Advance velocities half a step
-	gMul(E, 0.5);
-	acc(pop, E);
-	gMul(E, 2.0);
+		// Advance velocities half a step
+		gMul(E, 0.5);
+		acc(pop, E);
+		gMul(E, 2.0);
+	}
 
 	/*
 	 * TIME LOOP
@@ -191,10 +367,13 @@ void regular(dictionary *ini){
 
 	Timer *t = tAlloc(mpiInfo->mpiRank);
 
+	// Write .h5-files in the background from now on
+	h5AsyncStart(ini);
+
 	// n should start at 1 since that's the timestep we have after the first
 	// iteration (i.e. when storing H5-files).
 	int nTimeSteps = iniGetInt(ini,"time:nTimeSteps");
-	for(int n = 1; n <= nTimeSteps; n++){
+	for(int n = nStart+1; n <= nTimeSteps; n++){
 
 
 		msg(STATUS,"Computing time-step %i",n);
@@ -208,7 +387,7 @@ void regular(dictionary *ini){
 		tStart(t);
 
 		// Move particles
-		// oRayTrace(pop, obj, deltaRho); <- do we need this still???
+		if(objects) oFindParticleCollisions(pop, obj);
 		puMove(pop, obj);
 
 		// Migrate particles (periodic boundaries)
@@ -219,7 +398,7 @@ void regular(dictionary *ini){
 		pPosAssertInLocalFrame(pop, rho);
 
         // Collect the charges on the objects.
-        oCollectObjectCharge(pop, rhoObj, obj, mpiInfo);    // for capMatrix - objects
+        if(objects) oCollectObjectCharge(pop, rhoObj, obj, mpiInfo);    // for capMatrix - objects
         
 		// Compute charge density
 		distr(pop, rho);
@@ -235,9 +414,10 @@ void regular(dictionary *ini){
         solve(solver, rho, phi, mpiInfo);                   // for capMatrix - objects
         
         // Second run with solver to account for charges
-        oApplyCapacitanceMatrix(rho, phi, obj, mpiInfo);    // for capMatrix - objects
-
-		solve(solver, rho, phi, mpiInfo);
+        if(capacitance){
+            oApplyCapacitanceMatrix(rho, phi, obj, mpiInfo);    // for capMatrix - objects
+            solve(solver, rho, phi, mpiInfo);
+        }
 
 		gHaloOp(setSlice, phi, mpiInfo, TOHALO); // Needed by sSolve but not mgSolve
         
@@ -267,12 +447,17 @@ void regular(dictionary *ini){
 
 		//Write h5 files
     	gWriteH5(E, mpiInfo, (double) n);
-		gWriteH5(rho, mpiInfo, (double) n);
 		gWriteH5(phi, mpiInfo, (double) n);
 		pWriteH5(pop, mpiInfo, (double) n, (double)n+0.5);
 		pWriteEnergy(history,pop,(double)n);
+		dRun(diag, pop, phi, E, mpiInfo, (double)n);
+
+		if(checkpointInterval && n%checkpointInterval==0)
+			writeCheckpoint(ini, n, pop, phi, E, rhoObj, rng, rngSync, history, mpiInfo);
 	}
 
+	h5AsyncStop();
+
 	if(mpiInfo->mpiRank==0) tMsg(t->total, "Time spent: ");
 
 	/*
@@ -286,7 +471,8 @@ void regular(dictionary *ini){
  	gCloseH5(rhoObj);       // for capMatrix - objects
 	gCloseH5(phi);
 	gCloseH5(E);
-  	oCloseH5(obj);          // for capMatrix - objects
+  	if(objects) oCloseH5(obj);  // for capMatrix - objects
+	dFree(diag);
 	xyCloseH5(history);
 
 	// Free memory
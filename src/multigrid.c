@@ -16,6 +16,12 @@
 #include "core.h"
 #include "multigrid.h"
 
+/*
+ * Number of Gauss-Seidel iterations mgGS3DBlocked() fuses into one pass through
+ * memory before exchanging halos.
+ */
+#define MG_GS_BLOCK_DEPTH 2
+
 /******************************************************************************
  * 				Local functions
  *****************************************************************************/
@@ -30,9 +36,34 @@ void mgSetSolver(const dictionary *ini, Multigrid *multigrid){
 	char *preSmoothName = iniGetStr(ini, "multigrid:preSmooth");
     char *postSmoothName = iniGetStr(ini, "multigrid:postSmooth");
     char *coarseSolverName = iniGetStr(ini, "multigrid:coarseSolver");
+	char *stencilName = iniGetStr(ini, "multigrid:stencil");
 
 	int nDims = multigrid->grids[0]->rank-1;
 
+	multigrid->directCoarseSolve = false;
+	multigrid->coarseLU = NULL;
+	multigrid->coarsePerm = NULL;
+	multigrid->coarseBuffer = NULL;
+	multigrid->compactRho = NULL;
+	multigrid->nObjects = 0;
+	multigrid->objMask = NULL;
+	multigrid->objNodes = NULL;
+	multigrid->objNodesOffset = NULL;
+	multigrid->objLinks = NULL;
+	multigrid->objCount = NULL;
+	multigrid->objBuffer = NULL;
+
+	if(!strcmp(stencilName, "secondOrder")){
+		multigrid->fourthOrder = false;
+		multigrid->residual = &mgResidual;
+	} else if(!strcmp(stencilName, "fourthOrder")){
+		if(nDims != 3) msg(ERROR, "The fourthOrder stencil is only implemented for 3D");
+		multigrid->fourthOrder = true;
+		multigrid->residual = &mgResidual4th;
+	} else {
+		msg(ERROR, "No stencil specified");
+	}
+
 	if(!strcmp(preSmoothName,"gaussSeidelRB")){
 		if(nDims == 2)	multigrid->preSmooth = &mgGS2D;
 		else if(nDims == 3) multigrid->preSmooth = &mgGS3D;
@@ -43,6 +74,15 @@ void mgSetSolver(const dictionary *ini, Multigrid *multigrid){
 		multigrid->preSmooth = &mgJacobND;
 	} else if ((!strcmp(preSmoothName, "gaussSeidelRBND"))){
 		multigrid->preSmooth = &mgGSND;
+	} else if ((!strcmp(preSmoothName, "gaussSeidelRBBlocked"))){
+		if(nDims == 3) multigrid->preSmooth = &mgGS3DBlocked;
+		else msg(ERROR, "gaussSeidelRBBlocked is only implemented for 3D");
+	} else if ((!strcmp(preSmoothName, "gaussSeidelRBDeepHalo"))){
+		if(nDims == 3) multigrid->preSmooth = &mgGS3DDeepHalo;
+		else msg(ERROR, "gaussSeidelRBDeepHalo is only implemented for 3D");
+	} else if ((!strcmp(preSmoothName, "gaussSeidel4th"))){
+		if(nDims == 3) multigrid->preSmooth = &mgGS3D4th;
+		else msg(ERROR, "gaussSeidel4th is only implemented for 3D");
 	} else {
     	msg(ERROR, "No Presmoothing algorithm specified");
     }
@@ -58,6 +98,15 @@ void mgSetSolver(const dictionary *ini, Multigrid *multigrid){
 		multigrid->postSmooth = &mgJacobND;
 	} else if ((!strcmp(postSmoothName, "gaussSeidelRBND"))){
 		multigrid->postSmooth = &mgGSND;
+	} else if ((!strcmp(postSmoothName, "gaussSeidelRBBlocked"))){
+		if(nDims == 3) multigrid->postSmooth = &mgGS3DBlocked;
+		else msg(ERROR, "gaussSeidelRBBlocked is only implemented for 3D");
+	} else if ((!strcmp(postSmoothName, "gaussSeidelRBDeepHalo"))){
+		if(nDims == 3) multigrid->postSmooth = &mgGS3DDeepHalo;
+		else msg(ERROR, "gaussSeidelRBDeepHalo is only implemented for 3D");
+	} else if ((!strcmp(postSmoothName, "gaussSeidel4th"))){
+		if(nDims == 3) multigrid->postSmooth = &mgGS3D4th;
+		else msg(ERROR, "gaussSeidel4th is only implemented for 3D");
  	} else {
     	msg(ERROR, "No Postsmoothing algorithm specified");
     }
@@ -73,13 +122,38 @@ void mgSetSolver(const dictionary *ini, Multigrid *multigrid){
 		multigrid->coarseSolv = &mgJacobND;
 	} else if ((!strcmp(coarseSolverName, "gaussSeidelRBND"))){
 		multigrid->coarseSolv = &mgGSND;
+	} else if ((!strcmp(coarseSolverName, "gaussSeidelRBBlocked"))){
+		if(nDims == 3) multigrid->coarseSolv = &mgGS3DBlocked;
+		else msg(ERROR, "gaussSeidelRBBlocked is only implemented for 3D");
+	} else if ((!strcmp(coarseSolverName, "direct"))){
+		multigrid->coarseSolv = NULL;
+		multigrid->directCoarseSolve = true;
+		for(int d = 1; d < 2*(nDims+1); d++){
+			if(d != nDims+1 && multigrid->grids[0]->bnd[d] != PERIODIC)
+				msg(ERROR, "The direct coarse solver requires periodic boundaries");
+		}
+	} else if ((!strcmp(coarseSolverName, "gaussSeidelRBDeepHalo"))){
+		if(nDims == 3) multigrid->coarseSolv = &mgGS3DDeepHalo;
+		else msg(ERROR, "gaussSeidelRBDeepHalo is only implemented for 3D");
+	} else if ((!strcmp(coarseSolverName, "gaussSeidel4th"))){
+		if(nDims == 3) multigrid->coarseSolv = &mgGS3D4th;
+		else msg(ERROR, "gaussSeidel4th is only implemented for 3D");
  	} else {
     	msg(ERROR, "No coarse Grid Solver algorithm specified");
     }
 
+	// The smoothers must relax the same operator as the residual
+	bool compact = multigrid->fourthOrder;
+	if(	(multigrid->preSmooth == &mgGS3D4th) != compact ||
+		(multigrid->postSmooth == &mgGS3D4th) != compact ||
+		(!multigrid->directCoarseSolve && (multigrid->coarseSolv == &mgGS3D4th) != compact))
+		msg(ERROR, "The fourthOrder stencil requires the gaussSeidel4th smoothers "
+					"(and vice versa)");
+
     free(preSmoothName);
     free(postSmoothName);
     free(coarseSolverName);
+	free(stencilName);
 }
 
 void mgSetRestrictProlong(const dictionary *ini,Multigrid *multigrid){
@@ -94,6 +168,9 @@ void mgSetRestrictProlong(const dictionary *ini,Multigrid *multigrid){
 		else msg(ERROR, "No restricting algorithm for D%d", rank-1);
 	} else if(!strcmp(restrictor, "halfWeightND")){
 		multigrid->restrictor = &mgHalfRestrictND;
+	} else if(!strcmp(restrictor, "fullWeight")){
+		if(rank == 4) multigrid->restrictor = &mgFullRestrict3D;
+		else msg(ERROR, "fullWeight is only implemented for 3D");
 	} else msg(ERROR, "No restrict stencil specified");
 
 	if(!strcmp(prolongator, "bilinear")){
@@ -114,17 +191,82 @@ funPtr getMgAlgo(const dictionary *ini){
 
 	char *mgAlgo = iniGetStr(ini, "multigrid:cycle");
 
-	funPtr algorithm;
+	funPtr algorithm = NULL;
 
 	if(!strcmp(mgAlgo, "mgVRegular"))	algorithm = &mgVRegular;
 	if(!strcmp(mgAlgo, "mgVRecursive"))	algorithm = &mgVRecursive;
 	if(!strcmp(mgAlgo, "mgFMG"))		algorithm = &mgFMG;
 	if(!strcmp(mgAlgo, "mgW"))			algorithm = &mgW;
+	if(!strcmp(mgAlgo, "mgF"))			algorithm = &mgF;
+
+	if(algorithm == NULL) msg(ERROR, "Unknown multigrid:cycle %s", mgAlgo);
+
+	free(mgAlgo);
 
 	return algorithm;
 }
 
 
+static Grid *mgAllocGrid(const int *trueSize, const int *nGhostLayers,
+						const bndType *bnd, int rank){
+
+	int *subTrueSize = malloc(rank*sizeof(*subTrueSize));
+	int *subSize = malloc(rank *sizeof(*subSize));
+
+	// Calculate the number of grid points (True points + ghost points)
+	subTrueSize[0] = trueSize[0];
+	subSize[0] = trueSize[0];
+	for(int d = 1 ; d < rank ; d ++){
+		subTrueSize[d] = trueSize[d];
+		subSize[d] = subTrueSize[d] + nGhostLayers[d] + nGhostLayers[rank + d];
+	}
+	//Slice elements
+	long int nSliceMax = 0;
+	for(int d=0;d<rank;d++){
+		long int nSlice = 1;
+		for(int dd=0;dd<rank;dd++){
+			if(dd!=d) nSlice *= subSize[dd];
+		}
+		if(nSlice>nSliceMax) nSliceMax = nSlice;
+	}
+
+	long int *subSizeProd = malloc((rank+1)*sizeof(*subSizeProd));
+	ailCumProd(subSize, subSizeProd, rank);
+
+	//Alloc slice and val (slices hold all ghost layers of an edge)
+	int nLayersMax = aiMax(nGhostLayers, 2*rank);
+	if(nLayersMax<1) nLayersMax = 1;
+	double *val = malloc(subSizeProd[rank]*sizeof(*val));
+	double *sendSlice = malloc(nLayersMax*nSliceMax*sizeof(*sendSlice));
+	double *recvSlice = malloc(nLayersMax*nSliceMax*sizeof(*recvSlice));
+	double *bndSlice = malloc(2*rank*nSliceMax*sizeof(*bndSlice));
+
+	//Ghost layer vector
+	int *subNGhostLayers = malloc(rank*2*sizeof(*subNGhostLayers));
+	for(int d = 0; d < 2*rank; d++)	subNGhostLayers[d] = nGhostLayers[d];
+
+	//Copying boundaries
+	bndType *subBnd = malloc(rank*2*sizeof(*subBnd));
+	for(int d = 0; d < 2*rank; d++)	subBnd[d] = bnd[d];
+
+	//Assign to grid
+	Grid *grid = malloc(sizeof(Grid));
+	grid->val = val;
+	grid->rank = rank;
+	grid->size = subSize;
+	grid->trueSize = subTrueSize;
+	grid->sizeProd = subSizeProd;
+	grid->nGhostLayers = subNGhostLayers;
+
+	grid->sendSlice = sendSlice;
+	grid->recvSlice = recvSlice;
+	grid->bndSlice = bndSlice;
+	grid->h5 = 0;
+	grid->bnd = subBnd;
+
+	return grid;
+}
+
 Grid **mgAllocSubGrids(const dictionary *ini, Grid *grid,
 						const int nLevels){
 
@@ -136,73 +278,159 @@ Grid **mgAllocSubGrids(const dictionary *ini, Grid *grid,
 	bndType *bnd = grid->bnd;
 	int rank = grid->rank;
 
+	int *subTrueSize = malloc(rank*sizeof(*subTrueSize));
+
 	//Set first grid to point to f grid
 	grids[0] = grid;
 
 	//Cycle through subgrids
 	for(int q = 1; q < nLevels; q++){
-		//Allocate
-		int *subTrueSize = malloc(rank*sizeof(subTrueSize));
-		int *subSize = malloc(rank *sizeof(*subSize));
-
-		//Set first entries (nValues)
-		subTrueSize[0] = trueSize[0];
-		subSize[0] = subTrueSize[0];
 
 		//The subgrid needs half the grid points
+		subTrueSize[0] = trueSize[0];
 		for(int d = 1; d < rank; d++)	subTrueSize[d] = trueSize[d]/(pow(2,q));
 
-		// Calculate the number of grid points (True points + ghost points)
-		subSize[0] = trueSize[0];
-		for(int d = 1 ; d < rank ; d ++){
-			subSize[d] = subTrueSize[d] + nGhostLayers[d] + nGhostLayers[rank + d];
-		}
-		//Slice elements
-		long int nSliceMax = 0;
-		for(int d=0;d<rank;d++){
-			long int nSlice = 1;
-			for(int dd=0;dd<rank;dd++){
-				if(dd!=d) nSlice *= subSize[dd];
-			}
-			if(nSlice>nSliceMax) nSliceMax = nSlice;
-		}
+		grids[q] = mgAllocGrid(subTrueSize, nGhostLayers, bnd, rank);
+	}
+
+	free(subTrueSize);
+
+	return grids;
+}
 
-		long int *subSizeProd = malloc((rank+1)*sizeof(*subSizeProd));
-		ailCumProd(subSize, subSizeProd, rank);
+static MpiInfo *mgAllocAgglomMpi(int nDims){
+
+	MpiInfo *mpiInfo = malloc(sizeof(*mpiInfo));
+	mpiInfo->subdomain = calloc(nDims, sizeof(*mpiInfo->subdomain));
+	mpiInfo->nSubdomains = malloc(nDims*sizeof(*mpiInfo->nSubdomains));
+	mpiInfo->nSubdomainsProd = malloc((nDims+1)*sizeof(*mpiInfo->nSubdomainsProd));
+	mpiInfo->offset = calloc(nDims, sizeof(*mpiInfo->offset));
+	mpiInfo->posToSubdomain = calloc(nDims, sizeof(*mpiInfo->posToSubdomain));
+	aiSetAll(mpiInfo->nSubdomains, nDims, 1);
+	aiSetAll(mpiInfo->nSubdomainsProd, nDims+1, 1);
+
+	mpiInfo->nDims = nDims;
+	mpiInfo->mpiSize = 1;
+	mpiInfo->mpiRank = 0;
+	mpiInfo->comm = MPI_COMM_SELF;
+	mpiInfo->nSpecies = 0;
+	mpiInfo->nNeighbors = 0;
+
+	return mpiInfo;
+}
+
+static Multigrid *mgAllocAgglom(const dictionary *ini, const Grid *coarse,
+								int nLevels){
+
+	int rank = coarse->rank;
+	int nDims = rank-1;
+	int *nSubdomains = iniGetIntArr(ini, "grid:nSubdomains", nDims);
+
+	int *globalTrueSize = malloc(rank*sizeof(*globalTrueSize));
+	globalTrueSize[0] = coarse->trueSize[0];
+	for(int d = 1; d < rank; d++){
+		globalTrueSize[d] = nSubdomains[d-1]*coarse->trueSize[d];
+		if(globalTrueSize[d] % (int)pow(2,nLevels-1))
+			msg(ERROR, "The agglomerated coarse grid can not be halved %d times",
+				nLevels-1);
+	}
+
+	Grid *global = mgAllocGrid(globalTrueSize, coarse->nGhostLayers, coarse->bnd, rank);
+	gZero(global);
 
-		//Alloc slice and val
-		double *val = malloc(subSizeProd[rank]*sizeof(*val));
-		double *sendSlice = malloc(nSliceMax*sizeof(*sendSlice));
-		double *recvSlice = malloc(nSliceMax*sizeof(*recvSlice));
-		double *bndSlice = malloc(2*rank*nSliceMax*sizeof(*bndSlice));
+	Multigrid *agglom = malloc(sizeof(*agglom));
+	agglom->nLevels = nLevels;
+	agglom->nMGCycles = 1;
+	agglom->nPreSmooth = iniGetInt(ini, "multigrid:nPreSmooth");
+	agglom->nPostSmooth = iniGetInt(ini, "multigrid:nPostSmooth");
+	agglom->nCoarseSolve = iniGetInt(ini, "multigrid:nCoarseSolve");
+	agglom->grids = mgAllocSubGrids(ini, global, nLevels);
+	agglom->agglom = NULL;
+	agglom->agglomMpiInfo = NULL;
+	agglom->agglomBuffer = NULL;
 
-		//Ghost layer vector
-		int *subNGhostLayers = malloc(rank*2*sizeof(*subNGhostLayers));
-		for(int d = 0; d < 2*rank; d++)	subNGhostLayers[d] = nGhostLayers[d];
+	mgSetSolver(ini, agglom);
+	mgSetRestrictProlong(ini, agglom);
 
-		//Copying boundaries
-		bndType *subBnd = malloc(rank*2*sizeof(*subBnd));
-		for(int d = 0; d < 2*rank; d++)	subBnd[d] = bnd[d];
+	free(nSubdomains);
+	free(globalTrueSize);
+
+	return agglom;
+}
 
-		//Assign to grid
-		Grid *grid = malloc(sizeof(Grid));
-		grid->val = val;
-		grid->rank = rank;
-		grid->size = subSize;
-		grid->trueSize = subTrueSize;
-		grid->sizeProd = subSizeProd;
-		grid->nGhostLayers = subNGhostLayers;
+/*
+ * Index in grid of the t-th node (lexicographically) of a block of true nodes
+ * of size blockSize, where the block is shifted shift nodes into the grid.
+ */
+static long int mgBlockIndex(const Grid *grid, const int *blockSize,
+							long int t, const int *shift){
 
-		grid->sendSlice = sendSlice;
-		grid->recvSlice = recvSlice;
-		grid->bndSlice = bndSlice;
-		grid->h5 = 0;
-		grid->bnd = subBnd;
+	int rank = grid->rank;
+	int *nGhostLayers = grid->nGhostLayers;
+	long int *sizeProd = grid->sizeProd;
 
-		grids[q] = grid;
+	long int g = 0;
+	for(int d = 0; d < rank; d++){
+		long int c = t % blockSize[d];
+		t /= blockSize[d];
+		g += (c + nGhostLayers[d] + (d ? shift[d-1] : 0))*sizeProd[d];
 	}
+	return g;
+}
 
-	return grids;
+static void mgGatherAgglom(const Grid *local, Grid *global, double *buffer,
+							const MpiInfo *mpiInfo){
+
+	int rank = local->rank;
+	int nDims = rank-1;
+	int mpiSize = mpiInfo->mpiSize;
+	int *nSubdomains = mpiInfo->nSubdomains;
+	int *trueSize = local->trueSize;
+	long int nTrue = aiProd(trueSize, rank);
+
+	double *sendBuffer = &buffer[mpiSize*nTrue];
+	int *shift = calloc(nDims, sizeof(*shift));
+
+	for(long int t = 0; t < nTrue; t++)
+		sendBuffer[t] = local->val[mgBlockIndex(local, trueSize, t, shift)];
+
+	MPI_Allgather(sendBuffer, nTrue, MPI_DOUBLE, buffer, nTrue, MPI_DOUBLE,
+					mpiInfo->comm);
+
+	// Place the block from each subdomain in the global grid
+	for(int r = 0; r < mpiSize; r++){
+		int temp = r;
+		for(int d = 0; d < nDims; d++){
+			shift[d] = (temp % nSubdomains[d])*trueSize[d+1];
+			temp /= nSubdomains[d];
+		}
+		for(long int t = 0; t < nTrue; t++)
+			global->val[mgBlockIndex(global, trueSize, t, shift)] = buffer[r*nTrue+t];
+	}
+
+	free(shift);
+}
+
+static void mgScatterAgglom(const Grid *global, Grid *local,
+							const MpiInfo *mpiInfo){
+
+	int rank = local->rank;
+	int nDims = rank-1;
+	int *subdomain = mpiInfo->subdomain;
+	int *trueSize = local->trueSize;
+	long int nTrue = aiProd(trueSize, rank);
+
+	int *shift = malloc(nDims*sizeof(*shift));
+	int *noShift = calloc(nDims, sizeof(*noShift));
+	for(int d = 0; d < nDims; d++) shift[d] = subdomain[d]*trueSize[d+1];
+
+	// Every rank holds the whole solution, so no communication is needed
+	for(long int t = 0; t < nTrue; t++)
+		local->val[mgBlockIndex(local, trueSize, t, noShift)] =
+			global->val[mgBlockIndex(global, trueSize, t, shift)];
+
+	free(shift);
+	free(noShift);
 }
 
 /*************************************************
@@ -281,7 +509,73 @@ Grid **mgAllocSubGrids(const dictionary *ini, Grid *grid,
  	return;
  }
 
+/*
+ * Updates one colour of one (j,k)-plane of a 3D grid. The inner loop runs over
+ * every second node along j (stride 2), starting at a parity computed once per
+ * row, such that it is branch-free and vectorizes.
+ */
+inline static void loopRedBlackPlane3D(double * restrict phiVal,
+				const double * restrict rhoVal, const long int *sizeProd,
+				const int *trueSize, const int *nGhostLayers, int l, int colour){
+
+	long int gj = sizeProd[1];
+	long int gk = sizeProd[2];
+	long int gl = sizeProd[3];
+	double coeff = 1./6.;
+
+	for(int k = 0; k < trueSize[2]; k++){
+		int jStart = (k + l + colour) & 1;
+		long int g =	(nGhostLayers[1] + jStart)*gj +
+						(nGhostLayers[2] + k)*gk +
+						(nGhostLayers[3] + l)*gl;
+
+		for(int j = jStart; j < trueSize[1]; j += 2){
+			phiVal[g] = coeff*(	phiVal[g+gj] + phiVal[g-gj] +
+								phiVal[g+gk] + phiVal[g-gk] +
+								phiVal[g+gl] + phiVal[g-gl] + rhoVal[g]);
+			g += 2*gj;
+		}
+	}
+
+	return;
+}
+
+
 
+/*
+ * Updates one colour of the box lower <= (j,k,l) < upper, given in true node
+ * coordinates, which may extend into the ghost layers. The colour is that of
+ * the true node coordinates, such that it is consistent across subdomains.
+ */
+inline static void loopRedBlackBox3D(double * restrict phiVal,
+				const double * restrict rhoVal, const long int *sizeProd,
+				const int *nGhostLayers, const int *lower, const int *upper,
+				int colour){
+
+	long int gj = sizeProd[1];
+	long int gk = sizeProd[2];
+	long int gl = sizeProd[3];
+	double coeff = 1./6.;
+
+	for(int l = lower[2]; l < upper[2]; l++){
+		for(int k = lower[1]; k < upper[1]; k++){
+			// lower[0] may be negative, (j+k+l) & 1 is not portable
+			int jStart = lower[0] + ((lower[0] + k + l + colour) % 2 != 0);
+			long int g =	(nGhostLayers[1] + jStart)*gj +
+							(nGhostLayers[2] + k)*gk +
+							(nGhostLayers[3] + l)*gl;
+
+			for(int j = jStart; j < upper[0]; j += 2){
+				phiVal[g] = coeff*(	phiVal[g+gj] + phiVal[g-gj] +
+									phiVal[g+gk] + phiVal[g-gk] +
+									phiVal[g+gl] + phiVal[g-gl] + rhoVal[g]);
+				g += 2*gj;
+			}
+		}
+	}
+
+	return;
+}
 
 /*************************************************
  *		DEFINITIONS
@@ -302,6 +596,7 @@ Multigrid *mgAlloc(const dictionary *ini, Grid *grid){
 	int nPreSmooth = iniGetInt(ini, "multigrid:nPreSmooth");
 	int nPostSmooth = iniGetInt(ini, "multigrid:nPostSmooth");
 	int nCoarseSolve = iniGetInt(ini, "multigrid:nCoarseSolve");
+	int nAgglomLevels = iniGetInt(ini, "multigrid:agglomLevels");
 	//Load data
 	int nDims = grid->rank-1;
 	int *trueSize = grid->trueSize;
@@ -328,6 +623,14 @@ Multigrid *mgAlloc(const dictionary *ini, Grid *grid){
 		}
 	}
 
+	// Sanity check (the halo exchange needs as many true layers as ghost layers)
+	int *nGhostLayers = grid->nGhostLayers;
+	int nLayersMax = aiMax(nGhostLayers, 2*(nDims+1));
+	for(int d = 0; d < nDims; d++){
+		if(trueSize[d+1]/(int)pow(2,nLevels-1) < nLayersMax)
+			msg(ERROR, "The coarsest grid has fewer true points than ghost layers");
+	}
+
 	Grid **grids = mgAllocSubGrids(ini, grid, nLevels);
 
 	//Store in multigrid struct
@@ -344,6 +647,22 @@ Multigrid *mgAlloc(const dictionary *ini, Grid *grid){
 	mgSetSolver(ini, multigrid);
 	mgSetRestrictProlong(ini, multigrid);
 
+	//Continue coarsening on the agglomerated coarsest grid
+	multigrid->agglom = NULL;
+	multigrid->agglomMpiInfo = NULL;
+	multigrid->agglomBuffer = NULL;
+	if(nAgglomLevels > 0){
+		int mpiSize;
+		MPI_Comm_size(MPI_COMM_WORLD, &mpiSize);
+
+		Grid *coarse = grids[nLevels-1];
+		long int nTrue = aiProd(coarse->trueSize, coarse->rank);
+
+		multigrid->agglom = mgAllocAgglom(ini, coarse, nAgglomLevels);
+		multigrid->agglomMpiInfo = mgAllocAgglomMpi(nDims);
+		multigrid->agglomBuffer = malloc((mpiSize+1)*nTrue*sizeof(double));
+	}
+
   	return multigrid;
 
 }
@@ -356,6 +675,38 @@ void mgFree(Multigrid *multigrid){
 	for(int n = 1; n < nLevels; n++){
 		gFree(grids[n]);
 	}
+
+	if(multigrid->agglom){
+		Grid *global = multigrid->agglom->grids[0];
+		mgFree(multigrid->agglom);
+		gFree(global);
+		gFreeMpi(multigrid->agglomMpiInfo);
+		free(multigrid->agglomBuffer);
+	}
+
+	if(multigrid->coarseLU){
+		gsl_matrix_free(multigrid->coarseLU);
+		gsl_permutation_free(multigrid->coarsePerm);
+		free(multigrid->coarseBuffer);
+	}
+
+	if(multigrid->compactRho) gFree(multigrid->compactRho);
+
+	if(multigrid->nObjects){
+		for(int n = 0; n < nLevels; n++){
+			free(multigrid->objMask[n]);
+			free(multigrid->objNodes[n]);
+			free(multigrid->objNodesOffset[n]);
+			free(multigrid->objLinks[n]);
+			free(multigrid->objCount[n]);
+		}
+		free(multigrid->objMask);
+		free(multigrid->objNodes);
+		free(multigrid->objNodesOffset);
+		free(multigrid->objLinks);
+		free(multigrid->objCount);
+		free(multigrid->objBuffer);
+	}
 	free(multigrid);
 
 	return;
@@ -836,6 +1187,163 @@ void mgGS3DNew(Grid *phi, const Grid *rho, int nCycles, const MpiInfo *mpiInfo){
 	return;
 }
 
+void mgGS3DBlocked(Grid *phi, const Grid *rho, int nCycles, const MpiInfo *mpiInfo){
+
+	//Common variables
+	int *trueSize = phi->trueSize;
+	int *nGhostLayers = phi->nGhostLayers;
+	long int *sizeProd = phi->sizeProd;
+
+	//Seperate values
+	double *phiVal = phi->val;
+	double *rhoVal = rho->val;
+
+	int nPlanes = trueSize[3];
+
+	for(int c = 0; c < nCycles; c += MG_GS_BLOCK_DEPTH){
+
+		int depth = MG_GS_BLOCK_DEPTH;
+		if(nCycles - c < depth) depth = nCycles - c;
+		int nHalfSweeps = 2*depth;
+
+		/*
+		 * Wavefront: half-sweep h acts on plane w-h. Half-sweep h only needs
+		 * h-1 to be completed on the planes l-1, l and l+1, so all half-sweeps
+		 * of the block pass through memory together in one traversal.
+		 */
+		for(int w = 0; w < nPlanes + nHalfSweeps - 1; w++){
+			for(int h = 0; h < nHalfSweeps; h++){
+				int l = w - h;
+				if(l < 0 || l >= nPlanes) continue;
+				loopRedBlackPlane3D(phiVal, rhoVal, sizeProd, trueSize,
+									nGhostLayers, l, h & 1);
+			}
+		}
+
+		gHaloOp(setSlice, phi, mpiInfo, TOHALO);
+		gBnd(phi, mpiInfo);
+	}
+
+	return;
+}
+
+void mgGS3DDeepHalo(Grid *phi, const Grid *rho, int nCycles, const MpiInfo *mpiInfo){
+
+	//Common variables
+	int rank = phi->rank;
+	int *trueSize = phi->trueSize;
+	int *nGhostLayers = phi->nGhostLayers;
+	long int *sizeProd = phi->sizeProd;
+	bndType *bnd = phi->bnd;
+	int *subdomain = mpiInfo->subdomain;
+	int *nSubdomains = mpiInfo->nSubdomains;
+
+	//Seperate values
+	double *phiVal = phi->val;
+	double *rhoVal = rho->val;
+
+	// Each half-sweep invalidates one more layer of the halo
+	int nHalfSweepsPerExchange = aiMin(&nGhostLayers[1], rank-1);
+	int nUpperMin = aiMin(&nGhostLayers[rank+1], rank-1);
+	if(nUpperMin < nHalfSweepsPerExchange) nHalfSweepsPerExchange = nUpperMin;
+	if(nHalfSweepsPerExchange < 1) msg(ERROR, "mgGS3DDeepHalo needs at least 1 ghost layer");
+
+	// Do not compute redundantly beyond non-periodic global boundaries
+	int extendLower[3], extendUpper[3];
+	for(int d = 1; d < rank; d++){
+		extendLower[d-1] = !(subdomain[d-1]==0 && bnd[d]!=PERIODIC);
+		extendUpper[d-1] = !(subdomain[d-1]==nSubdomains[d-1]-1 && bnd[d+rank]!=PERIODIC);
+	}
+
+	// The redundant region also needs rho in the halo
+	gHaloOp(setSlice, (Grid *)rho, mpiInfo, TOHALO);
+
+	int lower[3], upper[3];
+	int nHalfSweeps = 2*nCycles;
+	for(int h = 0; h < nHalfSweeps; h += nHalfSweepsPerExchange){
+
+		int nBlock = nHalfSweepsPerExchange;
+		if(nHalfSweeps - h < nBlock) nBlock = nHalfSweeps - h;
+
+		for(int b = 0; b < nBlock; b++){
+
+			// Shrink the region such that the last half-sweep is on true nodes
+			int ext = nBlock - 1 - b;
+			for(int d = 0; d < 3; d++){
+				lower[d] = -ext*extendLower[d];
+				upper[d] = trueSize[d+1] + ext*extendUpper[d];
+			}
+
+			loopRedBlackBox3D(phiVal, rhoVal, sizeProd, nGhostLayers,
+								lower, upper, (h+b) & 1);
+			gBndEdges(phi, mpiInfo);
+		}
+
+		gHaloOp(setSlice, phi, mpiInfo, TOHALO);
+		gBnd(phi, mpiInfo);
+	}
+
+	return;
+}
+
+void mgGS3D4th(Grid *phi, const Grid *rho, int nCycles, const MpiInfo *mpiInfo){
+
+	//Common variables
+	int *trueSize = phi->trueSize;
+	int *nGhostLayers = phi->nGhostLayers;
+	long int *sizeProd = phi->sizeProd;
+
+	//Seperate values
+	double *phiVal = phi->val;
+	double *rhoVal = rho->val;
+
+	long int sj = sizeProd[1];
+	long int sk = sizeProd[2];
+	long int sl = sizeProd[3];
+
+	double coeff = 1./24.;
+
+	for(int c = 0; c < nCycles; c++){
+
+		// Nodes of equal colour (parity in each direction) are not coupled
+		for(int colour = 0; colour < 8; colour++){
+
+			int cj = colour & 1;
+			int ck = (colour >> 1) & 1;
+			int cl = (colour >> 2) & 1;
+
+			for(int l = cl; l < trueSize[3]; l += 2){
+				for(int k = ck; k < trueSize[2]; k += 2){
+					long int g = (l+nGhostLayers[3])*sl + (k+nGhostLayers[2])*sk
+								+ (cj+nGhostLayers[1])*sj;
+					for(int j = cj; j < trueSize[1]; j += 2){
+
+						double faces =	phiVal[g+sj] + phiVal[g-sj]
+										+phiVal[g+sk] + phiVal[g-sk]
+										+phiVal[g+sl] + phiVal[g-sl];
+
+						double edges =	phiVal[g+sj+sk] + phiVal[g+sj-sk]
+										+phiVal[g-sj+sk] + phiVal[g-sj-sk]
+										+phiVal[g+sj+sl] + phiVal[g+sj-sl]
+										+phiVal[g-sj+sl] + phiVal[g-sj-sl]
+										+phiVal[g+sk+sl] + phiVal[g+sk-sl]
+										+phiVal[g-sk+sl] + phiVal[g-sk-sl];
+
+						phiVal[g] = coeff*(2.*faces + edges + 6.*rhoVal[g]);
+
+						g += 2*sj;
+					}
+				}
+			}
+
+			gHaloOp(setSlice, phi, mpiInfo, TOHALO);
+			gBnd(phi, mpiInfo);
+		}
+	}
+
+	return;
+}
+
 /***********************************************************
  *			RESTRICTORS/PROLONGATORS
  **********************************************************/
@@ -910,6 +1418,53 @@ void mgHalfRestrict3D(const Grid *fine, Grid *coarse){
 	return;
 }
 
+void mgFullRestrict3D(const Grid *fine, Grid *coarse){
+
+	//Load fine grid
+	double *fVal = fine->val;
+	long int *fSizeProd = fine->sizeProd;
+	int *nGhostLayers = fine->nGhostLayers;
+
+	//Load coarse grid
+	double *cVal = coarse->val;
+	long int *cSizeProd = coarse->sizeProd;
+	int *cTrueSize = coarse->trueSize;
+	int *cGhostLayers = coarse->nGhostLayers;
+
+	//Weights (2-|dj|)(2-|dk|)(2-|dl|)/64 of the 27 fine nodes
+	long int offset[27];
+	double weight[27];
+	int n = 0;
+	for(int dl = -1; dl <= 1; dl++){
+		for(int dk = -1; dk <= 1; dk++){
+			for(int dj = -1; dj <= 1; dj++){
+				offset[n] = dj*fSizeProd[1] + dk*fSizeProd[2] + dl*fSizeProd[3];
+				weight[n] = (2-abs(dj))*(2-abs(dk))*(2-abs(dl))/64.;
+				n++;
+			}
+		}
+	}
+
+	//Cycle Coarse grid
+	for(int l = 0; l < cTrueSize[3]; l++){
+		for(int k = 0; k < cTrueSize[2]; k++){
+			long int c = (l+cGhostLayers[3])*cSizeProd[3]
+						+ (k+cGhostLayers[2])*cSizeProd[2] + cGhostLayers[1];
+			long int f = (2*l+nGhostLayers[3])*fSizeProd[3]
+						+ (2*k+nGhostLayers[2])*fSizeProd[2] + nGhostLayers[1];
+			for(int j = 0; j < cTrueSize[1]; j++){
+				double sum = 0;
+				for(int m = 0; m < 27; m++) sum += weight[m]*fVal[f+offset[m]];
+				cVal[c] = sum;
+				c++;
+				f += 2;
+			}
+		}
+	}
+
+	return;
+}
+
 void mgHalfRestrict2D(const Grid *fine, Grid *coarse){
 
 	//Load fine grid
@@ -1403,6 +1958,53 @@ void mgResidual(Grid *res, const Grid *rho, const Grid *phi,const MpiInfo *mpiIn
 }
 
 
+void mgResidual4th(Grid *res, const Grid *rho, const Grid *phi,const MpiInfo *mpiInfo){
+
+	//Load
+	long int *sizeProd = res->sizeProd;
+	int rank = res->rank;
+	double *resVal = res->val;
+	double *rhoVal = rho->val;
+
+	gFinDiff4th3D(res, phi);
+
+	for (long int g = 0; g < sizeProd[rank]; g++) resVal[g] += rhoVal[g];
+
+	return;
+}
+
+/*
+ * Right hand side of the compact scheme, rho + nabla^2 rho/12 on the true
+ * nodes. Needs the halo of rho.
+ */
+static void mgCompactSource3D(const Grid *rho, Grid *rhs){
+
+	int *trueSize = rho->trueSize;
+	int *nGhostLayers = rho->nGhostLayers;
+	long int *sizeProd = rho->sizeProd;
+
+	double *rhoVal = rho->val;
+	double *rhsVal = rhs->val;
+
+	long int sj = sizeProd[1];
+	long int sk = sizeProd[2];
+	long int sl = sizeProd[3];
+
+	for(int l = 0; l < trueSize[3]; l++){
+		for(int k = 0; k < trueSize[2]; k++){
+			long int g = (l+nGhostLayers[3])*sl + (k+nGhostLayers[2])*sk
+						+ nGhostLayers[1]*sj;
+			for(int j = 0; j < trueSize[1]; j++){
+				double faces =	rhoVal[g+sj] + rhoVal[g-sj]
+								+rhoVal[g+sk] + rhoVal[g-sk]
+								+rhoVal[g+sl] + rhoVal[g-sl];
+				rhsVal[g] = 0.5*rhoVal[g] + faces/12.;
+				g++;
+			}
+		}
+	}
+}
+
 double mgResMass3D(Grid *grid, MpiInfo *mpiInfo){
 
 	//Load MPI
@@ -1475,7 +2077,7 @@ double mgSumTrueSquared(Grid *error,const MpiInfo *mpiInfo){
 	double sum = gSumTruegrid(error);
 
 	//Reduce
-	MPI_Allreduce(MPI_IN_PLACE, &sum, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+	MPI_Allreduce(MPI_IN_PLACE, &sum, 1, MPI_DOUBLE, MPI_SUM, mpiInfo->comm);
 
 	return sum;
 }
@@ -1490,43 +2092,494 @@ void parseMGOptim(dictionary *ini, Multigrid *multigrid){
 
 
 /*****************************************************
- *			MG CYCLES
+ *			EMBEDDED OBJECTS
  ****************************************************/
 
- void inline static mgVRecursiveInner(int level, int bottom, int top, Multigrid *mgRho, Multigrid *mgPhi,
-  									Multigrid *mgRes, const MpiInfo *mpiInfo){
+/*
+ * Floating conductors embedded in the operator. All nodes of an object share
+ * one potential, and the equations of its nodes are summed into one, stating
+ * that the field lines leaving the object carry its total charge. The
+ * smoother keeps the object nodes fixed while relaxing the free nodes, and
+ * then moves each object as a whole. On the coarser levels the objects are
+ * found by injection and the same constraint holds for the error.
+ */
 
-    
- 	//Solve and return at coarsest level
- 	if(level == bottom){
- 		gHaloOp(setSlice, mgPhi->grids[level], mpiInfo, TOHALO);
-		gHaloOp(setSlice, mgRho->grids[level], mpiInfo, TOHALO);
-		gNeutralizeGrid(mgRho->grids[level], mpiInfo);
- 		mgRho->coarseSolv(mgPhi->grids[level], mgRho->grids[level], mgRho->nCoarseSolve, mpiInfo);
-		gBnd(mgPhi->grids[level], mpiInfo);
- 		mgRho->prolongator(mgRes->grids[level-1], mgPhi->grids[level], mpiInfo);
+// Sets the object nodes of each object to their mean
+static void mgProjectObjects(Multigrid *mgRho, int level, Grid *phi,
+							const MpiInfo *mpiInfo){
 
- 		return;
- 	}
+	int nObjects = mgRho->nObjects;
+	long int *nodes = mgRho->objNodes[level];
+	long int *offset = mgRho->objNodesOffset[level];
+	double *mean = mgRho->objBuffer;
 
- 	//Gathering info
- 	int nPreSmooth = mgRho->nPreSmooth;
- 	int nPostSmooth= mgRho->nPostSmooth;
+	for(int a = 0; a < nObjects; a++){
+		mean[a] = 0;
+		for(long int i = offset[a]; i < offset[a+1]; i++) mean[a] += phi->val[nodes[i]];
+	}
+	MPI_Allreduce(MPI_IN_PLACE, mean, nObjects, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
 
- 	Grid *phi = mgPhi->grids[level];
- 	Grid *rho = mgRho->grids[level];
- 	Grid *res = mgRes->grids[level];
- 	//Boundary
- 	gHaloOp(setSlice, rho, mpiInfo, TOHALO);
- 	gNeutralizeGrid(rho,mpiInfo);
+	for(int a = 0; a < nObjects; a++){
+		if(mgRho->objCount[level][a] == 0) continue;
+		mean[a] /= mgRho->objCount[level][a];
+		for(long int i = offset[a]; i < offset[a+1]; i++) phi->val[nodes[i]] = mean[a];
+	}
 
- 	//Prepare to go down
- 	mgRho->preSmooth(phi, rho, nPreSmooth, mpiInfo);
- 	mgResidual(res, rho, phi, mpiInfo);
- 	gHaloOp(setSlice, res, mpiInfo, TOHALO);
+	gHaloOp(setSlice, phi, mpiInfo, TOHALO);
+	gBnd(phi, mpiInfo);
+}
 
- 	//Go down
- 	mgRho->restrictor(res, mgRho->grids[level + 1]);
+/*
+ * Red and black Gauss-Seidel on the free nodes followed by moving each
+ * object such that the sum of the residuals on its nodes vanishes. Moving an
+ * object by delta changes that sum by -delta per link to a free node.
+ */
+static void mgGS3DObjects(Multigrid *mgRho, int level, Grid *phi,
+						const Grid *rho, int nCycles, const MpiInfo *mpiInfo){
+
+	int *size = phi->size;
+	int *nGhostLayers = phi->nGhostLayers;
+	int rank = phi->rank;
+	long int *sizeProd = phi->sizeProd;
+	double *phiVal = phi->val;
+	double *rhoVal = rho->val;
+	int *mask = mgRho->objMask[level];
+
+	int nObjects = mgRho->nObjects;
+	long int *nodes = mgRho->objNodes[level];
+	long int *offset = mgRho->objNodesOffset[level];
+	double *links = mgRho->objLinks[level];
+	double *sum = mgRho->objBuffer;
+
+	long int gj = sizeProd[1];
+	long int gk = sizeProd[2];
+	long int gl = sizeProd[3];
+	double coeff = 1./6.;
+
+	mgProjectObjects(mgRho, level, phi, mpiInfo);
+
+	for(int c = 0; c < nCycles; c++){
+
+		for(int colour = 0; colour < 2; colour++){
+			for(int l = nGhostLayers[3]; l < size[3]-nGhostLayers[rank+3]; l++){
+				for(int k = nGhostLayers[2]; k < size[2]-nGhostLayers[rank+2]; k++){
+					int j0 = nGhostLayers[1] + (nGhostLayers[1]+k+l+colour)%2;
+					for(int j = j0; j < size[1]-nGhostLayers[rank+1]; j+=2){
+						long int g = j*gj + k*gk + l*gl;
+						if(mask[g]) continue;
+						phiVal[g] = coeff*(	phiVal[g+gj] + phiVal[g-gj] +
+											phiVal[g+gk] + phiVal[g-gk] +
+											phiVal[g+gl] + phiVal[g-gl] + rhoVal[g]);
+					}
+				}
+			}
+			gHaloOp(setSlice, phi, mpiInfo, TOHALO);
+			gBnd(phi, mpiInfo);
+		}
+
+		for(int a = 0; a < nObjects; a++){
+			sum[a] = 0;
+			for(long int i = offset[a]; i < offset[a+1]; i++){
+				long int g = nodes[i];
+				sum[a] += 	phiVal[g+gj] + phiVal[g-gj] +
+							phiVal[g+gk] + phiVal[g-gk] +
+							phiVal[g+gl] + phiVal[g-gl] - 6*phiVal[g] + rhoVal[g];
+			}
+		}
+		MPI_Allreduce(MPI_IN_PLACE, sum, nObjects, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+
+		for(int a = 0; a < nObjects; a++){
+			if(links[a] == 0) continue;
+			double delta = sum[a]/links[a];
+			for(long int i = offset[a]; i < offset[a+1]; i++) phiVal[nodes[i]] += delta;
+		}
+		gHaloOp(setSlice, phi, mpiInfo, TOHALO);
+		gBnd(phi, mpiInfo);
+	}
+}
+
+/*
+ * Smooths with the given smoother, or the object-aware one if objects are
+ * embedded.
+ */
+static void mgSmooth(Multigrid *mgRho, int level, Grid *phi, const Grid *rho,
+					int nCycles, void (*smoother)(Grid *, const Grid *, const int,
+					const MpiInfo *), const MpiInfo *mpiInfo){
+
+	if(mgRho->nObjects) mgGS3DObjects(mgRho, level, phi, rho, nCycles, mpiInfo);
+	else smoother(phi, rho, nCycles, mpiInfo);
+}
+
+/*
+ * Residual on a level. The residuals on the individual nodes of an object
+ * are its induced surface charge rather than an error, so only their sum
+ * (made zero by the smoother) is meaningful, and they are not restricted.
+ */
+static void mgLevelResidual(Multigrid *mgRho, int level, Grid *res,
+							const Grid *rho, const Grid *phi, const MpiInfo *mpiInfo){
+
+	mgRho->residual(res, rho, phi, mpiInfo);
+
+	if(mgRho->nObjects){
+		long int *nodes = mgRho->objNodes[level];
+		long int nNodes = mgRho->objNodesOffset[level][mgRho->nObjects];
+		for(long int i = 0; i < nNodes; i++) res->val[nodes[i]] = 0;
+	}
+}
+
+void mgSetObjects(MultigridSolver *solver, const Grid *domain, const MpiInfo *mpiInfo){
+
+	Multigrid *mgRho = solver->mgRho;
+	int nLevels = mgRho->nLevels;
+	int rank = domain->rank;
+
+	if(rank != 4 || mgRho->fourthOrder)
+		msg(ERROR, "Embedded objects are only implemented for the 3D secondOrder stencil");
+	if(mgRho->agglom || mgRho->directCoarseSolve)
+		msg(ERROR, "Embedded objects do not support agglomeration or the direct coarse solver");
+
+	int nObjects = 0;
+	for(long int g = 0; g < domain->sizeProd[rank]; g++){
+		if(domain->val[g] > nObjects) nObjects = (int)(domain->val[g]+0.5);
+	}
+	MPI_Allreduce(MPI_IN_PLACE, &nObjects, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+
+	if(!nObjects) return;
+
+	mgRho->nObjects = nObjects;
+	mgRho->objMask = malloc(nLevels*sizeof(*mgRho->objMask));
+	mgRho->objNodes = malloc(nLevels*sizeof(*mgRho->objNodes));
+	mgRho->objNodesOffset = malloc(nLevels*sizeof(*mgRho->objNodesOffset));
+	mgRho->objLinks = malloc(nLevels*sizeof(*mgRho->objLinks));
+	mgRho->objCount = malloc(nLevels*sizeof(*mgRho->objCount));
+	mgRho->objBuffer = malloc((nObjects+1)*sizeof(*mgRho->objBuffer));
+
+	// The object (1-based, 0 for none) of each node, by injection from the
+	// level above. Ghosts are filled by a halo exchange.
+	Grid *ids = mgAllocGrid(domain->trueSize, domain->nGhostLayers, domain->bnd, rank);
+	for(long int g = 0; g < domain->sizeProd[rank]; g++) ids->val[g] = domain->val[g];
+
+	for(int q = 0; q < nLevels; q++){
+
+		Grid *level = mgRho->grids[q];
+		int *size = level->size;
+		int *nGhostLayers = level->nGhostLayers;
+		long int *sizeProd = level->sizeProd;
+		long int nNodes = sizeProd[rank];
+
+		if(q > 0){
+			Grid *coarse = mgAllocGrid(level->trueSize, nGhostLayers, level->bnd, rank);
+			gZero(coarse);
+			for(int l = nGhostLayers[3]; l < size[3]-nGhostLayers[rank+3]; l++){
+				for(int k = nGhostLayers[2]; k < size[2]-nGhostLayers[rank+2]; k++){
+					for(int j = nGhostLayers[1]; j < size[1]-nGhostLayers[rank+1]; j++){
+						int J = nGhostLayers[1] + 2*(j-nGhostLayers[1]);
+						int K = nGhostLayers[2] + 2*(k-nGhostLayers[2]);
+						int L = nGhostLayers[3] + 2*(l-nGhostLayers[3]);
+						coarse->val[j*sizeProd[1] + k*sizeProd[2] + l*sizeProd[3]] =
+							ids->val[J*ids->sizeProd[1] + K*ids->sizeProd[2] + L*ids->sizeProd[3]];
+					}
+				}
+			}
+			gHaloOp(setSlice, coarse, mpiInfo, TOHALO);
+			gFree(ids);
+			ids = coarse;
+		}
+
+		int *mask = malloc(nNodes*sizeof(*mask));
+		for(long int g = 0; g < nNodes; g++) mask[g] = ids->val[g] > 0.5 ? (int)(ids->val[g]+0.5) : 0;
+
+		// True object nodes, grouped by object, and their links to other nodes
+		long int *offset = malloc((nObjects+1)*sizeof(*offset));
+		alSetAll(offset, nObjects+1, 0);
+		double *links = malloc((nObjects+1)*sizeof(*links));
+		double *count = malloc((nObjects+1)*sizeof(*count));
+		adSetAll(links, nObjects+1, 0);
+		long int stride[3] = {sizeProd[1], sizeProd[2], sizeProd[3]};
+
+		for(int l = nGhostLayers[3]; l < size[3]-nGhostLayers[rank+3]; l++){
+			for(int k = nGhostLayers[2]; k < size[2]-nGhostLayers[rank+2]; k++){
+				for(int j = nGhostLayers[1]; j < size[1]-nGhostLayers[rank+1]; j++){
+					long int g = j*sizeProd[1] + k*sizeProd[2] + l*sizeProd[3];
+					int a = mask[g];
+					if(!a) continue;
+					offset[a]++;
+					for(int d = 0; d < 3; d++){
+						if(mask[g+stride[d]] != a) links[a-1]++;
+						if(mask[g-stride[d]] != a) links[a-1]++;
+					}
+				}
+			}
+		}
+		for(int a = 0; a < nObjects; a++) count[a] = offset[a+1];
+		for(int a = 0; a < nObjects; a++) offset[a+1] += offset[a];
+
+		long int *nodes = malloc((offset[nObjects]+1)*sizeof(*nodes));
+		long int *index = malloc((nObjects+1)*sizeof(*index));
+		for(int a = 0; a < nObjects; a++) index[a] = offset[a];
+		for(int l = nGhostLayers[3]; l < size[3]-nGhostLayers[rank+3]; l++){
+			for(int k = nGhostLayers[2]; k < size[2]-nGhostLayers[rank+2]; k++){
+				for(int j = nGhostLayers[1]; j < size[1]-nGhostLayers[rank+1]; j++){
+					long int g = j*sizeProd[1] + k*sizeProd[2] + l*sizeProd[3];
+					if(mask[g]) nodes[index[mask[g]-1]++] = g;
+				}
+			}
+		}
+		free(index);
+
+		MPI_Allreduce(MPI_IN_PLACE, links, nObjects, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+		MPI_Allreduce(MPI_IN_PLACE, count, nObjects, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+
+		mgRho->objMask[q] = mask;
+		mgRho->objNodes[q] = nodes;
+		mgRho->objNodesOffset[q] = offset;
+		mgRho->objLinks[q] = links;
+		mgRho->objCount[q] = count;
+	}
+
+	gFree(ids);
+}
+
+/*****************************************************
+ *			MG CYCLES
+ ****************************************************/
+
+/*
+ * Factorizes the operator of the Gauss-Seidel smoothers on the global grid
+ * of which grid is a subdomain, i.e. -nabla^2 with periodic boundaries (7-point
+ * or the 19-point compact stencil).
+ * Since this is singular, the first equation is replaced by sum(phi)=0.
+ */
+static void mgFactorizeCoarse(Multigrid *mgRho, const Grid *grid,
+								const MpiInfo *mpiInfo){
+
+	int rank = grid->rank;
+	int nDims = rank-1;
+	int *nSubdomains = mpiInfo->nSubdomains;
+
+	int *globalSize = malloc(nDims*sizeof(*globalSize));
+	long int *globalSizeProd = malloc((nDims+1)*sizeof(*globalSizeProd));
+	for(int d = 0; d < nDims; d++)
+		globalSize[d] = nSubdomains[d]*grid->trueSize[d+1];
+	ailCumProd(globalSize, globalSizeProd, nDims);
+	long int N = globalSizeProd[nDims];
+
+	if(N > 8192) msg(WARNING, "Direct coarse solver on %li nodes is expensive, "
+						"consider more multigrid levels", N);
+
+	gsl_matrix *A = gsl_matrix_calloc(N, N);
+
+	for(long int i = 0; i < N; i++){
+		if(!mgRho->fourthOrder){
+			gsl_matrix_set(A, i, i, 2.*nDims);
+			for(int d = 0; d < nDims; d++){
+				long int c = (i / globalSizeProd[d]) % globalSize[d];
+				long int up = (c + 1) % globalSize[d];
+				long int down = (c - 1 + globalSize[d]) % globalSize[d];
+				long int iUp = i + (up - c)*globalSizeProd[d];
+				long int iDown = i + (down - c)*globalSizeProd[d];
+				// Accumulate since the neighbours coincide for small grids
+				gsl_matrix_set(A, i, iUp, gsl_matrix_get(A, i, iUp) - 1.);
+				gsl_matrix_set(A, i, iDown, gsl_matrix_get(A, i, iDown) - 1.);
+			}
+		} else {
+			// 19-point compact stencil, see gFinDiff4th3D()
+			for(int n = 0; n < 27; n++){
+				int delta[3] = {n%3 - 1, (n/3)%3 - 1, n/9 - 1};
+				int nNonZero = abs(delta[0]) + abs(delta[1]) + abs(delta[2]);
+				if(nNonZero == 3) continue;
+
+				long int j = 0;
+				for(int d = 0; d < nDims; d++){
+					long int c = (i / globalSizeProd[d]) % globalSize[d];
+					long int cn = (c + delta[d] + globalSize[d]) % globalSize[d];
+					j += cn*globalSizeProd[d];
+				}
+
+				double coeff = nNonZero == 0 ? 4. : (nNonZero == 1 ? -1./3. : -1./6.);
+				gsl_matrix_set(A, i, j, gsl_matrix_get(A, i, j) + coeff);
+			}
+		}
+	}
+	for(long int j = 0; j < N; j++) gsl_matrix_set(A, 0, j, 1.);
+
+	int signum;
+	gsl_permutation *perm = gsl_permutation_alloc(N);
+	gsl_linalg_LU_decomp(A, perm, &signum);
+
+	long int nTrue = aiProd(grid->trueSize, rank);
+
+	mgRho->coarseLU = A;
+	mgRho->coarsePerm = perm;
+	mgRho->coarseBuffer = malloc((N + nTrue)*sizeof(double));
+
+	free(globalSize);
+	free(globalSizeProd);
+}
+
+/*
+ * Solves exactly on the coarsest level using the cached factorization. The
+ * right hand side is gathered on all ranks, which solve redundantly.
+ */
+static void mgDirectSolve(Multigrid *mgRho, Grid *phi, const Grid *rho,
+							const MpiInfo *mpiInfo){
+
+	if(!mgRho->coarseLU) mgFactorizeCoarse(mgRho, rho, mpiInfo);
+
+	int rank = rho->rank;
+	int nDims = rank-1;
+	int *subdomain = mpiInfo->subdomain;
+	int *trueSize = rho->trueSize;
+	long int N = mgRho->coarseLU->size1;
+	long int nTrue = aiProd(trueSize, rank);
+
+	double *b = mgRho->coarseBuffer;
+	double *gathered = malloc(N*sizeof(*gathered));
+	int *shift = calloc(nDims, sizeof(*shift));
+
+	// Subdomain blocks of true nodes are gathered in rank order
+	double *send = &b[N];
+	for(long int t = 0; t < nTrue; t++)
+		send[t] = rho->val[mgBlockIndex(rho, trueSize, t, shift)];
+	MPI_Allgather(send, nTrue, MPI_DOUBLE, gathered, nTrue, MPI_DOUBLE,
+					mpiInfo->comm);
+
+	// Reorder to global lexicographic order
+	long int globalProd = 1;
+	long int *globalSizeProd = malloc((nDims+1)*sizeof(*globalSizeProd));
+	for(int d = 0; d < nDims; d++){
+		globalSizeProd[d] = globalProd;
+		globalProd *= mpiInfo->nSubdomains[d]*trueSize[d+1];
+	}
+	for(int r = 0; r < mpiInfo->mpiSize; r++){
+		int temp = r;
+		long int offset = 0;
+		for(int d = 0; d < nDims; d++){
+			offset += (temp % mpiInfo->nSubdomains[d])*trueSize[d+1]*globalSizeProd[d];
+			temp /= mpiInfo->nSubdomains[d];
+		}
+		for(long int t = 0; t < nTrue; t++){
+			long int i = offset, temp2 = t;
+			for(int d = 0; d < nDims; d++){
+				i += (temp2 % trueSize[d+1])*globalSizeProd[d];
+				temp2 /= trueSize[d+1];
+			}
+			b[i] = gathered[r*nTrue + t];
+		}
+	}
+
+	// Make the system consistent and replace the first equation
+	double mean = adSum(b, N)/N;
+	for(long int i = 0; i < N; i++) b[i] -= mean;
+	b[0] = 0.;
+
+	gsl_vector_view x = gsl_vector_view_array(b, N);
+	gsl_linalg_LU_svx(mgRho->coarseLU, mgRho->coarsePerm, &x.vector);
+
+	// Extract own subdomain
+	long int offset = 0;
+	for(int d = 0; d < nDims; d++)
+		offset += subdomain[d]*trueSize[d+1]*globalSizeProd[d];
+	for(long int t = 0; t < nTrue; t++){
+		long int i = offset, temp = t;
+		for(int d = 0; d < nDims; d++){
+			i += (temp % trueSize[d+1])*globalSizeProd[d];
+			temp /= trueSize[d+1];
+		}
+		phi->val[mgBlockIndex(phi, trueSize, t, shift)] = b[i];
+	}
+
+	gHaloOp(setSlice, phi, mpiInfo, TOHALO);
+
+	free(gathered);
+	free(shift);
+	free(globalSizeProd);
+}
+
+/*
+ * Solves on the coarsest level. If the coarsest level is agglomerated, the
+ * V cycle continues on the global grid which is held redundantly by all ranks.
+ */
+static void mgCoarseSolve(int bottom, Multigrid *mgRho, Multigrid *mgPhi,
+						Multigrid *mgRes, const MpiInfo *mpiInfo){
+
+	Grid *phi = mgPhi->grids[bottom];
+	Grid *rho = mgRho->grids[bottom];
+
+	if(!mgRho->agglom){
+		if(mgRho->directCoarseSolve) mgDirectSolve(mgRho, phi, rho, mpiInfo);
+		else mgSmooth(mgRho, bottom, phi, rho, mgRho->nCoarseSolve, mgRho->coarseSolv, mpiInfo);
+		return;
+	}
+
+	Multigrid *agRho = mgRho->agglom;
+	Multigrid *agPhi = mgPhi->agglom;
+	Multigrid *agRes = mgRes->agglom;
+	const MpiInfo *agMpiInfo = mgRho->agglomMpiInfo;
+
+	mgGatherAgglom(rho, agRho->grids[0], mgRho->agglomBuffer, mpiInfo);
+	mgGatherAgglom(phi, agPhi->grids[0], mgPhi->agglomBuffer, mpiInfo);
+
+	int agBottom = agRho->nLevels-1;
+	if(agBottom > 0){
+		mgVRecursive(0, agBottom, 0, agRho, agPhi, agRes, agMpiInfo);
+	} else {
+		gHaloOp(setSlice, agRho->grids[0], agMpiInfo, TOHALO);
+		gHaloOp(setSlice, agPhi->grids[0], agMpiInfo, TOHALO);
+		mgCoarseSolve(0, agRho, agPhi, agRes, agMpiInfo);
+	}
+
+	mgScatterAgglom(agPhi->grids[0], phi, mpiInfo);
+	gHaloOp(setSlice, phi, mpiInfo, TOHALO);
+}
+
+/*
+ * Restricts a source term from level to level+1. The stencils are not scaled
+ * by the grid spacing, so the coarse source is multiplied by (2h/h)^2.
+ */
+static void mgRestrictSource(const Grid *fine, int level, Multigrid *mgRho){
+
+	Grid *coarse = mgRho->grids[level+1];
+
+	mgRho->restrictor(fine, coarse);
+	gMul(coarse, 4.);
+}
+
+ void inline static mgVRecursiveInner(int level, int bottom, int top, Multigrid *mgRho, Multigrid *mgPhi,
+  									Multigrid *mgRes, const MpiInfo *mpiInfo){
+
+    
+ 	//Solve and return at coarsest level
+ 	if(level == bottom){
+ 		gHaloOp(setSlice, mgPhi->grids[level], mpiInfo, TOHALO);
+		gHaloOp(setSlice, mgRho->grids[level], mpiInfo, TOHALO);
+		gNeutralizeGrid(mgRho->grids[level], mpiInfo);
+ 		mgCoarseSolve(level, mgRho, mgPhi, mgRes, mpiInfo);
+		gBnd(mgPhi->grids[level], mpiInfo);
+ 		mgRho->prolongator(mgRes->grids[level-1], mgPhi->grids[level], mpiInfo);
+
+ 		return;
+ 	}
+
+ 	//Gathering info
+ 	int nPreSmooth = mgRho->nPreSmooth;
+ 	int nPostSmooth= mgRho->nPostSmooth;
+
+ 	Grid *phi = mgPhi->grids[level];
+ 	Grid *rho = mgRho->grids[level];
+ 	Grid *res = mgRes->grids[level];
+ 	//Boundary
+ 	gHaloOp(setSlice, rho, mpiInfo, TOHALO);
+ 	gNeutralizeGrid(rho,mpiInfo);
+
+ 	//Prepare to go down
+ 	mgSmooth(mgRho, level, phi, rho, nPreSmooth, mgRho->preSmooth, mpiInfo);
+ 	mgLevelResidual(mgRho, level, res, rho, phi, mpiInfo);
+ 	gHaloOp(setSlice, res, mpiInfo, TOHALO);
+
+ 	//Go down
+ 	mgRestrictSource(res, level, mgRho);
+ 	gZero(mgPhi->grids[level + 1]);
 
 	//Repeat level + 1
  	mgVRecursiveInner(level + 1, bottom, top, mgRho, mgPhi, mgRes, mpiInfo);
@@ -1536,7 +2589,7 @@ void parseMGOptim(dictionary *ini, Multigrid *multigrid){
 
  	gHaloOp(setSlice, phi,mpiInfo, TOHALO);
  	gBnd(phi,mpiInfo);
- 	mgRho->postSmooth(phi, rho, nPostSmooth, mpiInfo);
+ 	mgSmooth(mgRho, level, phi, rho, nPostSmooth, mgRho->postSmooth, mpiInfo);
 	gBnd(phi, mpiInfo);
 
  	//Go up
@@ -1562,7 +2615,6 @@ void mgVRegular(int level, int bottom, int top, Multigrid *mgRho, Multigrid *mgP
 	//Gathering info
 	int nPreSmooth = mgRho->nPreSmooth;
 	int nPostSmooth= mgRho->nPostSmooth;
-	int nCoarseSolv= mgRho->nCoarseSolve;
 
 	//Needed grids
 	Grid *phi;
@@ -1570,15 +2622,12 @@ void mgVRegular(int level, int bottom, int top, Multigrid *mgRho, Multigrid *mgP
 	Grid *res;
 
 	//Solvers
-	void (*coarseSolv)(Grid *phi, const Grid *rho, const int nCycles,
-		const MpiInfo *mpiInfo) = mgRho->coarseSolv;
 	void (*postSmooth)(Grid *phi, const Grid *rho, const int nCycles,
 		const MpiInfo *mpiInfo) = mgRho->postSmooth;
 	void (*preSmooth)(Grid *phi, const Grid *rho, const int nCycles,
 		const MpiInfo *mpiInfo) = mgRho->preSmooth;
 
 	//Restriction/Prolongators
-	void (*restrictor)(const Grid *fine, Grid *coarse) = mgRho->restrictor;
 	void (*prolongator)(Grid *fine, const Grid *coarse,
 						const MpiInfo *mpiInfo) = mgRho->prolongator;
 
@@ -1595,17 +2644,17 @@ void mgVRegular(int level, int bottom, int top, Multigrid *mgRho, Multigrid *mgP
 		gNeutralizeGrid(rho, mpiInfo);
 
 
-		preSmooth(phi, rho, nPreSmooth, mpiInfo);
+		mgSmooth(mgRho, current, phi, rho, nPreSmooth, preSmooth, mpiInfo);
 
 		gHaloOp(setSlice, rho, mpiInfo, TOHALO);
 		gBnd(phi, mpiInfo);
 
 		gZero(res);
-		mgResidual(res, rho, phi, mpiInfo);
+		mgLevelResidual(mgRho, current, res, rho, phi, mpiInfo);
 
 		gHaloOp(setSlice, res, mpiInfo, TOHALO);
 
-		restrictor(res, mgRho->grids[current + 1]);
+		mgRestrictSource(res, current, mgRho);
 	}
 
 	rho = mgRho->grids[bottom];
@@ -1618,7 +2667,7 @@ void mgVRegular(int level, int bottom, int top, Multigrid *mgRho, Multigrid *mgP
 
 	//Solve at coarsest
 	gHaloOp(setSlice, rho, mpiInfo, TOHALO);
-	coarseSolv(phi, rho, nCoarseSolv, mpiInfo);
+	mgCoarseSolve(bottom, mgRho, mgPhi, mgRes, mpiInfo);
 
 	//Send up
 	gHaloOp(setSlice, phi, mpiInfo, TOHALO);
@@ -1640,7 +2689,7 @@ void mgVRegular(int level, int bottom, int top, Multigrid *mgRho, Multigrid *mgP
 		gHaloOp(setSlice, phi,mpiInfo, TOHALO);
 		gBnd(phi,mpiInfo);
 
-		postSmooth(phi, rho, nPostSmooth, mpiInfo);
+		mgSmooth(mgRho, current, phi, rho, nPostSmooth, postSmooth, mpiInfo);
 		gBnd(phi, mpiInfo);
 
 		if(current > top) prolongator(mgRes->grids[current-1], phi, mpiInfo);
@@ -1649,61 +2698,168 @@ void mgVRegular(int level, int bottom, int top, Multigrid *mgRho, Multigrid *mgP
 	return;
 }
 
+static void mgCycleInner(int level, int bottom, int gamma, Multigrid *mgRho,
+						Multigrid *mgPhi, Multigrid *mgRes, const MpiInfo *mpiInfo){
+
+	Grid *phi = mgPhi->grids[level];
+	Grid *rho = mgRho->grids[level];
+	Grid *res = mgRes->grids[level];
+
+	//Solve and return at coarsest level
+	if(level == bottom){
+		gHaloOp(setSlice, phi, mpiInfo, TOHALO);
+		gHaloOp(setSlice, rho, mpiInfo, TOHALO);
+		gNeutralizeGrid(rho, mpiInfo);
+		mgCoarseSolve(level, mgRho, mgPhi, mgRes, mpiInfo);
+		gBnd(phi, mpiInfo);
+		return;
+	}
+
+	//Boundary
+	gHaloOp(setSlice, rho, mpiInfo, TOHALO);
+	gNeutralizeGrid(rho, mpiInfo);
+
+	//Prepare to go down
+	mgSmooth(mgRho, level, phi, rho, mgRho->nPreSmooth, mgRho->preSmooth, mpiInfo);
+	mgLevelResidual(mgRho, level, res, rho, phi, mpiInfo);
+	gHaloOp(setSlice, res, mpiInfo, TOHALO);
+
+	//Go down, the coarse grid error equation starts from a zero guess
+	mgRestrictSource(res, level, mgRho);
+	gZero(mgPhi->grids[level+1]);
+
+	if(gamma){
+		for(int g = 0; g < gamma; g++)
+			mgCycleInner(level+1, bottom, gamma, mgRho, mgPhi, mgRes, mpiInfo);
+	} else {
+		//F-cycle: an F-cycle followed by a V-cycle on the coarser level
+		mgCycleInner(level+1, bottom, 0, mgRho, mgPhi, mgRes, mpiInfo);
+		mgCycleInner(level+1, bottom, 1, mgRho, mgPhi, mgRes, mpiInfo);
+	}
+
+	//Prepare to go up
+	mgRho->prolongator(res, mgPhi->grids[level+1], mpiInfo);
+	gAddTo(phi, res);
+
+	gHaloOp(setSlice, phi, mpiInfo, TOHALO);
+	gBnd(phi, mpiInfo);
+	mgSmooth(mgRho, level, phi, rho, mgRho->nPostSmooth, mgRho->postSmooth, mpiInfo);
+	gBnd(phi, mpiInfo);
+}
+
+void mgW(int level, int bottom, int top, Multigrid *mgRho, Multigrid *mgPhi,
+			Multigrid *mgRes, const MpiInfo *mpiInfo){
+
+	mgCycleInner(level, bottom, 2, mgRho, mgPhi, mgRes, mpiInfo);
+}
+
+void mgF(int level, int bottom, int top, Multigrid *mgRho, Multigrid *mgPhi,
+			Multigrid *mgRes, const MpiInfo *mpiInfo){
+
+	mgCycleInner(level, bottom, 0, mgRho, mgPhi, mgRes, mpiInfo);
+}
+
 void mgFMG(int level, int bottom, int top, Multigrid *mgRho, Multigrid *mgPhi,
  			Multigrid *mgRes, const MpiInfo *mpiInfo){
-	//Info
-	Grid **rho = &mgRho->grids[0];;
-	Grid **rhoNext;
-	void (*restrictor)(const Grid *fine, Grid *coarse) = mgRho->restrictor;
 
 	//Restrict down problem
-	for(int current = 0; current < bottom; current ++){
-		rhoNext = &mgRho->grids[current+1];
+	for(int current = level; current < bottom; current ++){
+		gHaloOp(setSlice, mgRho->grids[current], mpiInfo, TOHALO);
+		gNeutralizeGrid(mgRho->grids[current], mpiInfo);
+		mgRestrictSource(mgRho->grids[current], current, mgRho);
+	}
+
+	//Solve problem on the coarsest level
+	Grid *phi = mgPhi->grids[bottom];
+	gZero(phi);
+	gHaloOp(setSlice, mgRho->grids[bottom], mpiInfo, TOHALO);
+	gNeutralizeGrid(mgRho->grids[bottom], mpiInfo);
+	mgCoarseSolve(bottom, mgRho, mgPhi, mgRes, mpiInfo);
+	gBnd(phi, mpiInfo);
 
-		gHaloOp(setSlice, *rho, mpiInfo,TOHALO);
-		restrictor(*rho, *rhoNext);
+	//Nested iteration, each level starts from the next coarser solution
+	for(int current = bottom-1; current >= level; current --){
+		phi = mgPhi->grids[current];
 
-		*rho = *rhoNext;
-	}
+		mgRho->prolongator(phi, mgPhi->grids[current+1], mpiInfo);
+		gBnd(phi, mpiInfo);
 
-	//Solve problem
-	mgVRecursive(bottom, bottom, 0, mgRho, mgPhi, mgRes, mpiInfo);
+		mgCycleInner(current, bottom, 1, mgRho, mgPhi, mgRes, mpiInfo);
+	}
 
 	return;
 }
 
-void mgW(int level, int bottom, int top, Multigrid *mgRho, Multigrid *mgPhi,
-			Multigrid *mgRes, const MpiInfo *mpiInfo){
+static double mgResidualNorm(Multigrid *mgRho, Multigrid *mgPhi,
+							Multigrid *mgRes, const MpiInfo *mpiInfo){
+
+	mgLevelResidual(mgRho, 0, mgRes->grids[0], mgRho->grids[0], mgPhi->grids[0], mpiInfo);
+	gHaloOp(setSlice, mgRes->grids[0], mpiInfo, TOHALO);
+
+	double barRes = mgSumTrueSquared(mgRes->grids[0], mpiInfo);
+	barRes /= gTotTruesize(mgRho->grids[0], mpiInfo);
+
+	return sqrt(barRes);
+}
+
+/*
+ * Iterates mgAlgo until the RMS residual is below tol and returns the number
+ * of cycles spent. FMG only makes sense as the first cycle, since it discards
+ * the current guess, so it is followed by V-cycles if more are needed.
+ */
+static int mgSolveTol(funPtr mgAlgo, double tol, Multigrid *mgRho,
+						Multigrid *mgPhi, Multigrid *mgRes, const MpiInfo *mpiInfo){
 
-	int middle = bottom/2;
+	int bottom = mgRho->nLevels-1;
+	int nCycles = 0;
+	double barRes;
 
-	mgVRecursive(0, bottom, middle, mgRho, mgPhi, mgRes, mpiInfo);
-	mgVRecursive(middle, bottom, 0, mgRho, mgPhi, mgRes, mpiInfo);
+	do{
+		mgAlgo(0, bottom, 0, mgRho, mgPhi, mgRes, mpiInfo);
+		if(mgAlgo == (funPtr)&mgFMG) mgAlgo = (funPtr)&mgVRecursive;
+		barRes = mgResidualNorm(mgRho, mgPhi, mgRes, mpiInfo);
+		nCycles++;
+	} while(barRes > tol);
 
+	return nCycles;
 }
 
+/*
+ * With the compact stencil all levels are solved with the transformed source
+ * on the finest level, which temporarily replaces mgRho->grids[0]. Returns
+ * the original source, to be put back with mgRestoreSource().
+ */
+static Grid *mgPrepareSource(Multigrid *mgRho, const MpiInfo *mpiInfo){
+
+	Grid *rho = mgRho->grids[0];
+	if(!mgRho->fourthOrder) return rho;
 
+	if(!mgRho->compactRho)
+		mgRho->compactRho = mgAllocGrid(rho->trueSize, rho->nGhostLayers,
+										rho->bnd, rho->rank);
 
+	gHaloOp(setSlice, rho, mpiInfo, TOHALO);
+	mgCompactSource3D(rho, mgRho->compactRho);
+	mgRho->grids[0] = mgRho->compactRho;
+
+	return rho;
+}
+
+static void mgRestoreSource(Multigrid *mgRho, Grid *rho){
+	mgRho->grids[0] = rho;
+}
 
 void mgSolveRaw(funPtr mgAlgo, Multigrid *mgRho, Multigrid *mgPhi, Multigrid *mgRes, const MpiInfo *mpiInfo){
 
 	int nMGCycles = mgRho->nMGCycles;
-	int bottom = mgRho->nLevels-1;
 	int nLevels = mgRho->nLevels;
 
+	Grid *source = mgPrepareSource(mgRho, mpiInfo);
+
 	// gZero(mgPhi->grids[0]);
 	double tol = 1.E-10;
-	double barRes = 2.;
 	if(nLevels >1){
-		while(barRes > tol){
-			mgAlgo(0, bottom, 0, mgRho, mgPhi, mgRes, mpiInfo);
-			mgResidual(mgRes->grids[0],mgRho->grids[0], mgPhi->grids[0], mpiInfo);
-			gHaloOp(setSlice, mgRes->grids[0],mpiInfo,TOHALO);
-			barRes = mgSumTrueSquared(mgRes->grids[0],mpiInfo);
-			barRes /= gTotTruesize(mgRho->grids[0],mpiInfo);
-			barRes = sqrt(barRes);
-			//msg(STATUS, "barRes = %f", barRes);
-		}
+		mgSolveTol(mgAlgo, tol, mgRho, mgPhi, mgRes, mpiInfo);
 		// for(int c = 0; c < nMGCycles; c++){
 		// 	mgAlgo(0, bottom, 0, mgRho, mgPhi, mgRes, mpiInfo);
 		//
@@ -1711,19 +2867,356 @@ void mgSolveRaw(funPtr mgAlgo, Multigrid *mgRho, Multigrid *mgPhi, Multigrid *mg
 	}	else {
 		for(int c = 0; c < nMGCycles; c++){
 
-			Grid *phi = mgPhi->grids[0];
 			Grid *rho = mgRho->grids[0];
 			gHaloOp(setSlice, rho, mpiInfo, TOHALO);
 			gBnd(rho, mpiInfo);
-			mgRho->coarseSolv(phi, rho,
-								mgRho->nCoarseSolve, mpiInfo);
+			mgCoarseSolve(0, mgRho, mgPhi, mgRes, mpiInfo);
 		}
 	}
 
+	mgRestoreSource(mgRho, source);
+
 	return;
 }
 
 
+/*************************************************
+ *		BATCHED SOLVES
+ ************************************************/
+
+/*
+ * The batched grids hold nBatch independent right hand sides per node, i.e.
+ * size[0] = nBatch. Components of a node are contiguous, so every kernel has
+ * the component loop innermost, and a halo exchange moves all of them in one
+ * message. Only the 7-point stencil in 3D is implemented.
+ */
+
+// Removes the mean of each component separately
+static void mgNeutralizeBatch(Grid *grid, const MpiInfo *mpiInfo){
+
+	int nBatch = grid->size[0];
+	int *trueSize = grid->trueSize;
+	int *nGhostLayers = grid->nGhostLayers;
+	long int *sizeProd = grid->sizeProd;
+	double *val = grid->val;
+
+	double *mean = malloc(nBatch*sizeof(*mean));
+	adSetAll(mean, nBatch, 0);
+
+	for(int l = 0; l < trueSize[3]; l++){
+		for(int k = 0; k < trueSize[2]; k++){
+			long int g = (l+nGhostLayers[3])*sizeProd[3] + (k+nGhostLayers[2])*sizeProd[2]
+						+ nGhostLayers[1]*sizeProd[1];
+			for(int j = 0; j < trueSize[1]; j++){
+				for(int b = 0; b < nBatch; b++) mean[b] += val[g+b];
+				g += nBatch;
+			}
+		}
+	}
+
+	MPI_Allreduce(MPI_IN_PLACE, mean, nBatch, MPI_DOUBLE, MPI_SUM, mpiInfo->comm);
+
+	double nTot = (double)aiProd(&trueSize[1], 3)*mpiInfo->mpiSize;
+	for(int b = 0; b < nBatch; b++) mean[b] /= nTot;
+
+	for(long int g = 0; g < sizeProd[4]; g += nBatch){
+		for(int b = 0; b < nBatch; b++) val[g+b] -= mean[b];
+	}
+
+	free(mean);
+}
+
+static bool mgPeriodicBatch(const Grid *grid){
+
+	bool periodic = false;
+	for(int d = 1; d < 4; d++){
+		if(grid->bnd[d] == PERIODIC) periodic = true;
+	}
+	return periodic;
+}
+
+static void mgBndBatch(Grid *grid, const MpiInfo *mpiInfo){
+
+	if(mgPeriodicBatch(grid)) mgNeutralizeBatch(grid, mpiInfo);
+
+	gBndEdges(grid, mpiInfo);
+}
+
+static void mgGS3DBatch(Grid *phi, const Grid *rho, int nCycles, const MpiInfo *mpiInfo){
+
+	int nBatch = phi->size[0];
+	int *trueSize = phi->trueSize;
+	int *nGhostLayers = phi->nGhostLayers;
+	long int *sizeProd = phi->sizeProd;
+
+	double *phiVal = phi->val;
+	double *rhoVal = rho->val;
+
+	long int sj = sizeProd[1];
+	long int sk = sizeProd[2];
+	long int sl = sizeProd[3];
+
+	double coeff = 1./6.;
+
+	for(int c = 0; c < nCycles; c++){
+		for(int colour = 0; colour < 2; colour++){
+
+			for(int l = 0; l < trueSize[3]; l++){
+				for(int k = 0; k < trueSize[2]; k++){
+					int jStart = (k+l+colour) & 1;
+					long int g = (l+nGhostLayers[3])*sl + (k+nGhostLayers[2])*sk
+								+ (jStart+nGhostLayers[1])*sj;
+					for(int j = jStart; j < trueSize[1]; j += 2){
+						for(int b = 0; b < nBatch; b++){
+							phiVal[g+b] = coeff*(	phiVal[g+b+sj] + phiVal[g+b-sj] +
+													phiVal[g+b+sk] + phiVal[g+b-sk] +
+													phiVal[g+b+sl] + phiVal[g+b-sl] +
+													rhoVal[g+b]);
+						}
+						g += 2*sj;
+					}
+				}
+			}
+
+			gHaloOp(setSlice, phi, mpiInfo, TOHALO);
+			mgBndBatch(phi, mpiInfo);
+		}
+	}
+}
+
+// Half weight restriction, scaled by (2h/h)^2 like mgRestrictSource()
+static void mgRestrictBatch(const Grid *fine, Grid *coarse){
+
+	int nBatch = fine->size[0];
+	int *nGhostLayers = fine->nGhostLayers;
+	long int *fSizeProd = fine->sizeProd;
+	long int *cSizeProd = coarse->sizeProd;
+	int *cTrueSize = coarse->trueSize;
+	int *cGhostLayers = coarse->nGhostLayers;
+
+	double *fVal = fine->val;
+	double *cVal = coarse->val;
+
+	long int sj = fSizeProd[1];
+	long int sk = fSizeProd[2];
+	long int sl = fSizeProd[3];
+
+	double coeff = 4./12.;
+
+	for(int l = 0; l < cTrueSize[3]; l++){
+		for(int k = 0; k < cTrueSize[2]; k++){
+			long int c = (l+cGhostLayers[3])*cSizeProd[3]
+						+ (k+cGhostLayers[2])*cSizeProd[2] + cGhostLayers[1]*cSizeProd[1];
+			long int f = (2*l+nGhostLayers[3])*sl + (2*k+nGhostLayers[2])*sk
+						+ nGhostLayers[1]*sj;
+			for(int j = 0; j < cTrueSize[1]; j++){
+				for(int b = 0; b < nBatch; b++){
+					cVal[c+b] = coeff*(	6*fVal[f+b] +
+										fVal[f+b+sj] + fVal[f+b-sj] +
+										fVal[f+b+sk] + fVal[f+b-sk] +
+										fVal[f+b+sl] + fVal[f+b-sl]);
+				}
+				c += nBatch;
+				f += 2*sj;
+			}
+		}
+	}
+}
+
+// Trilinear interpolation from coarse (including its halo) to fine true nodes
+static void mgProlongBatch(Grid *fine, Grid *coarse, const MpiInfo *mpiInfo){
+
+	int nBatch = fine->size[0];
+	int *fTrueSize = fine->trueSize;
+	int *nGhostLayers = fine->nGhostLayers;
+	int *cGhostLayers = coarse->nGhostLayers;
+	long int *fSizeProd = fine->sizeProd;
+	long int *cSizeProd = coarse->sizeProd;
+
+	double *fVal = fine->val;
+	double *cVal = coarse->val;
+
+	gHaloOp(setSlice, coarse, mpiInfo, TOHALO);
+
+	for(int l = 0; l < fTrueSize[3]; l++){
+		for(int k = 0; k < fTrueSize[2]; k++){
+			long int f = (l+nGhostLayers[3])*fSizeProd[3]
+						+ (k+nGhostLayers[2])*fSizeProd[2] + nGhostLayers[1]*fSizeProd[1];
+			for(int j = 0; j < fTrueSize[1]; j++){
+
+				// Coarse nodes at or below, and the offsets to use above
+				long int c = (l/2+cGhostLayers[3])*cSizeProd[3]
+							+ (k/2+cGhostLayers[2])*cSizeProd[2]
+							+ (j/2+cGhostLayers[1])*cSizeProd[1];
+				long int cj = (j%2)*cSizeProd[1];
+				long int ck = (k%2)*cSizeProd[2];
+				long int cl = (l%2)*cSizeProd[3];
+
+				for(int b = 0; b < nBatch; b++){
+					fVal[f+b] = 0.125*(	cVal[c+b]			+ cVal[c+b+cj] +
+										cVal[c+b+ck]		+ cVal[c+b+cj+ck] +
+										cVal[c+b+cl]		+ cVal[c+b+cj+cl] +
+										cVal[c+b+ck+cl]		+ cVal[c+b+cj+ck+cl]);
+				}
+				f += nBatch;
+			}
+		}
+	}
+
+	gHaloOp(setSlice, fine, mpiInfo, TOHALO);
+}
+
+static void mgVBatch(int level, Multigrid *mgRho, Multigrid *mgPhi,
+					Multigrid *mgRes, const MpiInfo *mpiInfo){
+
+	Grid *phi = mgPhi->grids[level];
+	Grid *rho = mgRho->grids[level];
+	Grid *res = mgRes->grids[level];
+
+	gHaloOp(setSlice, rho, mpiInfo, TOHALO);
+	if(mgPeriodicBatch(rho)) mgNeutralizeBatch(rho, mpiInfo);
+
+	if(level == mgRho->nLevels-1){
+		mgGS3DBatch(phi, rho, mgRho->nCoarseSolve, mpiInfo);
+		return;
+	}
+
+	mgGS3DBatch(phi, rho, mgRho->nPreSmooth, mpiInfo);
+	mgResidual(res, rho, phi, mpiInfo);
+	gHaloOp(setSlice, res, mpiInfo, TOHALO);
+
+	mgRestrictBatch(res, mgRho->grids[level+1]);
+	gZero(mgPhi->grids[level+1]);
+
+	mgVBatch(level+1, mgRho, mgPhi, mgRes, mpiInfo);
+
+	mgProlongBatch(res, mgPhi->grids[level+1], mpiInfo);
+	gAddTo(phi, res);
+	mgBndBatch(phi, mpiInfo);
+
+	mgGS3DBatch(phi, rho, mgRho->nPostSmooth, mpiInfo);
+}
+
+// Largest RMS residual of the components
+static double mgResidualNormBatch(Multigrid *mgRho, Multigrid *mgPhi,
+								Multigrid *mgRes, const MpiInfo *mpiInfo){
+
+	Grid *res = mgRes->grids[0];
+	int nBatch = res->size[0];
+	int *trueSize = res->trueSize;
+	int *nGhostLayers = res->nGhostLayers;
+	long int *sizeProd = res->sizeProd;
+
+	mgResidual(res, mgRho->grids[0], mgPhi->grids[0], mpiInfo);
+
+	double *sum = malloc(nBatch*sizeof(*sum));
+	adSetAll(sum, nBatch, 0);
+
+	for(int l = 0; l < trueSize[3]; l++){
+		for(int k = 0; k < trueSize[2]; k++){
+			long int g = (l+nGhostLayers[3])*sizeProd[3] + (k+nGhostLayers[2])*sizeProd[2]
+						+ nGhostLayers[1]*sizeProd[1];
+			for(int j = 0; j < trueSize[1]; j++){
+				for(int b = 0; b < nBatch; b++) sum[b] += res->val[g+b]*res->val[g+b];
+				g += nBatch;
+			}
+		}
+	}
+
+	MPI_Allreduce(MPI_IN_PLACE, sum, nBatch, MPI_DOUBLE, MPI_SUM, mpiInfo->comm);
+
+	double nTot = (double)aiProd(&trueSize[1], 3)*mpiInfo->mpiSize;
+	double barRes = 0;
+	for(int b = 0; b < nBatch; b++){
+		double rms = sqrt(sum[b]/nTot);
+		if(rms > barRes) barRes = rms;
+	}
+
+	free(sum);
+	return barRes;
+}
+
+Multigrid *mgAllocBatch(const Multigrid *multigrid, Grid *grid){
+
+	int nLevels = multigrid->nLevels;
+	int rank = grid->rank;
+
+	if(rank != 4 || multigrid->fourthOrder)
+		msg(ERROR, "Batched multigrid is only implemented for the 3D secondOrder stencil");
+
+	Grid **grids = malloc(nLevels*sizeof(*grids));
+	grids[0] = grid;
+
+	int *trueSize = malloc(rank*sizeof(*trueSize));
+	for(int q = 1; q < nLevels; q++){
+		const Grid *level = multigrid->grids[q];
+		trueSize[0] = grid->trueSize[0];
+		for(int d = 1; d < rank; d++) trueSize[d] = level->trueSize[d];
+		grids[q] = mgAllocGrid(trueSize, level->nGhostLayers, level->bnd, rank);
+	}
+	free(trueSize);
+
+	Multigrid *batch = malloc(sizeof(*batch));
+
+	batch->grids = grids;
+	batch->nLevels = nLevels;
+	batch->nMGCycles = multigrid->nMGCycles;
+	batch->nPreSmooth = multigrid->nPreSmooth;
+	batch->nPostSmooth = multigrid->nPostSmooth;
+	batch->nCoarseSolve = multigrid->nCoarseSolve;
+
+	batch->coarseSolv = NULL;
+	batch->preSmooth = NULL;
+	batch->postSmooth = NULL;
+	batch->restrictor = NULL;
+	batch->prolongator = NULL;
+	batch->residual = NULL;
+
+	batch->agglom = NULL;
+	batch->agglomMpiInfo = NULL;
+	batch->agglomBuffer = NULL;
+	batch->directCoarseSolve = false;
+	batch->coarseLU = NULL;
+	batch->coarsePerm = NULL;
+	batch->coarseBuffer = NULL;
+	batch->fourthOrder = false;
+	batch->compactRho = NULL;
+	batch->nObjects = 0;
+	batch->objMask = NULL;
+	batch->objNodes = NULL;
+	batch->objNodesOffset = NULL;
+	batch->objLinks = NULL;
+	batch->objCount = NULL;
+	batch->objBuffer = NULL;
+
+	return batch;
+}
+
+int mgSolveBatch(Multigrid *mgRho, Multigrid *mgPhi, Multigrid *mgRes,
+				double tol, const MpiInfo *mpiInfo){
+
+	int nCycles = 0;
+	double barRes;
+
+	if(mgRho->nLevels == 1){
+		gHaloOp(setSlice, mgRho->grids[0], mpiInfo, TOHALO);
+		if(mgPeriodicBatch(mgRho->grids[0])) mgNeutralizeBatch(mgRho->grids[0], mpiInfo);
+	}
+
+	do{
+		if(mgRho->nLevels > 1){
+			mgVBatch(0, mgRho, mgPhi, mgRes, mpiInfo);
+		} else {
+			mgGS3DBatch(mgPhi->grids[0], mgRho->grids[0], mgRho->nCoarseSolve, mpiInfo);
+		}
+		barRes = mgResidualNormBatch(mgRho, mgPhi, mgRes, mpiInfo);
+		nCycles++;
+	} while(barRes > tol);
+
+	return nCycles;
+}
+
+
 /*************************************************
  *		RUNS
  ************************************************/
@@ -2012,3 +3505,97 @@ void mgMode(dictionary *ini){
 
 	uFree(units);
 }
+
+funPtr mgModeCycles_set(dictionary *ini){
+	return mgModeCycles;
+}
+void mgModeCycles(dictionary *ini){
+
+	Units *units=uAlloc(ini);
+	uNormalize(ini, units);
+
+	//Mpi
+	MpiInfo *mpiInfo = gAllocMpi(ini);
+
+	//Grids
+	Grid *phi 	= gAlloc(ini, SCALAR);
+	Grid *rho 	= gAlloc(ini, SCALAR);
+	Grid *res 	= gAlloc(ini, SCALAR);
+	Grid *sol 	= gAlloc(ini, SCALAR);
+	Grid *error = gAlloc(ini, SCALAR);
+
+	//Multigrids
+	Multigrid *mgPhi = mgAlloc(ini, phi);
+	Multigrid *mgRho = mgAlloc(ini, rho);
+	Multigrid *mgRes = mgAlloc(ini, res);
+
+	int bottom = mgRho->nLevels-1;
+	if(bottom < 1) msg(ERROR, "mgModeCycles needs at least two multigrid levels");
+
+	gFillSin(rho, 3, mpiInfo, 0);
+	gFillSinSol(sol, 3, mpiInfo);
+	gNeutralizeGrid(rho, mpiInfo);
+
+	const int nAlgos = 4;
+	const char *names[] = {"mgVRecursive", "mgW", "mgF", "mgFMG"};
+	funPtr algos[] = {	(funPtr)&mgVRecursive, (funPtr)&mgW,
+						(funPtr)&mgF, (funPtr)&mgFMG};
+
+	double tol = 1.E-10;
+	long int nTrue = gTotTruesize(sol, mpiInfo);
+	Timer *t = tAlloc(rho->rank);
+
+	int runNumber = iniGetInt(ini, "multigrid:runNumber");
+	hid_t history = xyOpenH5(ini, "cycles");
+	if(runNumber == 0){
+		xyCreateDataset(history, "time");
+		xyCreateDataset(history, "cycles");
+		xyCreateDataset(history, "error");
+		xyCreateDataset(history, "firstError");
+	}
+
+	Grid *source = mgPrepareSource(mgRho, mpiInfo);
+
+	for(int a = 0; a < nAlgos; a++){
+
+		//Error after a single cycle from a zero guess
+		for(int lvl = 0; lvl < mgPhi->nLevels; lvl++) gZero(mgPhi->grids[lvl]);
+		algos[a](0, bottom, 0, mgRho, mgPhi, mgRes, mpiInfo);
+		mgCompError(phi, sol, error);
+		double firstError = sqrt(mgSumTrueSquared(error, mpiInfo)/nTrue);
+
+		//Cycles and time to converge
+		for(int lvl = 0; lvl < mgPhi->nLevels; lvl++) gZero(mgPhi->grids[lvl]);
+		tReset(t);
+		tStart(t);
+		int nCycles = mgSolveTol(algos[a], tol, mgRho, mgPhi, mgRes, mpiInfo);
+		tStop(t);
+		mgCompError(phi, sol, error);
+		double finalError = sqrt(mgSumTrueSquared(error, mpiInfo)/nTrue);
+
+		msg(STATUS, "%-12s cycles = %3d, first cycle error = %.2e, final error = %.2e",
+			names[a], nCycles, firstError, finalError);
+		if(mpiInfo->mpiRank==0) tMsg(t->total, "Time spent: ");
+
+		xyWrite(history, "time", (double) a, (double) t->total, MPI_MAX);
+		xyWrite(history, "cycles", (double) a, (double) nCycles, MPI_MAX);
+		xyWrite(history, "error", (double) a, finalError, MPI_MAX);
+		xyWrite(history, "firstError", (double) a, firstError, MPI_MAX);
+	}
+
+	mgRestoreSource(mgRho, source);
+	xyCloseH5(history);
+
+	//Freedom
+	tFree(t);
+	mgFree(mgPhi);
+	mgFree(mgRho);
+	mgFree(mgRes);
+	gFree(phi);
+	gFree(rho);
+	gFree(res);
+	gFree(sol);
+	gFree(error);
+	gFreeMpi(mpiInfo);
+	uFree(units);
+}
@@ -24,7 +24,7 @@
  * The preSmooth, postSmooth and coarseSolv is set in the input.ini file, for
  * now the only options are Gauss-Seidel Red-Black (mgGS). More TBD.
  */
- typedef struct {
+ typedef struct Multigrid {
     Grid **grids;   ///< Array of Grid structs of decreasing coarseness
     int nLevels;         			///< #Grid levels
     int nMGCycles;         			///< Multigrid cycles we want to run
@@ -46,6 +46,29 @@
     ///< Function pointer to prolongator
 	void (*prolongator)(Grid *fine, const Grid *coarse, const MpiInfo *mpiInfo);
 
+	struct Multigrid *agglom;	///< Levels below the coarsest, agglomerated (or NULL)
+	MpiInfo *agglomMpiInfo;		///< Serial MpiInfo used on the agglomerated levels
+	double *agglomBuffer;		///< Buffer for gathering the coarsest level
+
+	bool directCoarseSolve;		///< Solve the coarsest level exactly
+	gsl_matrix *coarseLU;		///< LU factorization of the coarsest operator (or NULL)
+	gsl_permutation *coarsePerm;///< Permutation belonging to coarseLU
+	double *coarseBuffer;		///< Global right hand side and gather buffer
+
+	bool fourthOrder;			///< Use the compact fourth order stencil
+	Grid *compactRho;			///< Transformed source for the compact stencil (or NULL)
+	///< Function pointer to the residual matching the smoothers
+	void (*residual)(Grid *res, const Grid *rho, const Grid *phi,
+						const MpiInfo *mpiInfo);
+
+	int nObjects;				///< Number of embedded objects (0 if none)
+	int **objMask;				///< Object (1-based) of each node, or 0, per level
+	long int **objNodes;		///< True object nodes grouped by object, per level
+	long int **objNodesOffset;	///< Offset in the above per object (nObjects+1 elements)
+	double **objLinks;			///< Global number of stencil links out of each object, per level
+	double **objCount;			///< Global number of nodes of each object, per level
+	double *objBuffer;			///< Buffer for reductions over the objects
+
 } Multigrid;
 
 typedef struct {
@@ -86,6 +109,27 @@ typedef struct {
  *	NB!The number of true grid points used in the finest grid needs to be a
  *  multiple nLevels*2, to make it possible to half the grid points down to
  *  the coarsest grid.
+ *
+ *	Coarse-grid agglomeration: If multigrid:agglomLevels is larger than 0 the
+ *	coarsest level of all subdomains is gathered into one global grid held
+ *	by every rank, and the V cycle continues there before scattering the
+ *	result back. The agglomerated multigrid has agglomLevels levels, the first
+ *	of which has the same resolution as the coarsest distributed level, so
+ *	it adds agglomLevels-1 coarsenings. The agglomerated levels use a serial
+ *	MpiInfo (communicator MPI_COMM_SELF), so the redundant coarse solve needs
+ *	no further communication. This lifts the limit on the depth set by the
+ *	number of grid points per subdomain. The global coarsest grid must be a
+ *	multiple of 2^(agglomLevels-1).
+ *
+ *	Direct coarse solver: With multigrid:coarseSolver = direct the coarsest
+ *	level is solved exactly instead of by nCoarseSolve smoothing iterations.
+ *	The right hand side is gathered on all ranks and solved using an LU
+ *	factorization of the coarsest operator, which is computed on the first
+ *	call and cached in the Multigrid struct. When combined with
+ *	agglomeration it is the bottom of the agglomerated levels which is solved
+ *	directly. The factorization is dense, so the coarsest global grid should be
+ *	small (up to roughly 16^3 nodes). Only implemented for periodic boundaries,
+ *	where the solution with zero mean is returned.
  */
 
 Multigrid *mgAlloc(const dictionary *ini, Grid *grid);
@@ -95,6 +139,30 @@ void mgFreeSolver(MultigridSolver *solver);
 void mgSolve(const MultigridSolver *solver,	const Grid *rho, const Grid *phi, const MpiInfo* mpiInfo);
 funPtr mgSolver_set(const dictionary *ini);
 
+/**
+ * @brief Embeds floating objects in the multigrid solver
+ * @param	solver		Multigrid solver
+ * @param	domain		Object of each node, 1-based (see oFillConductor())
+ * @param	mpiInfo		MpiInfo
+ * @return	void
+ *
+ * Alternative to the capacitance matrix method. Each object is treated as a
+ * floating conductor: all its nodes share one potential, determined such
+ * that the sum of the residuals on its nodes vanishes (i.e. the charge
+ * deposited on the object equals the flux leaving it). The constraint is
+ * enforced by the smoother on every level, which after each red-black sweep
+ * over the free nodes shifts the potential of each object as a whole. The
+ * objects are transferred to the coarser levels by injection, and the
+ * residuals on object nodes are not restricted.
+ *
+ * Replaces the smoothers of the solver, so mgSolve() alone gives the
+ * potential including the objects. Called once after mgAllocSolver().
+ *
+ * NB! Only for the 3D secondOrder stencil, without agglomeration or the
+ * direct coarse solver.
+ */
+void mgSetObjects(MultigridSolver *solver, const Grid *domain, const MpiInfo *mpiInfo);
+
  /**
   * @brief Free multigrid struct, top gridQuantity needs to be freed seperately
   * @param 	multigrid
@@ -135,6 +203,20 @@ funPtr mgMode_set(dictionary *ini);
 void mgModeErrorScaling(dictionary *ini);
 funPtr mgModeErrorScaling_set(dictionary *ini);
 
+/**
+ * @brief Benchmarks the multigrid cycle types against each other
+ * @param 	ini
+ *
+ * Solves the sinusoidal test case with mgVRecursive, mgW, mgF and mgFMG,
+ * starting from a zero guess each time. For each cycle type the error after
+ * the first cycle, the number of cycles and the time to reach the residual
+ * tolerance of mgSolveRaw() and the final error are written to the "cycles"
+ * history file, with the x-axis being the index of the cycle type in the
+ * above list.
+ */
+void mgModeCycles(dictionary *ini);
+funPtr mgModeCycles_set(dictionary *ini);
+
 
 /**
  * @brief Performs a multigrid V cycle
@@ -163,29 +245,53 @@ void mgVRecursive(int level, int bottom, int top, Multigrid *mgRho,
 
 /**
  * @brief Performs a Full multigrid cycle
- * @param   level       Grid level the V cycle starts on
+ * @param   level       Grid level the cycle starts on
  * @param   bottom      Grid level at the bottom of the cycle
- * @param   top         Grid level at the top of the cycle
- * @param   mgRho       MgGrid struct containing rho
- * @param   mgRho       MgGrid struct containing rho
+ * @param   top         Grid level at the top of the cycle (unused)
  * @param   mgRho       MgGrid struct containing rho
+ * @param   mgPhi       MgGrid struct containing phi
+ * @param   mgRes       MgGrid struct containing the residual
  * @param   mpiInfo     MpiInfo struct containing subdomain information
+ *
+ * Nested iteration: the source is restricted down to the bottom level, where
+ * it is solved, and the solution on each level is prolongated as the initial
+ * guess for one V cycle on the next finer level. The current guess on the
+ * finest level is discarded, so mgSolveRaw() follows up with V cycles if the
+ * tolerance is not met after the first one. Should reach the discretization
+ * error in about one cycle.
  */
 void mgFMG(int level, int bottom, int top, Multigrid *mgRho, Multigrid *mgPhi,
  					Multigrid *mgRes, const MpiInfo *mpiInfo);
 /**
  * @brief Performs a multigrid W cycle
- * @param   level       Grid level the V cycle starts on
+ * @param   level       Grid level the cycle starts on
  * @param   bottom      Grid level at the bottom of the cycle
- * @param   top         Grid level at the top of the cycle
- * @param   mgRho       MgGrid struct containing rho
- * @param   mgRho       MgGrid struct containing rho
+ * @param   top         Grid level at the top of the cycle (unused)
  * @param   mgRho       MgGrid struct containing rho
+ * @param   mgPhi       MgGrid struct containing phi
+ * @param   mgRes       MgGrid struct containing the residual
  * @param   mpiInfo     MpiInfo struct containing subdomain information
+ *
+ * Visits each coarser level twice before going up again (gamma = 2).
  */
 void mgW(int level, int bottom, int top, Multigrid *mgRho, Multigrid *mgPhi,
  					Multigrid *mgRes, const MpiInfo *mpiInfo);
 
+/**
+ * @brief Performs a multigrid F cycle
+ * @param   level       Grid level the cycle starts on
+ * @param   bottom      Grid level at the bottom of the cycle
+ * @param   top         Grid level at the top of the cycle (unused)
+ * @param   mgRho       MgGrid struct containing rho
+ * @param   mgPhi       MgGrid struct containing phi
+ * @param   mgRes       MgGrid struct containing the residual
+ * @param   mpiInfo     MpiInfo struct containing subdomain information
+ *
+ * On each level the coarse grid correction is an F cycle followed by a V
+ * cycle, which is cheaper than a W cycle but almost as robust.
+ */
+void mgF(int level, int bottom, int top, Multigrid *mgRho, Multigrid *mgPhi,
+ 					Multigrid *mgRes, const MpiInfo *mpiInfo);
 
 
 /**
@@ -199,6 +305,11 @@ void mgW(int level, int bottom, int top, Multigrid *mgRho, Multigrid *mgPhi,
  *
  *	This is an implementation of a Multigrid V Cycle solver. See "DOC" for more
  *  information.
+ *
+ *  With multigrid:stencil = fourthOrder the source is first transformed to
+ *  rho + nabla^2 rho/12, which together with the compact Laplacian of
+ *  gFinDiff4th3D() is fourth order accurate. The transformed source is used
+ *  on all levels, the caller's rho is left untouched.
  */
 
 void mgSolveRaw(funPtr mgAlgo, Multigrid *mgRho, Multigrid *mgPhi,
@@ -206,6 +317,39 @@ void mgSolveRaw(funPtr mgAlgo, Multigrid *mgRho, Multigrid *mgPhi,
 
 funPtr mgSolveRaw_set(dictionary *ini);
 
+/**
+ * @brief Allocates a multigrid struct for batched solves
+ * @param	multigrid	Multigrid to take the levels and settings from
+ * @param	grid		Finest grid, with one value per right hand side
+ * @return	Multigrid
+ *
+ *	The returned struct has the same levels and number of smoothing steps as
+ *	multigrid, but each node holds grid->size[0] values, one per right hand
+ *	side. Only for use with mgSolveBatch(). Free with mgFree().
+ *
+ *	NB! Only implemented for the 3D secondOrder stencil.
+ */
+Multigrid *mgAllocBatch(const Multigrid *multigrid, Grid *grid);
+
+/**
+ * @brief Solves Poisson's equation for several right hand sides at once
+ * @param	mgRho	Source terms (from mgAllocBatch())
+ * @param	mgPhi	Solutions, the finest level holds the initial guesses
+ * @param	mgRes	Residuals
+ * @param	tol		Tolerance on the RMS residual of each right hand side
+ * @param	mpiInfo	Subdomain information
+ * @return	Number of V cycles
+ *
+ *	Runs V cycles with red-black Gauss-Seidel on all right hand sides together
+ *	until all of them are converged. The right hand sides share the sweeps
+ *	through memory and every halo exchange, so nBatch solves cost much less
+ *	than nBatch calls to mgSolve(). The coarsest level is always relaxed with
+ *	nCoarseSolve Gauss-Seidel iterations. With periodic boundaries the source
+ *	terms are neutralized in place.
+ */
+int mgSolveBatch(Multigrid *mgRho, Multigrid *mgPhi, Multigrid *mgRes,
+				double tol, const MpiInfo *mpiInfo);
+
 /**
  * @brief Gauss-Seidel Red and Black 3D
  * @param	rho		Source term
@@ -236,6 +380,87 @@ void mgGS3DNew(Grid *phi, const Grid *rho, const int nCycles,
 void mgGS3D(Grid *phi, const Grid *rho, const int nCycles,
             const MpiInfo *mpiInfo);
 
+/**
+ * @brief Gauss-Seidel Red and Black 3D, cache blocked
+ * @param	rho		Source term
+ * @param	phi		Solution term
+ * @param	nCycles	Number of iterations
+ * @param	mpiInfo	Subdomain information
+ * @return	phi
+ *
+ *	Red-black Gauss-Seidel where the inner loop runs over every second node
+ *	along j (stride 2), starting at a parity computed once per row rather than
+ *	tested with a branch per node, such that the compiler can vectorize it.
+ *
+ *	In addition the red and black half-sweeps of several iterations are
+ *	performed in a single wavefront through the grid (temporal blocking), such
+ *	that each (j,k)-plane is loaded from memory once per block rather than
+ *	twice per iteration. The block depth is MG_GS_BLOCK_DEPTH in multigrid.c.
+ *	Halos are exchanged once per block, so within a block the ghost layers
+ *	hold the values from the previous block. This makes it a block
+ *	Gauss-Seidel across subdomains, which is a good smoother but not
+ *	identical to mgGS3D().
+ *
+ *	Selected by "gaussSeidelRBBlocked" in the input file.
+ *
+ *	NB! Assumes 1 ghost layer. Only implemented for 3D.
+ */
+void mgGS3DBlocked(Grid *phi, const Grid *rho, const int nCycles,
+            const MpiInfo *mpiInfo);
+
+/**
+ * @brief Gauss-Seidel Red and Black 3D, communication avoiding
+ * @param	rho		Source term
+ * @param	phi		Solution term
+ * @param	nCycles	Number of iterations
+ * @param	mpiInfo	Subdomain information
+ * @return	phi
+ *
+ *	Red-black Gauss-Seidel which uses deep halos to exchange less often. With
+ *	m ghost layers, m half-sweeps are done between each halo exchange. The
+ *	first half-sweep also updates the m-1 innermost ghost layers, and for each
+ *	subsequent half-sweep the region shrinks by one layer, such that the last
+ *	one covers the true nodes only. The redundant computations in the halo
+ *	reproduce what the neighbouring subdomains compute, with 2*nCycles/m
+ *	rather than 2*nCycles exchanges of phi.
+ *
+ *	For periodic boundaries and interior subdomains the result is equivalent
+ *	to mgGS3D() up to rounding. It differs in that:
+ *	- rho's halo is exchanged once per call rather than not at all, such that
+ *	  its ghost layers are overwritten.
+ *	- The region is not extended beyond non-periodic global boundaries.
+ *	  There gBndEdges() is applied after every half-sweep, whereas gBnd()
+ *	  (including the neutralization of periodic boundaries) is applied only
+ *	  after each halo exchange, i.e. once per m half-sweeps.
+ *
+ *	Selected by "gaussSeidelRBDeepHalo" in the input file, and takes effect
+ *	when grid:nGhostLayers is larger than 1. With 1 ghost layer it behaves like
+ *	mgGS3D().
+ *
+ *	NB! The coarsest grid must have at least as many true points as ghost
+ *	layers. Only implemented for 3D.
+ */
+void mgGS3DDeepHalo(Grid *phi, const Grid *rho, const int nCycles,
+            const MpiInfo *mpiInfo);
+
+/**
+ * @brief Gauss-Seidel for the compact fourth order stencil, 3D
+ * @param	rho		Source term
+ * @param	phi		Solution term
+ * @param	nCycles	Number of iterations
+ * @param	mpiInfo	Subdomain information
+ * @return	phi
+ *
+ *	Relaxes the 19-point stencil of gFinDiff4th3D(). Edge neighbours share the
+ *	red-black colour, so the nodes are swept in 8 colours given by the parity
+ *	in each direction, with a halo exchange after each colour.
+ *
+ *	Selected by "gaussSeidel4th" in the input file, and must be used together
+ *	with multigrid:stencil = fourthOrder. Only implemented for 3D.
+ */
+void mgGS3D4th(Grid *phi, const Grid *rho, const int nCycles,
+				const MpiInfo *mpiInfo);
+
 /**
  * @brief Gauss-Seidel Red and Black 2D
  * @param	rho		Source term
@@ -301,6 +526,18 @@ void mgHalfRestrict2D(const Grid *fine, Grid *coarse);
  */
 void mgHalfRestrict3D(const Grid *fine, Grid *coarse);
 
+/**
+ * @brief Full weight restriction, 3D
+ * @param	fine	Source term
+ * @param	coarse	Solution term
+ * @return	coarse
+ *
+ *	27-point full weighting, the adjoint of trilinear interpolation. This is
+ *	the natural match of the 19-point compact stencil, but works with any.
+ *	Selected by "fullWeight" in the input file.
+ */
+void mgFullRestrict3D(const Grid *fine, Grid *coarse);
+
 /**
  * @brief Half weight restriction, ND
  * @param	fine	Source term
@@ -381,6 +618,19 @@ void mgRestrictBnd(Multigrid *mgGrid);
  */
 void mgResidual(Grid *res, const Grid *rho, const Grid *phi,const MpiInfo *mpiInfo);
 
+/**
+ * @brief Computes residual of the compact fourth order stencil
+ * @param	res		Residual grid
+ * @param	phi		Phi	grid
+ * @param	rho		Rho grid
+ * @param	mpiInfo	Subdomain information
+ * @return	res
+ *
+ *	Same as mgResidual() but with the Laplacian of gFinDiff4th3D(). rho is the
+ *	transformed source, see mgSolveRaw().
+ */
+void mgResidual4th(Grid *res, const Grid *rho, const Grid *phi,const MpiInfo *mpiInfo);
+
 /**
  * @brief Returns mass of a grid
  * @param	grid		Grid struct
@@ -11,6 +11,9 @@
 #include "spectral.h"
 #include <gsl/gsl_linalg.h>
 #include <gsl/gsl_blas.h>
+#include <gsl/gsl_errno.h>
+#include <stdint.h>
+#include <limits.h>
 
 /******************************************************************************
  *  LOCAL FUNCTION DECLARATIONS
@@ -110,11 +113,19 @@ void oGhost(long int node, const int *nGhostLayersBefore,
 // Count the number of objects and fill the lookup tables
 void oFillLookupTables(Object *obj, const MpiInfo *mpiInfo) {
     
+    Grid *domain = obj->domain;
+    long int *sizeProd = domain->sizeProd;
+    int *size = domain->size;
+    int *nGhostLayers = domain->nGhostLayers;
+    int rank = domain->rank;
+    double *val = domain->val;
+    long int nNodes = sizeProd[rank];
+
     // Find the number of objects in the input file
     int nObjects = 0;
-    for (int i=0; i<obj->domain->sizeProd[obj->domain->rank]; i++) {
-        if (obj->domain->val[i]>nObjects) {
-            nObjects = (int)(obj->domain->val[i]+0.5); // Note, this is not necessarily
+    for (long int i=0; i<nNodes; i++) {
+        if (val[i]>nObjects) {
+            nObjects = (int)(val[i]+0.5); // Note, this is not necessarily
                 //the number of objects, but rather the identifier of the object with the highest number.
                 //Feel free to implement something more fancy here...
         }
@@ -123,32 +134,62 @@ void oFillLookupTables(Object *obj, const MpiInfo *mpiInfo) {
     MPI_Allreduce(MPI_IN_PLACE, &nObjects, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
     //msg(WARNING|ALL,"nObjects: %i",nObjects);
    
-    // Initialise and compute the array that stores the offsets of the objects in the lookup table.
-    long int *lookupInteriorOffset = malloc((nObjects+1)*sizeof(*lookupInteriorOffset));
-    for (long int i=0; i<nObjects+1; i++) {
-        lookupInteriorOffset[i] = 0;
+    // Bounding box of each object (ghosts included) and the number of
+    // interior nodes, in one sweep. Boxes of absent objects are empty.
+    int *boundingBox = malloc(6*nObjects*sizeof(*boundingBox));
+    for (long int a=0; a<nObjects; a++) {
+        for (int d=0; d<3; d++) {
+            boundingBox[6*a+d] = size[d+1];
+            boundingBox[6*a+3+d] = -1;
+        }
     }
-   
-    for (long int i=0; i<obj->domain->sizeProd[obj->domain->rank]; i++) {
-        if (obj->domain->val[i]>0.5 && !isGhostNode(obj->domain, i)){
-            lookupInteriorOffset[(int)(obj->domain->val[i]+0.5)]++;
+
+    long int *lookupInteriorOffset = malloc((nObjects+1)*sizeof(*lookupInteriorOffset));
+    alSetAll(lookupInteriorOffset,nObjects+1,0);
+
+    // The object each node is inside, for constant time lookups.
+    int *nodeObject = malloc(nNodes*sizeof(*nodeObject));
+    aiSetAll(nodeObject,nNodes,-1);
+
+    for (int l=0; l<size[3]; l++) {
+        for (int k=0; k<size[2]; k++) {
+            for (int j=0; j<size[1]; j++) {
+                long int g = j*sizeProd[1] + k*sizeProd[2] + l*sizeProd[3];
+                if (val[g]<=0.5) continue;
+
+                int a = (int)(val[g]+0.5)-1;
+                int coord[3] = {j, k, l};
+                for (int d=0; d<3; d++) {
+                    if (coord[d]<boundingBox[6*a+d]) boundingBox[6*a+d] = coord[d];
+                    if (coord[d]>boundingBox[6*a+3+d]) boundingBox[6*a+3+d] = coord[d];
+                }
+
+                bool ghost = false;
+                for (int d=0; d<3; d++) {
+                    if (coord[d]<nGhostLayers[d+1] || coord[d]>=size[d+1]-nGhostLayers[rank+d+1]) ghost = true;
+                }
+                if (!ghost) {
+                    lookupInteriorOffset[a+1]++;
+                    nodeObject[g] = a;
+                }
+            }
         }
     }
 
     alCumSum(lookupInteriorOffset+1,lookupInteriorOffset,nObjects);
-    // Initialise and compute the lookup table.
-    long int *lookupInt = malloc((lookupInteriorOffset[nObjects])*sizeof(*lookupInt));
-    alSetAll(lookupInt,lookupInteriorOffset[nObjects],0);
+    // Initialise and compute the lookup table, visiting only the box of each object.
+    long int *lookupInt = malloc((lookupInteriorOffset[nObjects]+1)*sizeof(*lookupInt));
    
-    long int *index = malloc((nObjects)*sizeof(*index));
-    for (long int i=0; i<nObjects; i++) {
-        index[i]=lookupInteriorOffset[i];
-    }
-   
-    for (long int i=0; i<obj->domain->sizeProd[obj->domain->rank]; i++) {
-        if (obj->domain->val[i]>0.5 && !isGhostNode(obj->domain, i)){
-            lookupInt[(index[(int)(obj->domain->val[i]+0.5)-1])] = i;
-            (index[(int)(obj->domain->val[i]+0.5)-1])++;
+    for (long int a=0; a<nObjects; a++) {
+        long int index = lookupInteriorOffset[a];
+        int *box = &boundingBox[6*a];
+        for (int l=box[2]; l<=box[5]; l++) {
+            for (int k=box[1]; k<=box[4]; k++) {
+                for (int j=box[0]; j<=box[3]; j++) {
+                    long int g = j*sizeProd[1] + k*sizeProd[2] + l*sizeProd[3];
+                    if (nodeObject[g]==a) lookupInt[index++] = g;
+                }
+            }
         }
     }
     
@@ -156,7 +197,924 @@ void oFillLookupTables(Object *obj, const MpiInfo *mpiInfo) {
     obj->nObjects = nObjects;
     obj->lookupInterior = lookupInt;
     obj->lookupInteriorOffset = lookupInteriorOffset;
+    obj->nodeObject = nodeObject;
+    obj->boundingBox = boundingBox;
+
+}
+
+// Start of the capacitance matrix of object a in capMatrixAll.
+static long int oCapMatrixStart(const long int *capMatrixAllOffsets, long int a, int size) {
+
+    long int start = 0;
+    for (long int b=0; b<a; b++) {
+        long int totSNGlob = capMatrixAllOffsets[b*(size+1)+size];
+        start += totSNGlob*totSNGlob;
+    }
+    return start;
+}
+
+// Start of the rows of this core of object a in capMatrixAll.
+static long int oCapMatrixLocalStart(const long int *capMatrixAllOffsets, long int a,
+                                     int rank, int size) {
+
+    long int start = 0;
+    for (long int b=0; b<a; b++) {
+        long int totSNGlob = capMatrixAllOffsets[b*(size+1)+size];
+        long int nLocal = capMatrixAllOffsets[b*(size+1)+rank+1]-capMatrixAllOffsets[b*(size+1)+rank];
+        start += nLocal*totSNGlob;
+    }
+    return start;
+}
+
+// MPI datatype of one row of the capacitance matrix of object a, with the
+// number of rows of each core and where they start. Counting rows rather
+// than doubles keeps the counts within int for all but absurd matrices.
+static MPI_Datatype oCapMatrixRowType(const long int *capMatrixAllOffsets, long int a,
+                                      int size, int *counts, int *displs) {
+
+    const long int *offsets = &capMatrixAllOffsets[a*(size+1)];
+    if (offsets[size]>INT_MAX) msg(ERROR,"Too many surface nodes on object %ld.", a);
+
+    for (int r=0; r<size; r++) {
+        counts[r] = (int)(offsets[r+1]-offsets[r]);
+        displs[r] = (int)offsets[r];
+    }
+
+    MPI_Datatype rowType;
+    MPI_Type_contiguous((int)offsets[size], MPI_DOUBLE, &rowType);
+    MPI_Type_commit(&rowType);
+    return rowType;
+}
+
+// Invert a symmetric positive definite matrix in place.
+static void oInvertCapacitanceMatrix(double *matrix, long int n) {
+
+    // Symmetrize, the columns come from independent iterative solves.
+    for (long int i=0; i<n; i++) {
+        for (long int j=0; j<i; j++) {
+            double avg = 0.5*(matrix[n*i+j] + matrix[n*j+i]);
+            matrix[n*i+j] = avg;
+            matrix[n*j+i] = avg;
+        }
+    }
+
+    // The factorization leaves the strict upper triangle as it was, so the
+    // diagonal is all that is needed to restore the matrix for the fallback.
+    double *diagonal = malloc((n+1)*sizeof(*diagonal));
+    for (long int i=0; i<n; i++) diagonal[i] = matrix[n*i+i];
+
+    // Blocked (level 3 BLAS) Cholesky, half the work of LU.
+    gsl_matrix_view A = gsl_matrix_view_array(matrix, n, n);
+    gsl_error_handler_t *handler = gsl_set_error_handler_off();
+    int status = gsl_linalg_cholesky_decomp1(&A.matrix);
+    gsl_set_error_handler(handler);
+
+    if (!status) {
+        gsl_linalg_cholesky_invert(&A.matrix);
+    } else {
+
+        // Fall back to LU if it is not numerically positive definite.
+        msg(WARNING|ALL,"Capacitance matrix is not positive definite, inverting with LU.");
+        for (long int i=0; i<n; i++) {
+            matrix[n*i+i] = diagonal[i];
+            for (long int j=0; j<i; j++) matrix[n*i+j] = matrix[n*j+i];
+        }
+        int s;
+        gsl_permutation *p = gsl_permutation_alloc(n);
+        gsl_linalg_LU_decomp(&A.matrix, p, &s);
+        gsl_linalg_LU_invx(&A.matrix, p);
+        gsl_permutation_free(p);
+    }
+
+    free(diagonal);
+}
+
+// FNV-1a hash, continued from hash.
+static uint64_t oHashBytes(uint64_t hash, const void *data, size_t n) {
+
+    const unsigned char *bytes = data;
+    for (size_t i=0; i<n; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Hash of everything the capacitance matrices depend on.
+static uint64_t oCapacitanceHash(const Object *obj, const dictionary *ini, const MpiInfo *mpiInfo) {
+
+    const uint64_t seed = 14695981039346656037ULL;
+    int size = mpiInfo->mpiSize;
+    Grid *domain = obj->domain;
+
+    // The object identifiers on the true nodes of this core.
+    uint64_t hash = seed;
+    for (long int g=0; g<domain->sizeProd[domain->rank]; g++) {
+        if (!isGhostNode(domain, g)) {
+            int id = (int)(domain->val[g]+0.5);
+            hash = oHashBytes(hash, &id, sizeof(id));
+        }
+    }
+
+    // Combine the cores in order, the matrix layout depends on the decomposition.
+    uint64_t *hashes = malloc(size*sizeof(*hashes));
+    MPI_Allgather(&hash, 1, MPI_UINT64_T, hashes, 1, MPI_UINT64_T, MPI_COMM_WORLD);
+    hash = oHashBytes(seed, hashes, size*sizeof(*hashes));
+    free(hashes);
+
+    // Grid and solver settings.
+    const char *keys[] = {  "grid:nSubdomains", "grid:trueSize", "grid:nGhostLayers",
+                            "grid:boundaries", "multigrid:mgLevels", "multigrid:nPreSmooth",
+                            "multigrid:nPostSmooth", "multigrid:nCoarseSolve",
+                            "multigrid:stencil", "objects:capCompression",
+                            "objects:capBlockSize"};
+    for (size_t k=0; k<sizeof(keys)/sizeof(*keys); k++) {
+        char *value = iniGetStr(ini, keys[k]);
+        hash = oHashBytes(hash, value, strlen(value)+1);
+        free(value);
+    }
+
+    return hash;
+}
+
+// Stores the 64 bit hash exactly as two doubles.
+static void oSplitHash(uint64_t hash, double *value) {
+    value[0] = (double)(hash >> 32);
+    value[1] = (double)(hash & 0xffffffffULL);
+}
+
+static hid_t oOpenCacheH5(const char *fName, bool create) {
+
+    hid_t pList = H5Pcreate(H5P_FILE_ACCESS);
+    H5Pset_fapl_mpio(pList, MPI_COMM_WORLD, MPI_INFO_NULL);
+
+    hid_t file;
+    if (create) file = H5Fcreate(fName, H5F_ACC_TRUNC, H5P_DEFAULT, pList);
+    else        file = H5Fopen(fName, H5F_ACC_RDONLY, pList);
+
+    H5Pclose(pList);
+    return file;
+}
+
+// Reads a whole 1D dataset on every core, if it has n elements.
+static bool oReadCacheDataset(hid_t file, const char *name, hid_t memType, void *data, long int n) {
+
+    if (H5Lexists(file, name, H5P_DEFAULT) <= 0) return false;
+
+    hid_t dataset = H5Dopen(file, name, H5P_DEFAULT);
+    hid_t fileSpace = H5Dget_space(dataset);
+    bool match = H5Sget_simple_extent_npoints(fileSpace) == n;
+
+    if (match) H5Dread(dataset, memType, H5S_ALL, H5S_ALL, H5P_DEFAULT, data);
+
+    H5Sclose(fileSpace);
+    H5Dclose(dataset);
+    return match;
+}
+
+// Writes a whole 1D dataset from rank 0.
+static void oWriteCacheDataset(hid_t file, const char *name, hid_t fileType, hid_t memType,
+                               const void *data, long int n, int mpiRank) {
+
+    hsize_t dims = (hsize_t)n;
+    hid_t fileSpace = H5Screate_simple(1, &dims, NULL);
+    hid_t dataset = H5Dcreate(file, name, fileType, fileSpace, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+
+    if (mpiRank==0 && n>0) H5Dwrite(dataset, memType, H5S_ALL, H5S_ALL, H5P_DEFAULT, data);
+
+    H5Dclose(dataset);
+    H5Sclose(fileSpace);
+}
+
+// Reads or writes the rows of this core of every capacitance matrix. In the
+// file the matrices are stored whole, one after another.
+static bool oCapMatrixRowsH5(hid_t file, Object *obj, bool write, const MpiInfo *mpiInfo) {
+
+    int rank = mpiInfo->mpiRank;
+    int size = mpiInfo->mpiSize;
+    long int *offsets = obj->capMatrixAllOffsets;
+    long int n = oCapMatrixStart(offsets, obj->nObjects, size);
+    long int nLocal = oCapMatrixLocalStart(offsets, obj->nObjects, rank, size);
+
+    hid_t dataset;
+    hid_t fileSpace;
+    if (write) {
+        hsize_t dims = (hsize_t)n;
+        fileSpace = H5Screate_simple(1, &dims, NULL);
+        dataset = H5Dcreate(file, "capMatrixAll", H5T_IEEE_F64LE, fileSpace,
+                            H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    } else {
+        if (H5Lexists(file, "capMatrixAll", H5P_DEFAULT) <= 0) return false;
+        dataset = H5Dopen(file, "capMatrixAll", H5P_DEFAULT);
+        fileSpace = H5Dget_space(dataset);
+        if (H5Sget_simple_extent_npoints(fileSpace) != n) {
+            H5Sclose(fileSpace);
+            H5Dclose(dataset);
+            return false;
+        }
+    }
+
+    // The rows of each object are contiguous.
+    H5Sselect_none(fileSpace);
+    for (long int a=0; a<obj->nObjects; a++) {
+        long int totSNGlob = offsets[a*(size+1)+size];
+        long int beginIndex = offsets[a*(size+1)+rank];
+        long int endIndex = offsets[a*(size+1)+rank+1];
+        if (endIndex==beginIndex) continue;
+
+        hsize_t start = (hsize_t)(oCapMatrixStart(offsets, a, size) + beginIndex*totSNGlob);
+        hsize_t count = (hsize_t)((endIndex-beginIndex)*totSNGlob);
+        H5Sselect_hyperslab(fileSpace, H5S_SELECT_OR, &start, NULL, &count, NULL);
+    }
+
+    hsize_t memDims = (hsize_t)nLocal;
+    hid_t memSpace = H5Screate_simple(1, &memDims, NULL);
+    if (nLocal==0) H5Sselect_none(memSpace);
+
+    hid_t pList = H5Pcreate(H5P_DATASET_XFER);
+    H5Pset_dxpl_mpio(pList, H5FD_MPIO_COLLECTIVE);
+
+    herr_t status;
+    if (write) status = H5Dwrite(dataset, H5T_NATIVE_DOUBLE, memSpace, fileSpace, pList, obj->capMatrixAll);
+    else       status = H5Dread(dataset, H5T_NATIVE_DOUBLE, memSpace, fileSpace, pList, obj->capMatrixAll);
+
+    H5Pclose(pList);
+    H5Sclose(memSpace);
+    H5Sclose(fileSpace);
+    H5Dclose(dataset);
+    return status>=0;
+}
+
+// Reads or writes n elements from start of a 1D dataset, collectively.
+static bool oCacheSlabH5(hid_t dataset, hid_t memType, bool write, void *data,
+                         long int start, long int n) {
+
+    hid_t fileSpace = H5Dget_space(dataset);
+    hsize_t offset = (hsize_t)start;
+    hsize_t count = (hsize_t)n;
+    if (n>0) H5Sselect_hyperslab(fileSpace, H5S_SELECT_SET, &offset, NULL, &count, NULL);
+    else     H5Sselect_none(fileSpace);
+
+    hid_t memSpace = H5Screate_simple(1, &count, NULL);
+    if (n==0) H5Sselect_none(memSpace);
+
+    hid_t pList = H5Pcreate(H5P_DATASET_XFER);
+    H5Pset_dxpl_mpio(pList, H5FD_MPIO_COLLECTIVE);
+
+    herr_t status;
+    if (write) status = H5Dwrite(dataset, memType, memSpace, fileSpace, pList, data);
+    else       status = H5Dread(dataset, memType, memSpace, fileSpace, pList, data);
+
+    H5Pclose(pList);
+    H5Sclose(memSpace);
+    H5Sclose(fileSpace);
+    return status>=0;
+}
+
+// Doubles stored for a compressed block.
+static long int oCapBlockValues(const CapBlock *blk) {
+    return blk->rank<0 ? blk->m*blk->n : blk->rank*(blk->m+blk->n);
+}
+
+// Reads or writes the compressed blocks of this core. The blocks of all
+// cores are stored one after another, as (row, col, m, n, rank) in
+// "capBlocks" and their factors in "capBlockValues". "capBlocksCount" holds
+// Object::capBlocksOffset and the number of values of each core.
+static bool oCapBlocksH5(hid_t file, Object *obj, bool write, const MpiInfo *mpiInfo) {
+
+    int rank = mpiInfo->mpiRank;
+    int size = mpiInfo->mpiSize;
+    long int nObjects = obj->nObjects;
+    long int nRecord = nObjects+2;
+
+    long int *counts = malloc(size*nRecord*sizeof(*counts));
+    if (write) {
+        long int *record = malloc(nRecord*sizeof(*record));
+        long int nBlocks = obj->capBlocksOffset[nObjects];
+        for (long int a=0; a<=nObjects; a++) record[a] = obj->capBlocksOffset[a];
+        record[nObjects+1] = 0;
+        for (long int l=0; l<nBlocks; l++) record[nObjects+1] += oCapBlockValues(&obj->capBlocks[l]);
+        MPI_Allgather(record, (int)nRecord, MPI_LONG, counts, (int)nRecord, MPI_LONG, MPI_COMM_WORLD);
+        free(record);
+        oWriteCacheDataset(file, "capBlocksCount", H5T_STD_I64LE, H5T_NATIVE_LONG,
+                           counts, size*nRecord, rank);
+    } else if (!oReadCacheDataset(file, "capBlocksCount", H5T_NATIVE_LONG, counts, size*nRecord)) {
+        free(counts);
+        return false;
+    }
+
+    // Where the blocks and values of this core start, and the totals.
+    long int blockStart = 0, valueStart = 0, nBlocksAll = 0, nValuesAll = 0;
+    for (int r=0; r<size; r++) {
+        if (r==rank) {
+            blockStart = nBlocksAll;
+            valueStart = nValuesAll;
+        }
+        nBlocksAll += counts[r*nRecord+nObjects];
+        nValuesAll += counts[r*nRecord+nObjects+1];
+    }
+    long int nBlocks = counts[rank*nRecord+nObjects];
+    long int nValues = counts[rank*nRecord+nObjects+1];
+
+    hid_t blocks, values;
+    if (write) {
+        hsize_t dims = (hsize_t)(5*nBlocksAll);
+        hid_t space = H5Screate_simple(1, &dims, NULL);
+        blocks = H5Dcreate(file, "capBlocks", H5T_STD_I64LE, space, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        H5Sclose(space);
+        dims = (hsize_t)nValuesAll;
+        space = H5Screate_simple(1, &dims, NULL);
+        values = H5Dcreate(file, "capBlockValues", H5T_IEEE_F64LE, space, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        H5Sclose(space);
+    } else {
+        if (H5Lexists(file, "capBlocks", H5P_DEFAULT) <= 0 ||
+            H5Lexists(file, "capBlockValues", H5P_DEFAULT) <= 0) {
+            free(counts);
+            return false;
+        }
+        blocks = H5Dopen(file, "capBlocks", H5P_DEFAULT);
+        values = H5Dopen(file, "capBlockValues", H5P_DEFAULT);
+
+        obj->capBlocksOffset = malloc((nObjects+1)*sizeof(*obj->capBlocksOffset));
+        for (long int a=0; a<=nObjects; a++) obj->capBlocksOffset[a] = counts[rank*nRecord+a];
+        obj->capBlocks = malloc((nBlocks+1)*sizeof(*obj->capBlocks));
+    }
+    free(counts);
+
+    long int *meta = malloc((5*nBlocks+1)*sizeof(*meta));
+    double *factors = malloc((nValues+1)*sizeof(*factors));
+
+    if (write) {
+        long int v = 0;
+        for (long int l=0; l<nBlocks; l++) {
+            CapBlock *blk = &obj->capBlocks[l];
+            long int entry[5] = {blk->row, blk->col, blk->m, blk->n, blk->rank};
+            for (int e=0; e<5; e++) meta[5*l+e] = entry[e];
+            long int nU = blk->rank<0 ? blk->m*blk->n : blk->m*blk->rank;
+            for (long int i=0; i<nU; i++) factors[v++] = blk->u[i];
+            for (long int i=nU; i<oCapBlockValues(blk); i++) factors[v++] = blk->v[i-nU];
+        }
+    }
+
+    bool ok = oCacheSlabH5(blocks, H5T_NATIVE_LONG, write, meta, 5*blockStart, 5*nBlocks);
+    ok = oCacheSlabH5(values, H5T_NATIVE_DOUBLE, write, factors, valueStart, nValues) && ok;
+
+    if (!write) {
+        long int v = 0;
+        for (long int l=0; l<nBlocks; l++) {
+            CapBlock *blk = &obj->capBlocks[l];
+            blk->row = meta[5*l];
+            blk->col = meta[5*l+1];
+            blk->m = meta[5*l+2];
+            blk->n = meta[5*l+3];
+            blk->rank = meta[5*l+4];
+            long int nU = blk->rank<0 ? blk->m*blk->n : blk->m*blk->rank;
+            long int nV = oCapBlockValues(blk)-nU;
+            blk->u = malloc((nU+1)*sizeof(*blk->u));
+            blk->v = blk->rank<0 ? NULL : malloc((nV+1)*sizeof(*blk->v));
+            for (long int i=0; i<nU; i++) blk->u[i] = factors[v++];
+            for (long int i=0; i<nV; i++) blk->v[i] = factors[v++];
+        }
+    }
+
+    free(meta);
+    free(factors);
+    H5Dclose(blocks);
+    H5Dclose(values);
+    return ok;
+}
+
+// Load the capacitance matrices from the cache, if it exists and the hash
+// matches. The compressed matrices are stored as blocks, the others as rows.
+static bool oLoadCapacitanceCache(Object *obj, const char *fName, uint64_t hash,
+                                  bool compressed, const MpiInfo *mpiInfo) {
+
+    int size = mpiInfo->mpiSize;
+
+    int exists = 0;
+    if (mpiInfo->mpiRank==0) {
+        FILE *fh = fopen(fName, "r");
+        if (fh!=NULL) {
+            exists = 1;
+            fclose(fh);
+        }
+    }
+    MPI_Bcast(&exists, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (!exists) return false;
+
+    hid_t file = oOpenCacheH5(fName, false);
+    if (file<0) return false;
+
+    double expected[2], stored[2] = {-1, -1};
+    oSplitHash(hash, expected);
+    if (H5Aexists(file, "hash") > 0) {
+        hid_t attribute = H5Aopen(file, "hash", H5P_DEFAULT);
+        H5Aread(attribute, H5T_NATIVE_DOUBLE, stored);
+        H5Aclose(attribute);
+    }
+
+    if (stored[0]!=expected[0] || stored[1]!=expected[1]) {
+        msg(STATUS,"Capacitance matrix cache %s does not match, recomputing.", fName);
+        H5Fclose(file);
+        return false;
+    }
+
+    long int nOffsets = obj->nObjects*(size+1);
+    long int *capMatrixAllOffsets = malloc(nOffsets*sizeof(*capMatrixAllOffsets));
+
+    bool ok = oReadCacheDataset(file, "capMatrixAllOffsets", H5T_NATIVE_LONG, capMatrixAllOffsets, nOffsets);
+    if (ok) {
+        obj->capMatrixAllOffsets = capMatrixAllOffsets;
+        if (compressed) {
+            ok = oCapBlocksH5(file, obj, false, mpiInfo);
+        } else {
+            long int n = oCapMatrixLocalStart(capMatrixAllOffsets, obj->nObjects, mpiInfo->mpiRank, size);
+            obj->capMatrixAll = malloc(n*sizeof(*obj->capMatrixAll));
+            ok = oCapMatrixRowsH5(file, obj, false, mpiInfo);
+        }
+    }
+    H5Fclose(file);
+
+    if (!ok) {
+        msg(WARNING,"Capacitance matrix cache %s is incomplete, recomputing.", fName);
+        free(capMatrixAllOffsets);
+        free(obj->capMatrixAll);
+        if (obj->capBlocks!=NULL) {
+            for (long int l=0; l<obj->capBlocksOffset[obj->nObjects]; l++) {
+                free(obj->capBlocks[l].u);
+                free(obj->capBlocks[l].v);
+            }
+        }
+        free(obj->capBlocks);
+        free(obj->capBlocksOffset);
+        obj->capMatrixAll = NULL;
+        obj->capMatrixAllOffsets = NULL;
+        obj->capBlocks = NULL;
+        obj->capBlocksOffset = NULL;
+        return false;
+    }
+
+    msg(STATUS,"Loaded capacitance matrices from %s.", fName);
+    return true;
+}
+
+// Store the capacitance matrices in the cache, replacing what was there.
+static void oStoreCapacitanceCache(Object *obj, const char *fName, uint64_t hash, const MpiInfo *mpiInfo) {
+
+    int rank = mpiInfo->mpiRank;
+    int size = mpiInfo->mpiSize;
+
+    hid_t file = oOpenCacheH5(fName, true);
+    if (file<0) {
+        msg(WARNING,"Could not create capacitance matrix cache %s.", fName);
+        return;
+    }
+
+    double value[2];
+    oSplitHash(hash, value);
+    setH5Attr(file, "hash", value, 2);
+
+    long int nOffsets = obj->nObjects*(size+1);
+
+    oWriteCacheDataset(file, "capMatrixAllOffsets", H5T_STD_I64LE, H5T_NATIVE_LONG,
+                       obj->capMatrixAllOffsets, nOffsets, rank);
+    if (obj->capBlocks!=NULL) oCapBlocksH5(file, obj, true, mpiInfo);
+    else                      oCapMatrixRowsH5(file, obj, true, mpiInfo);
+
+    H5Fclose(file);
+    msg(STATUS,"Stored capacitance matrices in %s.", fName);
+}
+
+// Prepare the index and work arrays used by oApplyCapacitanceMatrix().
+static void oSetupCapacitanceApply(Object *obj, const MpiInfo *mpiInfo) {
+
+    int rank = mpiInfo->mpiRank;
+    int size = mpiInfo->mpiSize;
+    long int nObjects = obj->nObjects;
+    long int *offsets = obj->capMatrixAllOffsets;
+
+    // The gathered surface potentials hold the nodes of each core in turn,
+    // and within each core the nodes of all objects in turn.
+    int *recvCounts = malloc(size*sizeof(*recvCounts));
+    int *displs = malloc(size*sizeof(*displs));
+    long int displ = 0;
+    for (int r=0; r<size; r++) {
+        long int count = 0;
+        for (long int a=0; a<nObjects; a++) {
+            count += offsets[a*(size+1)+r+1]-offsets[a*(size+1)+r];
+        }
+        recvCounts[r] = (int)count;
+        displs[r] = (int)displ;
+        displ += count;
+    }
+    long int nTotal = displ;
+    if (nTotal>INT_MAX) msg(ERROR,"Too many surface nodes on the objects (%ld).", nTotal);
+
+    // Position of surface node j of object a in the gathered potentials.
+    long int *gatherIndex = malloc(nTotal*sizeof(*gatherIndex));
+    long int offset = 0;
+    for (long int a=0; a<nObjects; a++) {
+        long int totSNGlob = offsets[a*(size+1)+size];
+        for (int r=0; r<size; r++) {
+            long int pos = displs[r];
+            for (long int b=0; b<a; b++) pos += offsets[b*(size+1)+r+1]-offsets[b*(size+1)+r];
+            for (long int j=offsets[a*(size+1)+r]; j<offsets[a*(size+1)+r+1]; j++) {
+                gatherIndex[offset+j] = pos + j-offsets[a*(size+1)+r];
+            }
+        }
+        offset += totSNGlob;
+    }
+
+    free(obj->capRecvCounts);
+    free(obj->capDispls);
+    free(obj->capGatherIndex);
+    free(obj->capRowSum);
+    free(obj->capPhiAll);
+    free(obj->capDeltaPhi);
+    free(obj->capWork);
+
+    obj->capRecvCounts = recvCounts;
+    obj->capDispls = displs;
+    obj->capGatherIndex = gatherIndex;
+    obj->capRowSum = malloc(nTotal*sizeof(*obj->capRowSum));
+    obj->capPhiAll = malloc(nTotal*sizeof(*obj->capPhiAll));
+    obj->capDeltaPhi = malloc(nTotal*sizeof(*obj->capDeltaPhi));
+
+    // Holds both the local potentials and the local charge corrections, and
+    // for compressed matrices the intermediate product of low-rank blocks.
+    long int nLocalAll = obj->lookupSurfaceOffset[nObjects];
+    long int maxRank = 0;
+    if (obj->capBlocks!=NULL) {
+        for (long int l=0; l<obj->capBlocksOffset[nObjects]; l++) {
+            if (obj->capBlocks[l].rank>maxRank) maxRank = obj->capBlocks[l].rank;
+        }
+    }
+    obj->capWork = malloc((nLocalAll+maxRank+1)*sizeof(*obj->capWork));
+
+    // The row sums of the capacitance matrices (used in eq. 7). The matrices
+    // are symmetric, so the row sums are the column sums of the rows each
+    // core has.
+    double *rowSum = obj->capRowSum;
+    double *ones = obj->capDeltaPhi;
+    adSetAll(rowSum,nTotal,0);
+    adSetAll(ones,nTotal,1);
+    offset = 0;
+    for (long int a=0; a<nObjects; a++) {
+        long int totSNGlob = offsets[a*(size+1)+size];
+        if (obj->capBlocks!=NULL) {
+            double *tmp = &obj->capWork[nLocalAll];
+            for (long int l=obj->capBlocksOffset[a]; l<obj->capBlocksOffset[a+1]; l++) {
+                CapBlock *blk = &obj->capBlocks[l];
+                double *y = &rowSum[offset+blk->col];
+                if (blk->rank<0) {
+                    cblas_dgemv(CblasRowMajor, CblasTrans, (int)blk->m, (int)blk->n, 1.0, \
+                                blk->u, (int)blk->n, ones, 1, 1.0, y, 1);
+                } else if (blk->rank>0) {
+                    cblas_dgemv(CblasRowMajor, CblasTrans, (int)blk->m, (int)blk->rank, 1.0, \
+                                blk->u, (int)blk->rank, ones, 1, 0.0, tmp, 1);
+                    cblas_dgemv(CblasRowMajor, CblasTrans, (int)blk->rank, (int)blk->n, 1.0, \
+                                blk->v, (int)blk->n, tmp, 1, 1.0, y, 1);
+                }
+            }
+        } else {
+            long int nLocal = offsets[a*(size+1)+rank+1]-offsets[a*(size+1)+rank];
+            double *capMatrix = &obj->capMatrixAll[oCapMatrixLocalStart(offsets, a, rank, size)];
+            for (long int k=0; k<nLocal; k++) {
+                for (long int j=0; j<totSNGlob; j++) rowSum[offset+j] += capMatrix[totSNGlob*k+j];
+            }
+        }
+        offset += totSNGlob;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, rowSum, (int)nTotal, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+
+    // The inverse of the total sum of elements in each capacitance matrix.
+    if (obj->capMatrixSum==NULL) obj->capMatrixSum = malloc(nObjects*sizeof(*obj->capMatrixSum));
+    offset = 0;
+    for (long int a=0; a<nObjects; a++) {
+        long int totSNGlob = offsets[a*(size+1)+size];
+        obj->capMatrixSum[a] = 1/adSum(&rowSum[offset],totSNGlob);
+        offset += totSNGlob;
+    }
+}
+
+// Adaptive cross approximation (partial pivoting) of the m x n block A with
+// leading dimension ld, to relative accuracy tol in the Frobenius norm. On
+// success u (m x rank) and v (rank x n) are allocated and the rank is
+// returned. Returns -1 if the rank would exceed maxRank.
+static long int oAcaBlock(const double *A, long int ld, long int m, long int n,
+                          double tol, long int maxRank, double **u, double **v) {
+
+    // Column l of U and row l of V are kept contiguous while building.
+    double *uCols = malloc((maxRank*m+1)*sizeof(*uCols));
+    double *vRows = malloc((maxRank+1)*n*sizeof(*vRows));
+    bool *usedRow = calloc(m, sizeof(*usedRow));
+
+    double normS2 = 0;
+    long int k = 0;
+    long int iPivot = 0;
+    bool converged = false;
+
+    while (!converged) {
+
+        // Residual of row iPivot.
+        double *vk = &vRows[k*n];
+        usedRow[iPivot] = true;
+        for (long int j=0; j<n; j++) {
+            vk[j] = A[ld*iPivot+j];
+            for (long int l=0; l<k; l++) vk[j] -= uCols[l*m+iPivot]*vRows[l*n+j];
+        }
+
+        long int jPivot = 0;
+        for (long int j=1; j<n; j++) if (fabs(vk[j])>fabs(vk[jPivot])) jPivot = j;
+
+        if (vk[jPivot]!=0) {
+
+            if (k==maxRank) break;
+
+            double pivot = vk[jPivot];
+            for (long int j=0; j<n; j++) vk[j] /= pivot;
+
+            // Residual of column jPivot.
+            double *uk = &uCols[k*m];
+            for (long int i=0; i<m; i++) {
+                uk[i] = A[ld*i+jPivot];
+                for (long int l=0; l<k; l++) uk[i] -= uCols[l*m+i]*vRows[l*n+jPivot];
+            }
+
+            // Update the estimate of the norm of the approximation.
+            double normU2 = 0, normV2 = 0;
+            for (long int i=0; i<m; i++) normU2 += uk[i]*uk[i];
+            for (long int j=0; j<n; j++) normV2 += vk[j]*vk[j];
+            for (long int l=0; l<k; l++) {
+                double uu = 0, vv = 0;
+                for (long int i=0; i<m; i++) uu += uk[i]*uCols[l*m+i];
+                for (long int j=0; j<n; j++) vv += vk[j]*vRows[l*n+j];
+                normS2 += 2*uu*vv;
+            }
+            normS2 += normU2*normV2;
+            k++;
+
+            if (normU2*normV2 <= tol*tol*normS2) converged = true;
+        }
+
+        // Next row: the largest remaining entry of the last column.
+        if (!converged) {
+            long int next = -1;
+            if (vk[jPivot]!=0) {
+                double *uk = &uCols[(k-1)*m];
+                for (long int i=0; i<m; i++) {
+                    if (!usedRow[i] && (next<0 || fabs(uk[i])>fabs(uk[next]))) next = i;
+                }
+            } else {
+                for (long int i=0; i<m && next<0; i++) if (!usedRow[i]) next = i;
+            }
+            if (next<0) converged = true;     // Every row is represented exactly
+            else iPivot = next;
+        }
+    }
+
+    free(usedRow);
+    if (!converged) {
+        free(uCols);
+        free(vRows);
+        return -1;
+    }
+
+    *u = malloc((m*k+1)*sizeof(**u));
+    *v = malloc((k*n+1)*sizeof(**v));
+    for (long int i=0; i<m; i++) {
+        for (long int l=0; l<k; l++) (*u)[i*k+l] = uCols[l*m+i];
+    }
+    for (long int l=0; l<k*n; l++) (*v)[l] = vRows[l];
+
+    free(uCols);
+    free(vRows);
+    return k;
+}
+
+// Compress columns col to col+n-1 of the rows this core has of an object,
+// held in stripe with leading dimension ld, into blocks of at most blockSize
+// rows appended to blocks. Blocks on the diagonal are kept dense, the
+// others are compressed with ACA when that saves memory. stored accumulates
+// the doubles stored compressed and dense.
+static void oCompressCapacitanceStripe(CapBlock **blocks, const double *stripe, long int ld,
+                                       long int beginIndex, long int endIndex,
+                                       long int col, long int n, double tol,
+                                       long int blockSize, long int *nBlocks,
+                                       long int *nAlloc, double *stored) {
+
+    for (long int row=beginIndex; row<endIndex; row+=blockSize) {
+
+        if (*nBlocks==*nAlloc) {
+            *nAlloc *= 2;
+            *blocks = realloc(*blocks, *nAlloc*sizeof(**blocks));
+        }
+        CapBlock *blk = &(*blocks)[(*nBlocks)++];
+
+        blk->row = row;
+        blk->col = col;
+        blk->m = endIndex-row < blockSize ? endIndex-row : blockSize;
+        blk->n = n;
+        blk->rank = -1;
+        blk->u = NULL;
+        blk->v = NULL;
+
+        const double *A = &stripe[ld*(row-beginIndex)];
+        bool diagonal = row < col+blk->n && col < row+blk->m;
+        if (!diagonal) {
+            long int limit = blk->m*blk->n/(blk->m+blk->n);
+            blk->rank = oAcaBlock(A, ld, blk->m, blk->n, tol, limit, &blk->u, &blk->v);
+        }
+
+        if (blk->rank<0) {
+            blk->u = malloc(blk->m*blk->n*sizeof(*blk->u));
+            for (long int i=0; i<blk->m; i++) {
+                for (long int j=0; j<blk->n; j++) blk->u[blk->n*i+j] = A[ld*i+j];
+            }
+        }
+        stored[0] += oCapBlockValues(blk);
+        stored[1] += blk->m*blk->n;
+    }
+}
+
+// Y = (P+P^T)X/2, where P is the compressed potential matrix of object a with
+// n surface nodes and X and Y have k columns (row-major). X and Y are whole on
+// every core, while every core has the blocks of its own rows. tmp needs room
+// for k times the largest rank of the blocks.
+static void oCapBlocksApply(const Object *obj, long int a, long int n, long int k,
+                            const double *X, double *Y, double *tmp) {
+
+    int nk = (int)k;
+    adSetAll(Y,n*k,0);
+    for (long int l=obj->capBlocksOffset[a]; l<obj->capBlocksOffset[a+1]; l++) {
+        CapBlock *blk = &obj->capBlocks[l];
+        int m = (int)blk->m;
+        int nCols = (int)blk->n;
+        int r = (int)blk->rank;
+        const double *xRow = &X[k*blk->row], *xCol = &X[k*blk->col];
+        double *yRow = &Y[k*blk->row], *yCol = &Y[k*blk->col];
+        if (blk->rank<0) {
+            cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, m, nk, nCols, 0.5, \
+                        blk->u, nCols, xCol, nk, 1.0, yRow, nk);
+            cblas_dgemm(CblasRowMajor, CblasTrans, CblasNoTrans, nCols, nk, m, 0.5, \
+                        blk->u, nCols, xRow, nk, 1.0, yCol, nk);
+        } else if (blk->rank>0) {
+            cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, r, nk, nCols, 1.0, \
+                        blk->v, nCols, xCol, nk, 0.0, tmp, nk);
+            cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, m, nk, r, 0.5, \
+                        blk->u, r, tmp, nk, 1.0, yRow, nk);
+            cblas_dgemm(CblasRowMajor, CblasTrans, CblasNoTrans, r, nk, m, 1.0, \
+                        blk->u, r, xRow, nk, 0.0, tmp, nk);
+            cblas_dgemm(CblasRowMajor, CblasTrans, CblasNoTrans, nCols, nk, r, 0.5, \
+                        blk->v, nCols, tmp, nk, 1.0, yCol, nk);
+        }
+    }
+
+    // Summed in pieces, since n*k may not fit in an int.
+    for (long int i=0; i<n*k; i+=INT_MAX) {
+        long int count = n*k-i < INT_MAX ? n*k-i : INT_MAX;
+        MPI_Allreduce(MPI_IN_PLACE, &Y[i], (int)count, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    }
+}
+
+// Columns first to first+k-1 of the inverse of (P+P^T)/2 for object a (see
+// oCapBlocksApply()), by k conjugate gradient solves side by side to relative
+// accuracy tol. X (n x k, row-major) is the result. work needs room for 3nk
+// elements followed by the room needed by oCapBlocksApply(). The residuals of
+// rank 0 decide when to stop, so that every core does the same iterations.
+static void oCapBlocksInverse(const Object *obj, long int a, long int n, long int first,
+                              long int k, double *X, double tol, double *work) {
+
+    double *r = work;
+    double *p = &work[n*k];
+    double *q = &work[2*n*k];
+    double *tmp = &work[3*n*k];
+    double rr[k], rrNew[k], pq[k], alpha[k];
+
+    // The right-hand sides are unit vectors, so the residuals start there.
+    adSetAll(X,n*k,0);
+    adSetAll(r,n*k,0);
+    for (long int c=0; c<k; c++) {
+        r[k*(first+c)+c] = 1;
+        rr[c] = 1;
+    }
+    for (long int i=0; i<n*k; i++) p[i] = r[i];
+
+    bool converged = false;
+    for (long int iter=0; !converged; iter++) {
+
+        if (iter==n) msg(ERROR,"Inverting the capacitance matrix of object %ld did not converge.", a);
+
+        oCapBlocksApply(obj, a, n, k, p, q, tmp);
+
+        // Converged columns are left as they are.
+        for (long int c=0; c<k; c++) pq[c] = 0;
+        for (long int i=0; i<n; i++) {
+            for (long int c=0; c<k; c++) pq[c] += p[k*i+c]*q[k*i+c];
+        }
+        for (long int c=0; c<k; c++) {
+            alpha[c] = rr[c]>tol*tol ? rr[c]/pq[c] : 0;
+            rrNew[c] = 0;
+        }
+        for (long int i=0; i<n; i++) {
+            for (long int c=0; c<k; c++) {
+                X[k*i+c] += alpha[c]*p[k*i+c];
+                r[k*i+c] -= alpha[c]*q[k*i+c];
+                rrNew[c] += r[k*i+c]*r[k*i+c];
+            }
+        }
+        MPI_Bcast(rrNew, (int)k, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+
+        converged = true;
+        for (long int c=0; c<k; c++) {
+            if (rr[c]>tol*tol) {
+                double beta = rrNew[c]/rr[c];
+                for (long int i=0; i<n; i++) p[k*i+c] = r[k*i+c]+beta*p[k*i+c];
+                rr[c] = rrNew[c];
+            }
+            if (rr[c]>tol*tol) converged = false;
+        }
+    }
+}
+
+// Replace the compressed potential matrices in obj->capBlocks by compressed
+// capacitance matrices, without forming either whole. The columns of the
+// inverse are solved for nBatch at a time, and each core compresses its rows
+// of them a stripe of blockSize columns at a time. stored accumulates the
+// doubles stored compressed and dense.
+static void oInvertCapacitanceBlocks(Object *obj, double tol, long int blockSize,
+                                     long int nBatch, double *stored, const MpiInfo *mpiInfo) {
+
+    int rank = mpiInfo->mpiRank;
+    int size = mpiInfo->mpiSize;
+    long int nObjects = obj->nObjects;
+    long int *offsets = obj->capMatrixAllOffsets;
+
+    long int maxNodes = 0, maxLocal = 0, maxRank = 0;
+    for (long int a=0; a<nObjects; a++) {
+        long int totSNGlob = offsets[a*(size+1)+size];
+        long int nLocal = offsets[a*(size+1)+rank+1]-offsets[a*(size+1)+rank];
+        if (totSNGlob>maxNodes) maxNodes = totSNGlob;
+        if (nLocal>maxLocal) maxLocal = nLocal;
+    }
+    for (long int l=0; l<obj->capBlocksOffset[nObjects]; l++) {
+        if (obj->capBlocks[l].rank>maxRank) maxRank = obj->capBlocks[l].rank;
+    }
+
+    double *X = malloc((maxNodes*nBatch+1)*sizeof(*X));
+    double *work = malloc(((3*maxNodes+maxRank)*nBatch+1)*sizeof(*work));
+    double *stripe = malloc((maxLocal*blockSize+1)*sizeof(*stripe));
+
+    long int nBlocks = 0;
+    long int nAlloc = 64;
+    CapBlock *blocks = malloc(nAlloc*sizeof(*blocks));
+    long int *blocksOffset = malloc((nObjects+1)*sizeof(*blocksOffset));
+    blocksOffset[0] = 0;
+
+    for (long int a=0; a<nObjects; a++) {
+
+        long int totSNGlob = offsets[a*(size+1)+size];
+        long int beginIndex = offsets[a*(size+1)+rank];
+        long int endIndex = offsets[a*(size+1)+rank+1];
+        long int first = 0;
+
+        for (long int i0=0; i0<totSNGlob; i0+=nBatch) {
 
+            long int nThis = totSNGlob-i0 < nBatch ? totSNGlob-i0 : nBatch;
+            msg(STATUS,"Inverting capacitance matrix for nodes %ld-%ld of %ld for object %ld of %ld.", \
+                i0+1,i0+nThis,totSNGlob,a+1,nObjects);
+
+            oCapBlocksInverse(obj, a, totSNGlob, i0, nThis, X, tol, work);
+
+            // Fill columns i0 to i0+nThis, compressing every completed stripe.
+            for (long int b=0; b<nThis; b++) {
+                long int i = i0+b;
+                for (long int k=beginIndex; k<endIndex; k++) {
+                    stripe[blockSize*(k-beginIndex) + i-first] = X[nThis*k+b];
+                }
+                if (i+1-first==blockSize || i+1==totSNGlob) {
+                    oCompressCapacitanceStripe(&blocks, stripe, blockSize, beginIndex, endIndex, \
+                                               first, i+1-first, tol, blockSize, \
+                                               &nBlocks, &nAlloc, stored);
+                    first = i+1;
+                }
+            }
+        }
+        blocksOffset[a+1] = nBlocks;
+    }
+
+    for (long int l=0; l<obj->capBlocksOffset[nObjects]; l++) {
+        free(obj->capBlocks[l].u);
+        free(obj->capBlocks[l].v);
+    }
+    free(obj->capBlocks);
+    free(obj->capBlocksOffset);
+    obj->capBlocks = blocks;
+    obj->capBlocksOffset = blocksOffset;
+
+    free(X);
+    free(work);
+    free(stripe);
 }
 
 // Compute the capacitance matrix for each object.
@@ -166,24 +1124,45 @@ void oComputeCapacitanceMatrix(Object *obj, const dictionary *ini, const MpiInfo
     int size = mpiInfo->mpiSize;
     long int *lookupSurf = obj->lookupSurface;
     long int *lookupSurfOff = obj->lookupSurfaceOffset;
+
+    double compression = iniGetDouble(ini, "objects:capCompression");
+    long int blockSize = iniGetLongInt(ini, "objects:capBlockSize");
+    bool compress = compression>0;
+    if (compress && blockSize<2) msg(ERROR,"objects:capBlockSize must be at least 2");
+
+    // Reuse the matrices from an earlier run with the same geometry and grid.
+    char *cacheName = iniGetStr(ini, "objects:capCache");
+    bool useCache = strcmp(cacheName, "none");
+    uint64_t hash = 0;
+    if (useCache) {
+        hash = oCapacitanceHash(obj, ini, mpiInfo);
+        if (oLoadCapacitanceCache(obj, cacheName, hash, compress, mpiInfo)) {
+            oSetupCapacitanceApply(obj, mpiInfo);
+            free(cacheName);
+            return;
+        }
+    }
+
+    int nBatch = iniGetInt(ini, "objects:capBatchSize");
+    if (nBatch<1) msg(ERROR,"objects:capBatchSize must be at least 1");
+    double tol = 1.E-10;
     
-    // Allocate and initialise the structures to run the potential solver.
-    //funPtr mgAlgo = getMgAlgo(ini);
-    //Grid *res = gAlloc(ini, SCALAR);
-    //Multigrid *mgRes = mgAlloc(ini, res);
-    //Grid *rho = gAlloc(ini, SCALAR);
-    //Grid *phi = gAlloc(ini, SCALAR);
-    Grid *mgPhi = gAlloc(ini, SCALAR); //mgAllocSolver converts mgPhi to Multigrid
-    Grid *mgRho = gAlloc(ini, SCALAR);
-    MultigridSolver *solver = mgAllocSolver(ini, mgRho, mgPhi);
+    // The solver gives the multigrid settings. The batched grids hold one
+    // unit-charge right-hand side per value, solved together.
+    Grid *phi = gAlloc(ini, SCALAR);
+    Grid *rho = gAlloc(ini, SCALAR);
+    MultigridSolver *solver = mgAllocSolver(ini, rho, phi);
 
-    gZero(mgRho);
+    Grid *rhoBatch = gAlloc(ini, nBatch);
+    Grid *phiBatch = gAlloc(ini, nBatch);
+    Grid *resBatch = gAlloc(ini, nBatch);
+    Multigrid *mgRho = mgAllocBatch(solver->mgRho, rhoBatch);
+    Multigrid *mgPhi = mgAllocBatch(solver->mgRho, phiBatch);
+    Multigrid *mgRes = mgAllocBatch(solver->mgRho, resBatch);
     
     // Find the number of surface nodes for each object.
     long int *nodCorLoc = malloc((size+1)*sizeof(*nodCorLoc));
     long int *nodCorGlob = malloc(obj->nObjects*(size+1)*sizeof(*nodCorGlob));
-    
-    double *capMatrixSum = malloc(obj->nObjects*sizeof(*capMatrixSum));
 
     for (long int a=0; a<obj->nObjects; a++) {
         
@@ -199,102 +1178,157 @@ void oComputeCapacitanceMatrix(Object *obj, const dictionary *ini, const MpiInfo
         for (long int b=0; b<size+1; b++) nodCorGlob[a*(size+1)+b] = nodCorLoc[b];
     }
     
-    // Find the size and initialise the array holding the capacitance matrices for all objects.
-    long int capMatrixAllSize = 0;
-    for (long int a=0; a<obj->nObjects; a++) {
-        capMatrixAllSize +=nodCorGlob[a*(size+1)+size];
+    // Find the size and initialise the array holding the rows of the
+    // capacitance matrices this core has. Whole matrices only exist on the
+    // core inverting them. Compressed matrices never exist as a whole, but
+    // one stripe of blockSize columns of the local rows is held at a time.
+    double *capMatrixAll = NULL;
+    double **capMatrixFull = malloc(obj->nObjects*sizeof(*capMatrixFull));
+    double *stripe = NULL;
+    long int nBlocks = 0;
+    long int nAlloc = 64;
+    double stored[2] = {0, 0};      // Doubles stored compressed and dense
+    if (compress) {
+        long int maxLocal = 0;
+        for (long int a=0; a<obj->nObjects; a++) {
+            long int nLocal = nodCorGlob[a*(size+1)+rank+1]-nodCorGlob[a*(size+1)+rank];
+            if (nLocal>maxLocal) maxLocal = nLocal;
+        }
+        stripe = malloc((maxLocal*blockSize+1)*sizeof(*stripe));
+        obj->capBlocks = malloc(nAlloc*sizeof(*obj->capBlocks));
+        obj->capBlocksOffset = malloc((obj->nObjects+1)*sizeof(*obj->capBlocksOffset));
+        obj->capBlocksOffset[0] = 0;
+    } else {
+        long int capMatrixAllSize = oCapMatrixLocalStart(nodCorGlob, obj->nObjects, rank, size);
+        capMatrixAll = malloc(capMatrixAllSize*sizeof(*capMatrixAll));
     }
-    double *capMatrixAll = malloc(capMatrixAllSize*capMatrixAllSize*sizeof(*capMatrixAll));
-    //long int *capMatrixAllOffsets = malloc(obj->nObjects*(size+1)*sizeof(*capMatrixAllOffsets));
+
+    int *recvCounts = malloc(size*sizeof(*recvCounts));
+    int *displs = malloc(size*sizeof(*displs));
 
     // Compute the actual capacitance matrix for each object.
     for (long int a=0; a<obj->nObjects; a++) {
-        long int j = 0; // Keep track of the rank
-        long int inode = 0; // Keep track of the node number
-
         
         long int totSNGlob = nodCorGlob[a*(size+1)+size];
         long int beginIndex = nodCorGlob[a*(size+1)+rank];
         long int endIndex = nodCorGlob[a*(size+1)+rank+1];
+        long int nLocal = endIndex-beginIndex;
+        if (totSNGlob>INT_MAX) msg(ERROR,"Too many surface nodes on object %ld (%ld).", a, totSNGlob);
         
-        // Initialise the matrix and its inverse.
-        double *capMatrix = malloc( (totSNGlob*totSNGlob) * sizeof(*capMatrix));
-        double *invCapMatrix = malloc( (totSNGlob*totSNGlob) * sizeof(*invCapMatrix));
-        adSetAll(capMatrix,totSNGlob*totSNGlob,0);
-        adSetAll(invCapMatrix,totSNGlob*totSNGlob,0);
-
-        // Loop over the nodes and fill the matrix
-        for (long int i=0; i<totSNGlob; i++) {
-            msg(STATUS,"Solving capacitance matrix for node %ld of %ld for object %ld of %ld.", \
-                i+1,totSNGlob,a+1,obj->nObjects);
-            
-            // Don't loop over cores who do not have any surface nodes.
-            while ((nodCorGlob[a*(size+1)+j+1]-nodCorGlob[a*(size+1)+j])==0) {
-                j++;
-            }
-            
-            // Set the surface node to 1 charge.
-            if (rank==j) {
-                mgRho->val[lookupSurf[lookupSurfOff[a] + inode]] = 1;
-            }
-            
-            // Solve for the potential.
-            mgSolve(solver, mgRho, mgPhi, mpiInfo);
-            
-            // Set the surface node back to zero.
-            if (rank==j) {
-                mgRho->val[lookupSurf[inode]] = 0;
-            }
-            // Fill column i of the capacitance matrix.
-            for (int k=beginIndex; k<endIndex; k++) {
-                capMatrix[totSNGlob*k + i] = mgPhi->val[lookupSurf[lookupSurfOff[a] + k-beginIndex]];
+        // Every core fills the rows of the surface nodes it has, from column
+        // first on.
+        double *capRows = compress ? stripe : &capMatrixAll[oCapMatrixLocalStart(nodCorGlob, a, rank, size)];
+        long int ld = compress ? blockSize : totSNGlob;
+        long int first = 0;
+
+        for (long int i0=0; i0<totSNGlob; i0+=nBatch) {
+
+            long int nThis = totSNGlob-i0 < nBatch ? totSNGlob-i0 : nBatch;
+            msg(STATUS,"Solving capacitance matrix for nodes %ld-%ld of %ld for object %ld of %ld.", \
+                i0+1,i0+nThis,totSNGlob,a+1,obj->nObjects);
+
+            // Set surface node i0+b to 1 charge in right-hand side b.
+            gZero(rhoBatch);
+            gZero(phiBatch);
+            for (long int b=0; b<nThis; b++) {
+                long int i = i0+b;
+                if (i>=beginIndex && i<endIndex) {
+                    rhoBatch->val[lookupSurf[lookupSurfOff[a] + i-beginIndex]*nBatch + b] = 1;
+                }
             }
             
-            // Increase the counters. If you looped over all nodes on this core, increase the rank and reset inode.
-            inode++;
-            while (inode>(nodCorGlob[a*(size+1)+j+1]-nodCorGlob[a*(size+1)+j]-1)) {
-                j++;
-                inode=0;
+            // Solve for the potentials.
+            mgSolveBatch(mgRho, mgPhi, mgRes, tol, mpiInfo);
+
+            // Fill columns i0 to i0+nThis, compressing every completed stripe.
+            for (long int b=0; b<nThis; b++) {
+                long int i = i0+b;
+                for (long int k=beginIndex; k<endIndex; k++) {
+                    long int node = lookupSurf[lookupSurfOff[a] + k-beginIndex];
+                    capRows[ld*(k-beginIndex) + i-first] = phiBatch->val[node*nBatch + b];
+                }
+                if (compress && (i+1-first==blockSize || i+1==totSNGlob)) {
+                    oCompressCapacitanceStripe(&obj->capBlocks, stripe, blockSize, beginIndex, endIndex, \
+                                               first, i+1-first, compression, blockSize, \
+                                               &nBlocks, &nAlloc, stored);
+                    first = i+1;
+                }
             }
+        }
 
+        if (compress) {
+            obj->capBlocksOffset[a+1] = nBlocks;
+            capMatrixFull[a] = NULL;
+            continue;
         }
-    
-        // Make sure every codes has the complete matrix (needed for BLAS).
-        MPI_Allreduce(MPI_IN_PLACE, capMatrix, (totSNGlob*totSNGlob), \
-                      MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
- 
-        // Compute the inverse of the capacitance matrix.
-        // Actually, the inverse is the capacitance matrix. Probably have to rethink the variable names.
-        gsl_matrix_view A = gsl_matrix_view_array(capMatrix, totSNGlob, totSNGlob);
-        gsl_matrix_view invA = gsl_matrix_view_array(invCapMatrix, totSNGlob, totSNGlob);
 
-        //debug 290619
-        print_gsl_mat(A);
+        // Collect the matrix on the core inverting it (objects are spread over the cores).
+        MPI_Datatype rowType = oCapMatrixRowType(nodCorGlob, a, size, recvCounts, displs);
+        int owner = a%size;
+        capMatrixFull[a] = NULL;
+        if (rank==owner) capMatrixFull[a] = malloc(totSNGlob*totSNGlob*sizeof(*capMatrixFull[a]));
+        MPI_Gatherv(capRows, (int)nLocal, rowType, capMatrixFull[a], \
+                    recvCounts, displs, rowType, owner, MPI_COMM_WORLD);
+        MPI_Type_free(&rowType);
+    }
 
-        int s;
-        gsl_permutation *p = gsl_permutation_alloc(totSNGlob);
-        gsl_linalg_LU_decomp(&A.matrix, p, &s);
-        gsl_linalg_LU_invert(&A.matrix, p, &invA.matrix);
-        print_gsl_mat(invA);
+    if (compress) {
+
+        // The blocks are of the potential matrices. They are inverted in
+        // compressed form, so that applying them stays a local product.
+        free(stripe);
+        obj->capMatrixAllOffsets = nodCorGlob;
+        stored[0] = 0;
+        stored[1] = 0;
+        oInvertCapacitanceBlocks(obj, compression, blockSize, nBatch, stored, mpiInfo);
+
+        MPI_Allreduce(MPI_IN_PLACE, stored, 2, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+        msg(STATUS,"Compressed capacitance matrices to %.1f%% of their dense size.", \
+            100*stored[0]/stored[1]);
+
+    } else {
 
-        // Add the invCapMatrix for object a to the big array.
-        for (long int l=0; l<totSNGlob*totSNGlob; l++) {
-            capMatrixAll[a*totSNGlob*totSNGlob+l] = invCapMatrix[l];
+        // Compute the inverse of the capacitance matrices.
+        // Actually, the inverse is the capacitance matrix. Probably have to rethink the variable names.
+        for (long int a=rank; a<obj->nObjects; a+=size) {
+            long int totSNGlob = nodCorGlob[a*(size+1)+size];
+            oInvertCapacitanceMatrix(capMatrixFull[a], totSNGlob);
         }
-        
-        // Compute here to total sum of elements in the capacitance matrix (needed later).
-        capMatrixSum[a] = adSum(invCapMatrix,totSNGlob*totSNGlob);
-        // We need the inverse later on.
-        capMatrixSum[a] = 1/capMatrixSum[a];
 
+        // Send every core back the rows of its surface nodes.
+        for (long int a=0; a<obj->nObjects; a++) {
+            long int nLocal = nodCorGlob[a*(size+1)+rank+1]-nodCorGlob[a*(size+1)+rank];
+            MPI_Datatype rowType = oCapMatrixRowType(nodCorGlob, a, size, recvCounts, displs);
+            MPI_Scatterv(capMatrixFull[a], recvCounts, displs, rowType, \
+                         &capMatrixAll[oCapMatrixLocalStart(nodCorGlob, a, rank, size)], \
+                         (int)nLocal, rowType, (int)(a%size), MPI_COMM_WORLD);
+            MPI_Type_free(&rowType);
+            free(capMatrixFull[a]);
+        }
     }
+    free(capMatrixFull);
     
     long int *capMatrixAllOffsets = nodCorGlob;
     
     // Add to object
     obj->capMatrixAll = capMatrixAll;
     obj->capMatrixAllOffsets = capMatrixAllOffsets;
-    obj->capMatrixSum = capMatrixSum;
+    oSetupCapacitanceApply(obj, mpiInfo);
+
+    if (useCache) oStoreCapacitanceCache(obj, cacheName, hash, mpiInfo);
+    free(cacheName);
+    free(recvCounts);
+    free(displs);
+    free(nodCorLoc);
+    mgFree(mgRho);
+    mgFree(mgPhi);
+    mgFree(mgRes);
+    gFree(rhoBatch);
+    gFree(phiBatch);
+    gFree(resBatch);
+    mgFreeSolver(solver);
+    gFree(rho);
+    gFree(phi);
 }
 
 // Construct and solve equation 5 in Miyake_Usui_PoP_2009
@@ -308,58 +1342,73 @@ void oApplyCapacitanceMatrix(Grid *rho, const Grid *phi, const Object *obj, cons
     double *capMatrixAll = obj->capMatrixAll;
     long int *capMatrixAllOffsets = obj->capMatrixAllOffsets;
     double *capMatrixSum = obj->capMatrixSum;
-    
+    double *capRowSum = obj->capRowSum;
+    long int *gatherIndex = obj->capGatherIndex;
+    double *capPhiAll = obj->capPhiAll;
+    double *deltaPhi = obj->capDeltaPhi;
+    double *capWork = obj->capWork;
+
+    // Collect the surface potentials of all objects in one go.
+    long int nLocalAll = lookupSurfOff[obj->nObjects];
+    for (long int j=0; j<nLocalAll; j++) capWork[j] = phi->val[lookupSurf[j]];
+    MPI_Allgatherv(capWork, (int)nLocalAll, MPI_DOUBLE, capPhiAll, \
+                   obj->capRecvCounts, obj->capDispls, MPI_DOUBLE, MPI_COMM_WORLD);
+
     // Loop over the objects
+    long int offset = 0;
     for (long int a=0; a<obj->nObjects; a++) {
         
-        // This number is in fact the correct potential of the object.
-        double capMatrixPhiSum = 0;
-        
         // total number of surface nodes
         long int totSNGlob = capMatrixAllOffsets[a*(size+1)+size];
         long int beginIndex = capMatrixAllOffsets[a*(size+1)+rank];
         long int endIndex = capMatrixAllOffsets[a*(size+1)+rank+1];
-        
-        double *deltaPhi = malloc(totSNGlob*sizeof(*deltaPhi));
-        adSetAll(deltaPhi,totSNGlob,0);
-        double *rhoCorr = malloc(totSNGlob*sizeof(*rhoCorr));
-        adSetAll(rhoCorr,totSNGlob,0);
-        
-        // Compute eq. 7.
-        for (long int i=0; i<totSNGlob; i++) {
-            // Make sure that each core loops only over the matrix elements/parts of the grid it has
-            for (long int j=beginIndex; j<endIndex; j++) {
-                capMatrixPhiSum += capMatrixAll[a*totSNGlob*totSNGlob+totSNGlob*j+i] \
-                * (phi->val[lookupSurf[lookupSurfOff[a] + j-beginIndex]]);
-            }
+        long int *index = &gatherIndex[offset];
+        double *dPhi = &deltaPhi[offset];
+
+        // Compute eq. 7. This is phi_c for each object.
+        double capMatrixPhiSum = 0;
+        for (long int j=0; j<totSNGlob; j++) {
+            capMatrixPhiSum += capRowSum[offset+j]*capPhiAll[index[j]];
         }
-        
-        // This is phi_c for each object.
         capMatrixPhiSum = capMatrixPhiSum*capMatrixSum[a];
-        MPI_Allreduce(MPI_IN_PLACE, &capMatrixPhiSum, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
         
         msg(STATUS,"Potential-check for object %ld : %f",a,capMatrixPhiSum);
-        //capMatrixPhiSum=0.03;
 
-        for (long int j=beginIndex; j<endIndex; j++) {
-            deltaPhi[j] = capMatrixPhiSum - phi->val[lookupSurf[lookupSurfOff[a] + j-beginIndex]];
+        for (long int j=0; j<totSNGlob; j++) {
+            dPhi[j] = capMatrixPhiSum - capPhiAll[index[j]];
         }
         
-        MPI_Allreduce(MPI_IN_PLACE, deltaPhi, totSNGlob, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-        
-        // Eq. 5
-        for (long int i=0; i<totSNGlob; i++) {
-            for (long int j=beginIndex; j<endIndex; j++) {
-                rhoCorr[i] += capMatrixAll[a*totSNGlob*totSNGlob+totSNGlob*j+i]*deltaPhi[j];
+        // Eq. 5, for the rows of the surface nodes this core has. The matrix
+        // is symmetric, so these rows are all that is needed.
+        long int nLocal = endIndex-beginIndex;
+        if (obj->capBlocks!=NULL) {
+            double *tmp = &capWork[nLocalAll];
+            adSetAll(capWork,nLocal,0);
+            for (long int l=obj->capBlocksOffset[a]; l<obj->capBlocksOffset[a+1]; l++) {
+                CapBlock *blk = &obj->capBlocks[l];
+                double *y = &capWork[blk->row-beginIndex];
+                if (blk->rank<0) {
+                    cblas_dgemv(CblasRowMajor, CblasNoTrans, (int)blk->m, (int)blk->n, 1.0, \
+                                blk->u, (int)blk->n, &dPhi[blk->col], 1, 1.0, y, 1);
+                } else if (blk->rank>0) {
+                    cblas_dgemv(CblasRowMajor, CblasNoTrans, (int)blk->rank, (int)blk->n, 1.0, \
+                                blk->v, (int)blk->n, &dPhi[blk->col], 1, 0.0, tmp, 1);
+                    cblas_dgemv(CblasRowMajor, CblasNoTrans, (int)blk->m, (int)blk->rank, 1.0, \
+                                blk->u, (int)blk->rank, tmp, 1, 1.0, y, 1);
+                }
             }
+        } else if (nLocal>0) {
+            double *capMatrix = &capMatrixAll[oCapMatrixLocalStart(capMatrixAllOffsets, a, rank, size)];
+            cblas_dgemv(CblasRowMajor, CblasNoTrans, (int)nLocal, (int)totSNGlob, 1.0, \
+                        capMatrix, (int)totSNGlob, dPhi, 1, 0.0, capWork, 1);
         }
         
-        MPI_Allreduce(MPI_IN_PLACE, rhoCorr, totSNGlob, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-        
         // Add the charge corrections.
-        for (long int j=beginIndex; j<endIndex; j++) {
-            rho->val[lookupSurf[lookupSurfOff[a] + j-beginIndex]] += rhoCorr[j];
+        for (long int j=0; j<nLocal; j++) {
+            rho->val[lookupSurf[lookupSurfOff[a] + j]] += capWork[j];
         }
+
+        offset += totSNGlob;
     }
 }
 
@@ -367,87 +1416,64 @@ void oApplyCapacitanceMatrix(Grid *rho, const Grid *phi, const Object *obj, cons
 //Find all the object nodes which are part of the object surface.
 void oFindObjectSurfaceNodes(Object *obj, const MpiInfo *mpiInfo) {
     
-    long int *sizeProd = obj->domain->sizeProd;
-    double *val = obj->domain->val;
+    Grid *domain = obj->domain;
+    long int *sizeProd = domain->sizeProd;
+    int *size = domain->size;
+    int *nGhostLayers = domain->nGhostLayers;
+    int rank = domain->rank;
+    double *val = domain->val;
+    long int nObjects = obj->nObjects;
     
     // Initialise the array storing the offsets for the surface nodes in the lookup table.
-    long int *lookupSurfaceOffset = malloc((obj->nObjects+1)*sizeof(*lookupSurfaceOffset));
-    alSetAll(lookupSurfaceOffset,obj->nObjects+1,0);
-    
-    // Find the 8 neighbour cells of each non-ghost node.
-    long int *myNB = malloc(9*sizeof(*myNB));
-    // Find the ofsetts first.
-    for (long int a=0; a<obj->nObjects; a++) {
-        for (long int b=0; b<sizeProd[obj->domain->rank]; b++) {
-            if (!isGhostNode(obj->domain, b)) {
-                myNB[0] = b;    // me on node i,j,k
-                myNB[1] = myNB[0];                  // cell i,j,k
-                myNB[2] = myNB[0] - sizeProd[3];    // cell i,j,k-1
-                myNB[3] = myNB[0] - sizeProd[1];                    // cell i-1,j,k
-                myNB[4] = myNB[0] - sizeProd[1] - sizeProd[3];      // cell i-1,j,k-1
-                myNB[5] = myNB[0] - sizeProd[2];                    // cell i,j-1,k
-                myNB[6] = myNB[0] - sizeProd[2] - sizeProd[3];      // cell i,j-1,k-1
-                myNB[7] = myNB[0] - sizeProd[2] - sizeProd[1];      // cell i-1,j-1,k
-                myNB[8] = myNB[0] - sizeProd[2] - sizeProd[1] - sizeProd[3];   // cell i-1,j-1,k-1
-                
-                int d=0;
-                if (val[myNB[1]]>(a+0.5) && val[myNB[1]]<(a+1.5)) d++;
-                if (val[myNB[2]]>(a+0.5) && val[myNB[2]]<(a+1.5)) d++;
-                if (val[myNB[3]]>(a+0.5) && val[myNB[3]]<(a+1.5)) d++;
-                if (val[myNB[4]]>(a+0.5) && val[myNB[4]]<(a+1.5)) d++;
-                if (val[myNB[5]]>(a+0.5) && val[myNB[5]]<(a+1.5)) d++;
-                if (val[myNB[6]]>(a+0.5) && val[myNB[6]]<(a+1.5)) d++;
-                if (val[myNB[7]]>(a+0.5) && val[myNB[7]]<(a+1.5)) d++;
-                if (val[myNB[8]]>(a+0.5) && val[myNB[8]]<(a+1.5)) d++;
-                
-                // Check if on surface.
-                if (d<7.5 && d>0) {
-                    lookupSurfaceOffset[a+1]++;
-                }
-            }
-        }
-    }
-    alCumSum(lookupSurfaceOffset+1,lookupSurfaceOffset,obj->nObjects);
-    
-    // Initialise and compute the lookup table.
-    long int *lookupSurface = malloc((lookupSurfaceOffset[obj->nObjects])*sizeof(*lookupSurface));
-    alSetAll(lookupSurface,lookupSurfaceOffset[obj->nObjects]+1,0);
-    
-    long int *index = malloc((obj->nObjects)*sizeof(*index));
-    for (long int i=0; i<obj->nObjects; i++) {
-        index[i]=lookupSurfaceOffset[i];
+    long int *lookupSurfaceOffset = malloc((nObjects+1)*sizeof(*lookupSurfaceOffset));
+    lookupSurfaceOffset[0] = 0;
+
+    // Lower corners of the 8 cells around a node.
+    long int cells[8];
+    for (int c=0; c<8; c++) {
+        cells[c] = -(c&1)*sizeProd[1] - ((c>>1)&1)*sizeProd[2] - ((c>>2)&1)*sizeProd[3];
     }
-    
-    for (long int a=0; a<obj->nObjects; a++) {
-        for (long int b=0; b<obj->domain->sizeProd[obj->domain->rank]; b++) {
-            if (!isGhostNode(obj->domain, b)) {
-                myNB[0] = b;    // me on node i,j,k
-                myNB[1] = myNB[0];                  // cell i,j,k
-                myNB[2] = myNB[0] - sizeProd[3];    // cell i,j,k-1
-                myNB[3] = myNB[0] - sizeProd[1];                    // cell i-1,j,k
-                myNB[4] = myNB[0] - sizeProd[1] - sizeProd[3];      // cell i-1,j,k-1
-                myNB[5] = myNB[0] - sizeProd[2];                    // cell i,j-1,k
-                myNB[6] = myNB[0] - sizeProd[2] - sizeProd[3];      // cell i,j-1,k-1
-                myNB[7] = myNB[0] - sizeProd[2] - sizeProd[1];                  // cell i-1,j-1,k;
-                myNB[8] = myNB[0] - sizeProd[2] - sizeProd[1] - sizeProd[3];    // cell i-1,j-1,k-1
-                
-                int d=0;
-                if (val[myNB[1]]>(a+0.5) && val[myNB[1]]<(a+1.5)) d++;
-                if (val[myNB[2]]>(a+0.5) && val[myNB[2]]<(a+1.5)) d++;
-                if (val[myNB[3]]>(a+0.5) && val[myNB[3]]<(a+1.5)) d++;
-                if (val[myNB[4]]>(a+0.5) && val[myNB[4]]<(a+1.5)) d++;
-                if (val[myNB[5]]>(a+0.5) && val[myNB[5]]<(a+1.5)) d++;
-                if (val[myNB[6]]>(a+0.5) && val[myNB[6]]<(a+1.5)) d++;
-                if (val[myNB[7]]>(a+0.5) && val[myNB[7]]<(a+1.5)) d++;
-                if (val[myNB[8]]>(a+0.5) && val[myNB[8]]<(a+1.5)) d++;
-                
-                // Check if on surface.
-                if (d<7.5 && d>0) {
-                    lookupSurface[index[a]] = myNB[0];
-                    index[a]++;
+
+    long int nAlloc = 64;
+    long int *lookupSurface = malloc(nAlloc*sizeof(*lookupSurface));
+    long int n = 0;
+
+    // A true node is on the surface of object a if some, but not all, of the
+    // cells around it have their lower corner in a. Only nodes in the
+    // bounding box of a (extended by one upwards) can be.
+    for (long int a=0; a<nObjects; a++) {
+
+        int lo[3], hi[3];
+        for (int d=0; d<3; d++) {
+            lo[d] = obj->boundingBox[6*a+d];
+            hi[d] = obj->boundingBox[6*a+3+d]+1;
+            if (lo[d]<nGhostLayers[d+1]) lo[d] = nGhostLayers[d+1];
+            if (hi[d]>size[d+1]-nGhostLayers[rank+d+1]-1) hi[d] = size[d+1]-nGhostLayers[rank+d+1]-1;
+        }
+
+        for (int l=lo[2]; l<=hi[2]; l++) {
+            for (int k=lo[1]; k<=hi[1]; k++) {
+                for (int j=lo[0]; j<=hi[0]; j++) {
+                    long int g = j*sizeProd[1] + k*sizeProd[2] + l*sizeProd[3];
+
+                    int d = 0;
+                    for (int c=0; c<8; c++) {
+                        double v = val[g+cells[c]];
+                        if (v>(a+0.5) && v<(a+1.5)) d++;
+                    }
+
+                    // Check if on surface.
+                    if (d<8 && d>0) {
+                        if (n==nAlloc) {
+                            nAlloc *= 2;
+                            lookupSurface = realloc(lookupSurface, nAlloc*sizeof(*lookupSurface));
+                        }
+                        lookupSurface[n++] = g;
+                    }
                 }
             }
         }
+        lookupSurfaceOffset[a+1] = n;
     }
     
     // Add to object.
@@ -456,6 +1482,26 @@ void oFindObjectSurfaceNodes(Object *obj, const MpiInfo *mpiInfo) {
 }
 
 
+// Fill a grid with the nodes and surface nodes of each object.
+void oFillConductor(Grid *conductor, const Object *obj, const MpiInfo *mpiInfo) {
+
+    long int nNodes = conductor->sizeProd[conductor->rank];
+    double *val = conductor->val;
+
+    for (long int g=0; g<nNodes; g++) val[g] = obj->domain->val[g];
+
+    // Surface nodes outside every object belong to the conductor as well.
+    for (long int a=0; a<obj->nObjects; a++) {
+        for (long int i=obj->lookupSurfaceOffset[a]; i<obj->lookupSurfaceOffset[a+1]; i++) {
+            long int g = obj->lookupSurface[i];
+            if (val[g]<0.5) val[g] = a+1;
+        }
+    }
+
+    gHaloOp(setSlice, conductor, mpiInfo, TOHALO);
+}
+
+
 // Collect the charge inside each object.
 void oCollectObjectCharge(Population *pop, Grid *rhoObj, Object *obj, const MpiInfo *mpiInfo) {
     
@@ -463,9 +1509,10 @@ void oCollectObjectCharge(Population *pop, Grid *rhoObj, Object *obj, const MpiI
     long int *sizeProd = rhoObj->sizeProd;
     
     int nSpecies = pop->nSpecies;
+    int nDims = pop->nDims;
     double *charge = pop->charge;
     
-    long int *lookupIntOff = obj->lookupInteriorOffset;
+    int *nodeObject = obj->nodeObject;
     long int *lookupSurfOff = obj->lookupSurfaceOffset;
     
     // We might add this to the Object, although probably better  to store the rhoObj for restarts and insulators later on.
@@ -481,12 +1528,13 @@ void oCollectObjectCharge(Population *pop, Grid *rhoObj, Object *obj, const MpiI
     for(int s=0;s<nSpecies;s++) {
         
         long int iStart = pop->iStart[s];
-        long int iStop = pop->iStop[s];
         
-        for(int i=iStart;i<iStop;i++){
+        // pCut() moves the last particle into the removed one's place, so
+        // i is only advanced when the particle is kept.
+        long int i = iStart;
+        while (i<pop->iStop[s]) {
             
-            double *pos = &pop->pos[3*i];
-            double *vel = &pop->vel[3*i];
+            double *pos = &pop->pos[nDims*i];
             
             // Integer parts of position
             int j = (int) pos[0];
@@ -496,13 +1544,13 @@ void oCollectObjectCharge(Population *pop, Grid *rhoObj, Object *obj, const MpiI
             long int p = j + k*sizeProd[2] + l*sizeProd[3];
             
             // Check whether p is one of the object nodes and collect the charge if so.
-            for (long int a=0; a<obj->nObjects; a++) {
-                for (long int b=lookupIntOff[a]; b<lookupIntOff[a+1]; b++) {
-                    if ((obj->lookupInterior[b])==p) {
-                        chargeCounter[a] += charge[s];
-                        pCut(pop, s, p, pos, vel);
-                    }
-                }
+            int a = nodeObject[p];
+            if (a>=0) {
+                double cutPos[nDims], cutVel[nDims];
+                chargeCounter[a] += charge[s];
+                pCut(pop, s, nDims*i, cutPos, cutVel);
+            } else {
+                i++;
             }
         }
     }
@@ -512,156 +1560,300 @@ void oCollectObjectCharge(Population *pop, Grid *rhoObj, Object *obj, const MpiI
             val[obj->lookupSurface[b]] += chargeCounter[a]*invNrSurfNod[a];
         }
     }
+
+    free(chargeCounter);
+    free(invNrSurfNod);
 }
 
-bool oParticleIntersection(Population *pop, long int particleId, Object *obj){
-    
-    //find nearest nodes
-    double *nearest = oFindNearestSurfaceNodes(pop, particleId, obj);
+// Squared distance transform along one line of n values with the given
+// stride (Felzenszwalb and Huttenlocher). f is replaced by the transform.
+static void oDistanceTransform1D(double *f, long int n, long int stride,
+                                 double *d, double *z, long int *v) {
+
+    long int k = 0;
+    v[0] = 0;
+    z[0] = -INFINITY;
+    z[1] = INFINITY;
+    for (long int q=1; q<n; q++) {
+        double s;
+        while (1) {
+            long int r = v[k];
+            s = ((f[q*stride]+q*q) - (f[r*stride]+r*r)) / (2.0*(q-r));
+            if (s>z[k]) break;
+            k--;    // z[0] is -inf, so this stops at k=0
+        }
+        k++;
+        v[k] = q;
+        z[k] = s;
+        z[k+1] = INFINITY;
+    }
 
-    //
+    k = 0;
+    for (long int q=0; q<n; q++) {
+        while (z[k+1]<q) k++;
+        d[q] = (q-v[k])*(q-v[k]) + f[v[k]*stride];
+    }
+    for (long int q=0; q<n; q++) f[q*stride] = d[q];
 }
 
-//stores index of particles that are close to an object at the current timestep
-void oVicinityParticles(Population *pop, Object *obj){
+// Distance from every node to the nearest node where inside is (or is not) set.
+static void oDistanceTransform(const Grid *domain, bool inside, double *dist) {
+
+    long int *sizeProd = domain->sizeProd;
+    int *size = domain->size;
+    long int nNodes = sizeProd[domain->rank];
+    const double far = 1e20;
+
+    for (long int g=0; g<nNodes; g++) {
+        dist[g] = ((domain->val[g]>0.5)==inside) ? 0 : far;
+    }
+
+    long int nMax = 1;
+    for (int d=1; d<domain->rank; d++) if (size[d]>nMax) nMax = size[d];
+    double *work = malloc(nMax*sizeof(*work));
+    double *z = malloc((nMax+1)*sizeof(*z));
+    long int *v = malloc(nMax*sizeof(*v));
+
+    // Separable: one pass along each dimension over every line.
+    for (int d=1; d<domain->rank; d++) {
+        long int stride = sizeProd[d];
+        for (long int g=0; g<nNodes; g++) {
+            if ((g/stride)%size[d]) continue;  // Not the start of a line
+            oDistanceTransform1D(&dist[g], size[d], stride, work, z, v);
+        }
+    }
 
-	double *val = obj->domain->val;
-	int nSpecies = pop->nSpecies;
-	int counter = 0;
-	long int *sizeProd = obj->domain->sizeProd;
-
-	for(int s=0; s < nSpecies; s++) {
-
-		long int iStart = pop->iStart[s];
-		long int iStop = pop->iStop[s];
-		
-		for(int i=iStart;i<iStop;i++){
-			
-			double *pos = &pop->pos[3*i];
-						
-			// Integer parts of position
-			int j = (int) pos[0];
-			int k = (int) pos[1];
-			int l = (int) pos[2];
-
-			// Index of nodes surrounding particle i
-			long int p 		= j*3 + k*sizeProd[2] + l*sizeProd[3];
-			long int pj 	= p + 3; //sizeProd[1];
-			long int pk 	= p + sizeProd[2];
-			long int pjk 	= pk + 3; //sizeProd[1];
-			long int pl 	= p + sizeProd[3];
-			long int pjl 	= pl + 3; //sizeProd[1];
-			long int pkl 	= pl + sizeProd[2];
-			long int pjkl 	= pkl + 3; //sizeProd[1];
-
-			// All neighbours must be part of bounding box, value of obj->domain->val 
-			// at a vicinity node is set to 2, obj->domain->val set to 1 for object itself.
-            // When particle does not have an object node as a neighbour, this sum will 16
-			int sum = val[p]+val[pj]+val[pk]+val[pjk]+val[pl]+val[pjl]+val[pkl]+val[pjkl];
-
-			if(sum < 16 && sum > 0){
-				pop->objVicinity[counter] = i;
-				counter++;
-			}
-		}
-	}
+    for (long int g=0; g<nNodes; g++) dist[g] = sqrt(dist[g]);
+
+    free(work);
+    free(z);
+    free(v);
 }
 
-//Relies on a courant number < 1 (otherwise particle might be inside object)
-//checks which particles in object vicinity will collide => overwrites pop->collisions
-void oFindParticleCollisions(Population *pop, Object *obj){
+// Signed distance to the object surfaces, negative inside, and its gradient.
+// The surface is taken halfway between object nodes and other nodes.
+static void oComputeDistanceField(Object *obj) {
 
-    long int *lookupIntOff = obj->lookupInteriorOffset;
-    long int *sizeProd = obj->domain->sizeProd;
+    Grid *domain = obj->domain;
+    long int *sizeProd = domain->sizeProd;
+    int *size = domain->size;
+    long int nNodes = sizeProd[domain->rank];
 
-    oVicinityParticles(pop, obj);
-    long int *vicinity = pop->objVicinity;
-    long int nCloseParticles = sizeof(vicinity) / sizeof(vicinity[0]);
-    long int counter = 0;
-    alSetAll(pop->collisions, nCloseParticles, 0);
+    double *distOut = malloc(nNodes*sizeof(*distOut));
+    double *distIn = malloc(nNodes*sizeof(*distIn));
+    oDistanceTransform(domain, true, distOut);
+    oDistanceTransform(domain, false, distIn);
 
+    double *sdf = malloc(nNodes*sizeof(*sdf));
+    for (long int g=0; g<nNodes; g++) {
+        if (domain->val[g]>0.5) sdf[g] = 0.5-distIn[g];
+        else                    sdf[g] = distOut[g]-0.5;
+    }
 
-    for(int i=0;i<nCloseParticles;i++){
-        
-        double *pos = &pop->pos[3*i];
-        double *vel = &pop->vel[3*i];
-        double *nextPos;
-        adAdd(pos,vel,nextPos,3);
-        
-        // Integer parts of position in next time step
-        int j = (int) nextPos[0];
-        int k = (int) nextPos[1];
-        int l = (int) nextPos[2];
-        
-        long int p = j + k*sizeProd[2] + l*sizeProd[3];
-        
-        // Check whether p is one of the object nodes
-        for (long int a=0; a<obj->nObjects; a++) {
-            for (long int b=lookupIntOff[a]; b<lookupIntOff[a+1]; b++) {
-                if ((obj->lookupInterior[b])==p) {
-                    pop->collisions[counter] = p;
-                    counter++;
-                }
-            }
+    // Normals by central differences (one-sided at the edges).
+    double *sdfNormal = malloc(3*nNodes*sizeof(*sdfNormal));
+    for (long int g=0; g<nNodes; g++) {
+        double norm = 0;
+        for (int d=1; d<4; d++) {
+            int coord = (int)((g/sizeProd[d])%size[d]);
+            long int lo = coord>0 ? g-sizeProd[d] : g;
+            long int hi = coord<size[d]-1 ? g+sizeProd[d] : g;
+            double grad = (hi==lo) ? 0 : (sdf[hi]-sdf[lo])/((hi-lo)/sizeProd[d]);
+            sdfNormal[3*g+d-1] = grad;
+            norm += grad*grad;
         }
+        norm = sqrt(norm);
+        if (norm>0) for (int d=0; d<3; d++) sdfNormal[3*g+d] /= norm;
     }
+
+    free(distOut);
+    free(distIn);
+    obj->sdf = sdf;
+    obj->sdfNormal = sdfNormal;
 }
 
-//Moves a particle according to the type of collision, also creates and removes new particles
-void oParticleCollision(Population *pop, Object *obj, long int i){
+// Trilinear interpolation of nValues values per node at pos. Points outside
+// the nodes (ghosts included), such as the end point of a particle leaving
+// the subdomain, are moved to the nearest point inside.
+static void oInterpolate(const Object *obj, const double *field, int nValues,
+                         const double *pos, double *result) {
 
-    void (*collisionType)(Population *);
+    int *size = obj->domain->size;
+    long int *sizeProd = obj->domain->sizeProd;
 
-    pFindCollisionType(pop, obj, i, collisionType);
+    int cell[3];
+    double frac[3];
+    for (int d=0; d<3; d++) {
+        double coord = pos[d];
+        if (coord<0) coord = 0;
+        if (coord>size[d+1]-1) coord = size[d+1]-1;
+        cell[d] = (int) coord;
+        if (cell[d]>size[d+1]-2) cell[d] = size[d+1]-2;
+        frac[d] = coord-cell[d];
+    }
+    double x = frac[0];
+    double y = frac[1];
+    double z = frac[2];
+
+    long int p = cell[0] + cell[1]*sizeProd[2] + cell[2]*sizeProd[3];
+
+    for (int v=0; v<nValues; v++) result[v] = 0;
+    for (int c=0; c<8; c++) {
+        int dj = c&1, dk = (c>>1)&1, dl = (c>>2)&1;
+        double weight = (dj ? x : 1-x) * (dk ? y : 1-y) * (dl ? z : 1-z);
+        long int q = p + dj + dk*sizeProd[2] + dl*sizeProd[3];
+        for (int v=0; v<nValues; v++) result[v] += weight*field[nValues*q+v];
+    }
+}
 
-    collisionType();
+// Signed distance to the object surfaces at pos.
+static double oLevelSet(const Object *obj, const double *pos) {
+
+    double value;
+    oInterpolate(obj, obj->sdf, 1, pos, &value);
+    return value;
 }
 
+// Find the cells a particle can reach an object from in one time step.
+static void oFindNarrowBand(Object *obj) {
+
+    Grid *domain = obj->domain;
+    long int *sizeProd = domain->sizeProd;
+    int *size = domain->size;
+    long int nNodes = sizeProd[domain->rank];
+
+    // A particle in cell p ends within one cell of it (the Courant number
+    // is less than one), and the level-set in a cell depends on its 8
+    // corners. Hence cell p is near an object if there is an object node
+    // p+o with -1 <= o <= 2 along each dimension.
+    bool *narrowBand = malloc(nNodes*sizeof(*narrowBand));
+    bool *work = malloc(nNodes*sizeof(*work));
+    for (long int g=0; g<nNodes; g++) narrowBand[g] = domain->val[g]>0.5;
+
+    for (int d=1; d<domain->rank; d++) {
+        bool *in = narrowBand;
+        narrowBand = work;
+        work = in;
+        for (long int g=0; g<nNodes; g++) {
+            int coord = (int)((g/sizeProd[d])%size[d]);
+            bool near = false;
+            for (int o=-1; o<=2 && !near; o++) {
+                if (coord+o>=0 && coord+o<size[d]) near = in[g+o*sizeProd[d]];
+            }
+            narrowBand[g] = near;
+        }
+    }
 
-//Finds nearest 3 object surface nodes to a specific particle of index p
-//3 object surface nodes needed to compute normal from cross product of surface vectors
-double *oFindNearestSurfaceNodes(Population *pop, long int particleId, Object *obj){
+    free(work);
+    obj->narrowBand = narrowBand;
+}
 
-    double *pos = NULL;
-    for(int i=0; i<3; i++){
-        pos[i] = pop->pos[3*particleId + i];
+//determines if particle will collide
+bool oParticleIntersection(Population *pop, long int particleId, Object *obj, double *intersection){
+
+    int nDims = pop->nDims;
+    double *pos = &pop->pos[nDims*particleId];
+    double *vel = &pop->vel[nDims*particleId];
+
+    double end[3];
+    for (int d=0; d<3; d++) end[d] = pos[d]+vel[d];
+    if (oLevelSet(obj, pos)<0 || oLevelSet(obj, end)>=0) return false;
+
+    // The distance is close to linear along the path, so a couple of
+    // regula falsi steps find where it crosses the surface.
+    double tOut = 0, tIn = 1;
+    double fOut = oLevelSet(obj, pos), fIn = oLevelSet(obj, end);
+    double t = 1;
+    for (int it=0; it<3; it++) {
+        t = tOut + (tIn-tOut)*fOut/(fOut-fIn);
+        double mid[3];
+        for (int d=0; d<3; d++) mid[d] = pos[d]+t*vel[d];
+        double f = oLevelSet(obj, mid);
+        if (f<0) {
+            tIn = t;
+            fIn = f;
+        } else {
+            tOut = t;
+            fOut = f;
+        }
     }
+    for (int d=0; d<3; d++) intersection[d] = pos[d]+t*vel[d];
 
-    
-    return pos;
+    return true;
+}
+
+//stores index of particles that are close to an object at the current timestep
+void oVicinityParticles(Population *pop, Object *obj){
+
+    int nSpecies = pop->nSpecies;
+    int nDims = pop->nDims;
+    long int *sizeProd = obj->domain->sizeProd;
+    bool *narrowBand = obj->narrowBand;
+    long int counter = 0;
+
+    for(int s=0; s < nSpecies; s++) {
+
+        long int iStart = pop->iStart[s];
+        long int iStop = pop->iStop[s];
+
+        for(long int i=iStart;i<iStop;i++){
 
+            double *pos = &pop->pos[nDims*i];
+
+            // Integer parts of position
+            int j = (int) pos[0];
+            int k = (int) pos[1];
+            int l = (int) pos[2];
+
+            long int p = j + k*sizeProd[2] + l*sizeProd[3];
+
+            if (narrowBand[p]) {
+                pop->objVicinity[counter] = i;
+                counter++;
+            }
+        }
+    }
+
+    pop->nVicinity = counter;
 }
 
-//pos_new = pos_old + vel*delta_t
-//try http://geomalgorithms.com/a05-_intersect-1.html algorithm
-//implementation based on https://rosettacode.org/wiki/Find_the_intersection_of_a_line_with_a_plane#C
-void oFindIntersectPoint(const Population *pop, long int id, double *surfNormal, 
-     double *surfPoint, double *intersect){ 
+//Relies on a courant number < 1 (otherwise particle might be inside object)
+//checks which particles in object vicinity will collide => overwrites pop->collisions
+void oFindParticleCollisions(Population *pop, Object *obj){
+
+    int nDims = pop->nDims;
+    long int counter = 0;
+
+    oVicinityParticles(pop, obj);
 
-        double epsilon = 1e-6;
-        double *pos = &pop->pos[3*id];
-        double *vel = &pop->vel[3*id];
-        double *w = NULL;
-        double *Psi = vel;
-        int ndotu = adDotProd(vel,surfNormal,3);
+    for(long int n=0; n<pop->nVicinity; n++){
 
-        if(ndotu < epsilon){
-            msg(ERROR, "Particle %i, will not collide with any object next timestep!", id);
+        long int i = pop->objVicinity[n];
+        if (oParticleIntersection(pop, i, obj, &pop->intersections[nDims*counter])) {
+            pop->collisions[counter] = i;
+            counter++;
         }
-        adSub(pos, surfPoint, w, 3);
+    }
+
+    pop->nCollisions = counter;
+}
 
-        //Compute intersection
-        double si = -1.*(double) adDotProd(surfNormal,w,3) / (double) ndotu;
-        adScale(Psi,3,si);
-        adAdd(w,Psi,Psi,3);
-        adAdd(surfPoint,Psi,Psi,3);
+//Moves a particle according to the type of collision. Only absorption is
+//implemented so far: the particle moves on into the object, where
+//oCollectObjectCharge() collects it.
+void oParticleCollision(Population *pop, Object *obj, long int i){
 
-        intersect[0]=Psi[0], intersect[1]=Psi[1], intersect[1]=Psi[1];
+    int nDims = pop->nDims;
+    for(int d=0; d<nDims; d++) pop->pos[nDims*i+d] += pop->vel[nDims*i+d];
 }
 
-void oParticleCollision(Population *pop, Object *obj, long int n){
+// Outward normal of the object surface near pos.
+void oSurfaceNormal(const Object *obj, const double *pos, double *normal){
 
-    msg(WARNING, "Collision types not yet implemented!");
+    oInterpolate(obj, obj->sdfNormal, 3, pos, normal);
+
+    double norm = sqrt(normal[0]*normal[0]+normal[1]*normal[1]+normal[2]*normal[2]);
+    if (norm>0) for (int d=0; d<3; d++) normal[d] /= norm;
 }
 
 /*****************************************************************************
@@ -694,6 +1886,20 @@ Object *oAlloc(const dictionary *ini){
     obj->capMatrixAll = capMatrixAll;
     obj->capMatrixAllOffsets =capMatrixAllOffsets;
     obj->capMatrixSum = capMatrixSum;
+    obj->capRowSum = NULL;
+    obj->capGatherIndex = NULL;
+    obj->capPhiAll = NULL;
+    obj->capDeltaPhi = NULL;
+    obj->capWork = NULL;
+    obj->capRecvCounts = NULL;
+    obj->capDispls = NULL;
+    obj->capBlocks = NULL;
+    obj->capBlocksOffset = NULL;
+    obj->nodeObject = NULL;
+    obj->narrowBand = NULL;
+    obj->boundingBox = NULL;
+    obj->sdf = NULL;
+    obj->sdfNormal = NULL;
     
     return obj;
 }
@@ -704,11 +1910,31 @@ void oFree(Object *obj){
     
     free(obj->lookupInterior);
     free(obj->lookupInteriorOffset);
+    free(obj->nodeObject);
+    free(obj->narrowBand);
+    free(obj->boundingBox);
+    free(obj->sdf);
+    free(obj->sdfNormal);
     free(obj->lookupSurface);
     free(obj->lookupSurfaceOffset);
     free(obj->capMatrixAll);
     free(obj->capMatrixAllOffsets);
     free(obj->capMatrixSum);
+    free(obj->capRowSum);
+    free(obj->capGatherIndex);
+    free(obj->capPhiAll);
+    free(obj->capDeltaPhi);
+    free(obj->capWork);
+    free(obj->capRecvCounts);
+    free(obj->capDispls);
+    if (obj->capBlocks!=NULL) {
+        for (long int l=0; l<obj->capBlocksOffset[obj->nObjects]; l++) {
+            free(obj->capBlocks[l].u);
+            free(obj->capBlocks[l].v);
+        }
+    }
+    free(obj->capBlocks);
+    free(obj->capBlocksOffset);
     free(obj);
     
 }
@@ -725,7 +1951,10 @@ void oOpenH5(const dictionary *ini, Object *obj, const MpiInfo *mpiInfo,
 }
 
 void oReadH5(Object *obj, const MpiInfo *mpiInfo){
-    
+
+    // The level-set and collision functions are written for 3D
+    if (mpiInfo->nDims!=3) msg(ERROR, "Objects are only supported in 3D (use objects:method = none)");
+
     // Identical to gReadH5()
     hid_t fileSpace = obj->domain->h5FileSpace;
     hid_t memSpace = obj->domain->h5MemSpace;
@@ -753,6 +1982,11 @@ void oReadH5(Object *obj, const MpiInfo *mpiInfo){
     
     // Find all the object nodes which are part of the object surface.
     oFindObjectSurfaceNodes(obj, mpiInfo);
+
+    // Find the cells where particles may hit an object, and the distance to
+    // the objects for finding where.
+    oFindNarrowBand(obj);
+    oComputeDistanceField(obj);
 }
 
 
@@ -8,6 +8,22 @@
 #ifndef OBJECT_H
 #define OBJECT_H
 
+/**
+ * @brief Block of a compressed capacitance matrix
+ *
+ * The block is either dense (rank -1, u holding the m x n block) or of low
+ * rank, approximated by u (m x rank) times v (rank x n). All row-major.
+ */
+typedef struct{
+	long int row;					///< First row (surface node of the object)
+	long int col;					///< First column
+	long int m;						///< Number of rows
+	long int n;						///< Number of columns
+	long int rank;					///< Rank, or -1 if dense
+	double *u;						///< Left factor, or the dense block
+	double *v;						///< Right factor
+} CapBlock;
+
 /**
  * @brief Represents an object
  */
@@ -15,11 +31,25 @@ typedef struct{
 	Grid *domain;					///< Represents presence of objects
 	long int *lookupInterior;		///< Indices of the interior of the objects
 	long int *lookupInteriorOffset;	///< Offset in the above per object (nObjects+1 elements)
+	int *nodeObject;				///< Object each node is in the interior of (0-based), or -1
+	int *boundingBox;				///< Lowest and highest node (j,k,l) of each object, ghosts included (6 per object)
+	bool *narrowBand;				///< Cells from which particles may hit an object in one step
+	double *sdf;					///< Signed distance to the object surfaces (negative inside)
+	double *sdfNormal;				///< Gradient of sdf, i.e. the outward normal (3 per node)
   long int *lookupSurface;        ///< Indices of the surface nodes of the objects
   long int *lookupSurfaceOffset;  ///< Offset in the above per object (nObjects+1 elements)
-  double *capMatrixAll;              ///< Array holding the capacitance matrices for each object
+  double *capMatrixAll;              ///< Rows of the capacitance matrices for the surface nodes of this core
   long int *capMatrixAllOffsets;         ///< Array holding the total sum of capMatrix elements (nObjects elements)
   double *capMatrixSum;    ///< total sum of elements in the capacitance matrix
+  double *capRowSum;              ///< Row sums of the capacitance matrices
+  long int *capGatherIndex;       ///< Position of each surface node in capPhiAll
+  double *capPhiAll;              ///< Gathered surface potentials of all objects
+  double *capDeltaPhi;            ///< Work array for the potential differences
+  double *capWork;                ///< Work array for the local surface nodes
+  int *capRecvCounts;             ///< Surface nodes per core (all objects)
+  int *capDispls;                 ///< Offset of each core in capPhiAll
+  CapBlock *capBlocks;            ///< Compressed rows of the capacitance matrices (replaces capMatrixAll)
+  long int *capBlocksOffset;      ///< Offset in the above per object (nObjects+1 elements)
 	int nObjects;					///< Number of objects
 } Object;
 
@@ -71,7 +101,12 @@ void oCloseH5(Object *obj);
  * @return	void
  * @see gReadH5()
  *
- * Reads the input objects and creates the various lookup tables needed.
+ * Reads the input objects and creates the various lookup tables needed. It
+ * also computes the signed distance to the objects and its gradient on every
+ * node (including ghosts), using an exact Euclidean distance transform. Only
+ * objects within the subdomain and its ghost layers are seen, which is all
+ * collisions need. Objects are only supported in 3D, and other dimensions
+ * give an error.
  */
 void oReadH5(Object *obj, const MpiInfo *mpiInfo);
 
@@ -81,7 +116,27 @@ void oReadH5(Object *obj, const MpiInfo *mpiInfo);
  * @param	ini		input settings
  * @return	void
  *
- * Compute the capacitance matrix.
+ * Compute the capacitance matrix. The unit-charge solves for objects:capBatchSize
+ * surface nodes are done together with mgSolveBatch(), and each core keeps
+ * the rows of its own surface nodes. The matrices are then inverted with a
+ * blocked Cholesky factorization, with the objects spread over the cores.
+ *
+ * If objects:capCache is a file name rather than "none", the matrices are
+ * loaded from it when it was written for the same object domain, grid,
+ * decomposition and multigrid settings (compared by a hash). Otherwise they
+ * are computed and stored there.
+ *
+ * Each core only keeps the rows of its own surface nodes. If
+ * objects:capCompression is larger than zero, no matrix is ever held whole.
+ * The rows of the potential matrix (the inverse) are instead compressed a
+ * stripe of objects:capBlockSize columns at a time as they are solved for, in
+ * blocks of objects:capBlockSize rows. Blocks off the diagonal are compressed
+ * to low rank by adaptive cross approximation with that relative tolerance.
+ * The capacitance matrix is then found objects:capBatchSize columns at a time
+ * by conjugate gradient solves on the compressed potential matrix, and
+ * compressed the same way. It is an error if a solve does not converge.
+ *
+ * NB! Needs the 3D secondOrder multigrid stencil.
  */
 void oComputeCapacitanceMatrix(Object *obj, const dictionary *ini,
                                const MpiInfo *mpiInfo);
@@ -95,10 +150,30 @@ void oComputeCapacitanceMatrix(Object *obj, const dictionary *ini,
  * @return	void
  *
  * Construct and solve equation 5 in Miyake_Usui_PoP_2009.
+ *
+ * The surface potentials of all objects are gathered with a single
+ * collective, after which each core applies the rows of the capacitance
+ * matrix belonging to its own surface nodes (BLAS dgemv), block by block if
+ * they are compressed.
  */
 void oApplyCapacitanceMatrix(Grid *rho, const Grid *phi, const Object *obj,
                              const MpiInfo *mpiInfo);
 
+/**
+ * @brief	Fill a grid with the conductor of each object
+ * @param	conductor	Grid (SCALAR)
+ * @param	obj         Object
+ * @param	mpiInfo		MpiInfo
+ * @return	void
+ *
+ * Sets the nodes of object a, and the surface nodes found for it by
+ * oFindObjectSurfaceNodes(), to a+1 and all other nodes to 0. These are the
+ * nodes oCollectObjectCharge() puts the object charge on, and the nodes the
+ * capacitance matrix makes equipotential, so this is the domain to pass to
+ * mgSetObjects(). The halo is exchanged.
+ */
+void oFillConductor(Grid *conductor, const Object *obj, const MpiInfo *mpiInfo);
+
 /**
  * @brief	Collect the charge inside each object
  * @param   pop         Population
@@ -107,7 +182,9 @@ void oApplyCapacitanceMatrix(Grid *rho, const Grid *phi, const Object *obj,
  * @param	mpiInfo		MpiInfo
  * @return	void
  *
- * Collect the charge inside each object.
+ * Collect the charge inside each object. Particles inside an object are
+ * removed from the population. Uses Object::nodeObject, so the cost is
+ * one lookup per particle.
  */
 void oCollectObjectCharge(Population *pop, Grid *rhoObj, Object *obj,
                           const MpiInfo *mpiInfo);
@@ -118,33 +195,66 @@ void oCollectObjectCharge(Population *pop, Grid *rhoObj, Object *obj,
  */
 
 
-/*
-Finding particles in population close to object, discards
-particles that will not intersect object next timestep
-pop->vicinity contains index of particles that are close
-to the object
-*/
+/**
+ * @brief	Find the particles close to objects
+ * @param	pop		Population
+ * @param	obj		Object
+ * @return	void
+ *
+ * Stores the indices of the particles in cells of Object::narrowBand in
+ * pop->objVicinity, and their number in pop->nVicinity. Costs one lookup per
+ * particle.
+ */
 void oVicinityParticles(Population *pop, Object *obj);
 
-//determines if particle will collide
-bool oParticleIntersection(Population *pop, long int particleId, Object *obj);
+/**
+ * @brief	Determines if a particle will hit an object during the next move
+ * @param	pop				Population
+ * @param	particleId		Index of the particle
+ * @param	obj				Object
+ * @param[out]	intersection	Point where it crosses the object surface
+ * @return	true if the particle will hit an object
+ *
+ * The surface is the zero of Object::sdf, interpolated trilinearly. The
+ * crossing point is found by a few regula falsi steps along the path.
+ */
+bool oParticleIntersection(Population *pop, long int particleId, Object *obj,
+                           double *intersection);
 
-//"collides" a single particle based on collision type
+/**
+ * @brief	"Collides" a single particle based on collision type
+ * @param	pop		Population
+ * @param	obj		Object
+ * @param	n		Index of the particle
+ * @return	void
+ *
+ * Only absorption is implemented so far; the particle is moved as usual and
+ * collected by oCollectObjectCharge().
+ */
 void oParticleCollision(Population *pop, Object *obj, long int n);
 
-//determines collision type, then moves particle accordingly 
+/**
+ * @brief	Find the particles that will hit an object during the next move
+ * @param	pop		Population
+ * @param	obj		Object
+ * @return	void
+ *
+ * Only the particles found by oVicinityParticles() are tested. The indices
+ * of colliding particles are stored in increasing order in pop->collisions,
+ * their number in pop->nCollisions and where they hit in pop->intersections.
+ * Relies on a Courant number less than one.
+ */
 void oFindParticleCollisions(Population *pop, Object *obj);
 
 /**
- * @brief	Computes the local point a nearby particle with collide with an object
- * @param   pos         Position (population->)
- * @param   rhoObj      Grid
- * @param	obj         Object
- * @param	mpiInfo		MpiInfo
+ * @brief	Outward normal of the object surface near a point
+ * @param	obj			Object
+ * @param	pos			Position (local frame)
+ * @param[out]	normal	Unit normal (3 elements)
  * @return	void
  *
- * Computes the local point a nearby particle with collide with an object
+ * Trilinear interpolation of Object::sdfNormal, computed once by oReadH5().
  */
-void oFindIntersectPoint(const Population *pop, long int id, double *surfNormal, 
-                        double *surfPoint, double *intersection);
+void oSurfaceNormal(const Object *obj, const double *pos, double *normal);
+
 #endif // OBJECT_H
\ No newline at end of file
@@ -11,12 +11,14 @@
 
 #include "core.h"
 #include <math.h>
+#include <stdint.h>
 #include <mpi.h>
 #include <gsl/gsl_rng.h>
 #include <gsl/gsl_randist.h>
 #include <hdf5.h>
 #include "iniparser.h"
 
+#define PARTICLE_CHUNK 65536	// Max particles per chunk in .pop.h5-files
 
 /******************************************************************************
  * DECLARING LOCAL FUNCTIONS
@@ -79,6 +81,9 @@ Population *pAlloc(const dictionary *ini){
 	pop->iStop = iStop;
 	pop->objVicinity = malloc(iStart[nSpecies]*sizeof(long int));
 	pop->collisions = malloc(iStart[nSpecies]*sizeof(long int)); //malloc(sizeof pop->collisions)
+	pop->intersections = malloc((long int)nDims*iStart[nSpecies]*sizeof(double));
+	pop->nVicinity = 0;
+	pop->nCollisions = 0;
 	pop->kinEnergy = malloc((nSpecies+1)*sizeof(double));
 	pop->potEnergy = malloc((nSpecies+1)*sizeof(double));
 	pop->charge = iniGetDoubleArr(ini,"population:charge",nSpecies);
@@ -101,13 +106,95 @@ void pFree(Population *pop){
 	free(pop->iStop);
 	free(pop->objVicinity);
 	free(pop->collisions);
+	free(pop->intersections);
 	free(pop->charge);
 	free(pop->mass);
 	free(pop);
 
 }
 
-void pPosUniform(const dictionary *ini, Population *pop, const MpiInfo *mpiInfo, const gsl_rng *rng){
+typedef struct{
+	int nDims;
+	int nSpecies;
+	int s;						// Specie
+	uint64_t seed;				// Seed of the positions within cells
+	uint64_t splitSeed;			// Seed of the splits
+	const int *L;				// Global size
+	const int *lower;			// Subdomain extent in global frame
+	const int *upper;
+	const int *offset;			// Offset of local reference frame
+	long int iStart;			// Memory allocated to the specie
+	long int iMax;
+} UniformTree;
+
+/*
+ * Appends the n particles in the box [lo,hi) of global cells that are in the
+ * subdomain. The box is halved along its longest dimension, and the number of
+ * particles in the lower half is binomially distributed with the fraction of
+ * the volume as probability. Its stream is the key of the box, where the
+ * domain has key 1 and the halves of box k have keys 2k and 2k+1. Boxes
+ * outside the subdomain are skipped, so only the splits above its own cells
+ * are drawn on each MPI node. The particles of a cell are uniformly
+ * distributed within it.
+ */
+static void pUniformSplit(const UniformTree *tree, uint64_t key, const int *lo, const int *hi,
+						  long int n, double **pos, long int *iStop){
+
+	int nDims = tree->nDims;
+	int nSpecies = tree->nSpecies;
+	int s = tree->s;
+
+	if(n==0) return;
+	for(int d=0;d<nDims;d++){
+		if(hi[d]<=tree->lower[d] || lo[d]>=tree->upper[d]) return;
+	}
+
+	int dSplit = 0;
+	for(int d=1;d<nDims;d++){
+		if(hi[d]-lo[d]>hi[dSplit]-lo[dSplit]) dSplit = d;
+	}
+	int width = hi[dSplit]-lo[dSplit];
+
+	if(width==1){
+
+		// Global index of the cell
+		long int g = 0;
+		long int gProd = 1;
+		for(int d=0;d<nDims;d++){
+			g += lo[d]*gProd;
+			gProd *= tree->L[d];
+		}
+
+		if(*iStop+n>tree->iMax){
+			msg(ERROR,	"allocated only %li particles of specie %i per node",
+						tree->iMax-tree->iStart, s);
+		}
+
+		// The particles only depend on the seed, specie and global cell,
+		// not on how the domain is decomposed
+		uint64_t stream = (uint64_t)g*nSpecies+s;
+		rUniform(tree->seed,stream,0,*pos,n*nDims);
+		for(long int k=0;k<n;k++){
+			for(int d=0;d<nDims;d++) (*pos)[d] += lo[d]-tree->offset[d];
+			*pos += nDims;
+			(*iStop)++;
+		}
+		return;
+	}
+
+	int mid = lo[dSplit]+width/2;
+	double p = (double)(mid-lo[dSplit])/width;
+	long int nLower = rBinomial(tree->splitSeed,key*nSpecies+s,p,n);
+
+	int bound[nDims];
+	for(int d=0;d<nDims;d++) bound[d] = d==dSplit ? mid : hi[d];
+	pUniformSplit(tree,2*key,lo,bound,nLower,pos,iStop);
+
+	for(int d=0;d<nDims;d++) bound[d] = d==dSplit ? mid : lo[d];
+	pUniformSplit(tree,2*key+1,bound,hi,n-nLower,pos,iStop);
+}
+
+void pPosUniform(const dictionary *ini, Population *pop, const MpiInfo *mpiInfo, const gsl_rng *rngSync){
 
 	// Read from ini
 	int nSpecies = pop->nSpecies;
@@ -117,11 +204,25 @@ void pPosUniform(const dictionary *ini, Population *pop, const MpiInfo *mpiInfo,
 
 	// Read from mpiInfo
 	int *subdomain = mpiInfo->subdomain;
-	double *posToSubdomain = mpiInfo->posToSubdomain;
+	int *offset = mpiInfo->offset;
 
 	// Compute normalized length of global reference frame
 	int *L = gGetGlobalSize(ini);
 
+	// Subdomain extent in global frame, and the whole domain
+	int *lower = malloc(nDims*sizeof(*lower));
+	int *upper = malloc(nDims*sizeof(*upper));
+	int *zero = malloc(nDims*sizeof(*zero));
+	for(int d=0;d<nDims;d++){
+		lower[d] = subdomain[d]*trueSize[d];
+		upper[d] = lower[d]+trueSize[d];
+		zero[d] = 0;
+	}
+
+	// Same seeds on all MPI nodes
+	uint64_t seed = gsl_rng_get(rngSync);
+	uint64_t splitSeed = gsl_rng_get(rngSync);
+
 	for(int s=0;s<nSpecies;s++){
 
 		// Start on first particle of this specie
@@ -129,44 +230,94 @@ void pPosUniform(const dictionary *ini, Population *pop, const MpiInfo *mpiInfo,
 		long int iStop = iStart;
 		double *pos = &pop->pos[iStart*nDims];
 
-		// Iterate through all particles to be generated. Same seed on all MPI
-		// nodes ensure same particles are generated everywhere.
-		for(long int i=0;i<nParticles[s];i++){
+		UniformTree tree = {nDims, nSpecies, s, seed, splitSeed, L, lower,
+							upper, offset, iStart, pop->iStart[s+1]};
+		pUniformSplit(&tree,1,zero,L,nParticles[s],&pos,&iStop);
 
-			// Generate position for particle i
-			for(int d=0;d<nDims;d++) pos[d] = L[d]*gsl_rng_uniform_pos(rng);
+		pop->iStop[s]=iStop;
 
-			// Count the number of dimensions where the particle resides in
-			// the range of this node
-			int correctRange = 0;
-			for(int d=0;d<nDims;d++)
-				correctRange += (subdomain[d] == (int)(posToSubdomain[d]*pos[d]));
+	}
 
-			// Iterate only if particle resides in this sub-domain.
-			if(correctRange==nDims){
-				pos += nDims;
-				iStop++;
-			}
+	free(lower);
+	free(upper);
+	free(zero);
+	free(L);
+	free(nParticles);
+	free(trueSize);
 
-		}
+}
 
-		if(iStop>pop->iStart[s+1]){
-			int allocated = pop->iStart[s+1]-iStart;
-			int generated = iStop-iStart;
-			msg(ERROR,	"allocated only %i particles of specie %i per node but"
-			 			"%i generated", allocated, s, generated);
-		}
+typedef struct{
+	int nDims;
+	double l;					// Particle-particle distance in lattice
+	const int *L;				// Global size
+	const double *LProd;		// Product of L in the dimensions below
+	const int *lower;			// Subdomain extent in global frame
+	const int *upper;
+	const int *nSubdomains;
+} Lattice;
+
+/*
+ * Appends the lattice particles with index in [a,b) which are in the
+ * subdomain. Along dimension d, particle i is at l*i/LProd[d] modulo L[d],
+ * so the indices of particles within the subdomain along d form one interval
+ * for each wrap-around. These are narrowed down from the highest dimension to
+ * the lowest, with a small margin to account for round-off, and the exact
+ * test of pPosLattice() is applied at the end.
+ */
+static void pLatticeInterval(const Lattice *lat, int d, long int a, long int b,
+							 const MpiInfo *mpiInfo, double **pos, long int *iStop){
 
-		pop->iStop[s]=iStop;
+	int nDims = lat->nDims;
+	double l = lat->l;
+	const int *L = lat->L;
 
-	}
+	if(d<0){
 
-	pToLocalFrame(pop,mpiInfo);
+		int *subdomain = mpiInfo->subdomain;
+		double *posToSubdomain = mpiInfo->posToSubdomain;
 
-	free(L);
-	free(nParticles);
-	free(trueSize);
+		for(long int i=a;i<b;i++){
+
+			double linearPos = l*i;
+			for(int dd=0;dd<nDims;dd++){
+				(*pos)[dd] = fmod(linearPos,L[dd]);
+				linearPos /= L[dd];
+			}
+
+			int correctRange = 0;
+			for(int dd=0;dd<nDims;dd++)
+				correctRange += (subdomain[dd] == (int)(posToSubdomain[dd]*(*pos)[dd]));
+
+			if(correctRange==nDims){
+				*pos += nDims;
+				(*iStop)++;
+			}
+		}
+		return;
+	}
+
+	if(lat->nSubdomains[d]==1){
+		pLatticeInterval(lat,d-1,a,b,mpiInfo,pos,iStop);
+		return;
+	}
 
+	const long int margin = 2;
+	double P = lat->LProd[d];
+	long int kFirst = (long int)floor(l*a/P/L[d]);
+	long int kLast = (long int)floor(l*(b-1)/P/L[d]);
+	long int prevEnd = a;
+
+	for(long int k=kFirst;k<=kLast;k++){
+		long int start = (long int)ceil((k*L[d]+lat->lower[d])*P/l) - margin;
+		long int end = (long int)ceil((k*L[d]+lat->upper[d])*P/l) + margin;
+		if(start<prevEnd) start = prevEnd;
+		if(end>b) end = b;
+		if(start<end){
+			pLatticeInterval(lat,d-1,start,end,mpiInfo,pos,iStop);
+			prevEnd = end;
+		}
+	}
 }
 
 void pPosLattice(const dictionary *ini, Population *pop, const MpiInfo *mpiInfo){
@@ -177,48 +328,44 @@ void pPosLattice(const dictionary *ini, Population *pop, const MpiInfo *mpiInfo)
 	long int *nParticles = iniGetLongIntArr(ini,"population:nParticles",nSpecies);
 	int *trueSize = iniGetIntArr(ini,"grid:trueSize",nDims);
 
-	// Read from mpiInfo
-	int *subdomain = mpiInfo->subdomain;
-	double *posToSubdomain = mpiInfo->posToSubdomain;
-
 	// Compute normalized length of global reference frame
 	int *L = gGetGlobalSize(ini);
 	long int V = gGetGlobalVolume(ini);
 
+	// Extent of the subdomain in the global reference frame
+	double *LProd = malloc(nDims*sizeof(*LProd));
+	int *lower = malloc(nDims*sizeof(*lower));
+	int *upper = malloc(nDims*sizeof(*upper));
+	LProd[0] = 1;
+	for(int d=1;d<nDims;d++) LProd[d] = LProd[d-1]*L[d-1];
+	for(int d=0;d<nDims;d++){
+		lower[d] = mpiInfo->subdomain[d]*trueSize[d];
+		upper[d] = lower[d]+trueSize[d];
+	}
+
+	Lattice lat = {
+		.nDims = nDims,
+		.L = L,
+		.LProd = LProd,
+		.lower = lower,
+		.upper = upper,
+		.nSubdomains = mpiInfo->nSubdomains,
+	};
+
 	for(int s=0;s<nSpecies;s++){
 
 		// Particle-particle distance in lattice
-		double l = pow(V/(double)nParticles[s],1.0/nDims);
+		lat.l = pow(V/(double)nParticles[s],1.0/nDims);
 
 		// Start on first particle of this specie
 		long int iStart = pop->iStart[s];
 		long int iStop = iStart;
 		double *pos = &pop->pos[iStart*nDims];
 
-		// Iterate through all particles to be generated
-		// Generate particles on global frame on all nodes and discard the ones
-		// out of range. This is simpler as it resembles pPosUniform()
-		for(long int i=0;i<nParticles[s];i++){
-
-			double linearPos = l*i;
-			for(int d=0;d<nDims;d++){
-				pos[d] = fmod(linearPos,L[d]);
-				linearPos /= L[d];
-			}
-
-			// Count the number of dimensions where the particle resides in
-			// the range of this node
-			int correctRange = 0;
-			for(int d=0;d<nDims;d++)
-				correctRange += (subdomain[d] == (int)(posToSubdomain[d]*pos[d]));
-
-			// Iterate only if particle resides in this sub-domain.
-			if(correctRange==nDims){
-				pos += nDims;
-				iStop++;
-			}
-
-		}
+		// Only visits the particles in range of this node, but generates the
+		// same lattice as if all were generated and the others discarded.
+		if(nParticles[s]>0)
+			pLatticeInterval(&lat,nDims-1,0,nParticles[s],mpiInfo,&pos,&iStop);
 
 		if(iStop>pop->iStart[s+1]){
 			int allocated = pop->iStart[s+1]-iStart;
@@ -233,6 +380,9 @@ void pPosLattice(const dictionary *ini, Population *pop, const MpiInfo *mpiInfo)
 
 	pToLocalFrame(pop,mpiInfo);
 
+	free(upper);
+	free(lower);
+	free(LProd);
 	free(L);
 	free(nParticles);
 	free(trueSize);
@@ -364,28 +514,31 @@ void pVelAssertMax(const Population *pop, double max){
 	}
 }
 
-void pVelMaxwell(const dictionary *ini, Population *pop, const gsl_rng *rng){
+void pVelMaxwell(const dictionary *ini, Population *pop, const MpiInfo *mpiInfo, const gsl_rng *rngSync){
 
 	int nSpecies = pop->nSpecies;
 	double *velDrift = iniGetDoubleArr(ini,"population:drift",nSpecies);
 	double *velThermal = iniGetDoubleArr(ini,"population:thermalVelocity",nSpecies);
 
 	int nDims = pop->nDims;
+	int mpiRank = mpiInfo->mpiRank;
+
+	uint64_t seed = gsl_rng_get(rngSync);
 
 	for(int s=0;s<nSpecies;s++){
 
 		long int iStart = pop->iStart[s];
 		long int iStop = pop->iStop[s];
+		long int n = (iStop-iStart)*nDims;
 
-		double velTh = velThermal[s];
+		// Same seed everywhere, but one stream per MPI node and specie
+		uint64_t stream = (uint64_t)mpiRank*nSpecies+s;
 
-		for(long int i=iStart;i<iStop;i++){
+		double *vel = &pop->vel[iStart*nDims];
+		rGaussian(seed,stream,0,vel,n);
 
-			double *vel = &pop->vel[i*nDims];
-			for(int d=0;d<nDims;d++){
-				vel[d] = velDrift[s] + gsl_ran_gaussian_ziggurat(rng,velTh);
-			}
-		}
+		double velTh = velThermal[s];
+		for(long int i=0;i<n;i++) vel[i] = velDrift[s] + velTh*vel[i];
 	}
 	free(velDrift);
 	free(velThermal);
@@ -526,6 +679,19 @@ void pOpenH5(	const dictionary *ini, Population *pop, const Units *units,
 
 	pop->h5 = file;
 
+	int interval, decimation;
+	getH5Output(ini, fName, &interval, &decimation);
+
+	char *sampling = iniGetStr(ini, "files:particleSampling");
+	if(strcmp(sampling, "stride") && strcmp(sampling, "random"))
+		msg(ERROR, "files:particleSampling = %s is not a valid option", sampling);
+
+	pop->h5Interval = interval;
+	pop->h5Decimation = decimation;
+	pop->h5Random = !strcmp(sampling, "random");
+	pop->h5Type = getH5Compression(ini, fName, &pop->h5Deflate);
+	free(sampling);
+
 	/*
 	 * CREATE ATTRIBUTES
 	 */
@@ -535,24 +701,149 @@ void pOpenH5(	const dictionary *ini, Population *pop, const Units *units,
 
 }
 
+// Scrambles a 64-bit key (the splitmix64 finalizer)
+static inline uint64_t pHash(uint64_t key){
+	key = (key ^ (key>>30))*0xBF58476D1CE4E5B9ULL;
+	key = (key ^ (key>>27))*0x94D049BB133111EBULL;
+	return key ^ (key>>31);
+}
+
+/*
+ * Picks out the particles of specie s to be written, and packs them in pos and
+ * vel. Returns the number of picked particles. Random picks are made by
+ * hashing the time step, rank and index, so no generator state is needed.
+ */
+static long int pPickParticles(const Population *pop, int s, long int n,
+								int mpiRank, double *pos, double *vel){
+
+	int nDims = pop->nDims;
+	int decimation = pop->h5Decimation;
+	long int nPicked = 0;
+
+	for(long int i=pop->iStart[s];i<pop->iStop[s];i++){
+
+		bool pick;
+		if(pop->h5Random){
+			uint64_t key = pHash((uint64_t)n*0x9E3779B97F4A7C15ULL
+								 ^ (uint64_t)mpiRank<<48 ^ (uint64_t)i);
+			pick = key%decimation==0;
+		} else {
+			pick = (i-pop->iStart[s])%decimation==0;
+		}
+
+		if(pick){
+			for(int d=0;d<nDims;d++){
+				pos[nPicked*nDims+d] = pop->pos[i*nDims+d];
+				vel[nPicked*nDims+d] = pop->vel[i*nDims+d];
+			}
+			nPicked++;
+		}
+	}
+
+	return nPicked;
+}
+
+typedef struct{
+	hid_t h5;
+	hsize_t fileDims[2];
+	hsize_t memDims[2];
+	hsize_t offset[2];
+	hid_t type;
+	int deflate;
+	char posName[64];
+	char velName[64];
+	double *pos;
+	double *vel;
+	bool staged;		// pos and vel are copies to be freed after writing
+} PWriteJob;
+
+static void pWriteH5Job(void *data){
+
+	PWriteJob *job = (PWriteJob*)data;
+	const int arrSize = 2;
+
+	hid_t memSpace = H5Screate_simple(arrSize,job->memDims,NULL);
+	hid_t fileSpace = H5Screate_simple(arrSize,job->fileDims,NULL);
+
+	H5Sselect_hyperslab(fileSpace,
+						H5S_SELECT_SET,
+						job->offset,
+						NULL,
+						job->memDims,
+						NULL);
+
+	/*
+	 * STORE DATA COLLECTIVELY
+	 */
+	hid_t pList = H5Pcreate(H5P_DATASET_XFER);
+    H5Pset_dxpl_mpio(pList, H5FD_MPIO_COLLECTIVE);
+
+	hsize_t chunkDims[2] = {job->fileDims[0], job->fileDims[1]};
+	if(chunkDims[0]>PARTICLE_CHUNK) chunkDims[0] = PARTICLE_CHUNK;
+	hid_t createProp = createH5Chunked(arrSize, chunkDims, job->deflate);
+
+	hid_t dataset;
+
+	dataset = H5Dcreate(job->h5,
+						job->posName,
+						job->type,
+						fileSpace,
+						H5P_DEFAULT,
+						createProp,
+						H5P_DEFAULT);
+
+	H5Dwrite(	dataset,
+				H5T_NATIVE_DOUBLE,
+				memSpace,
+				fileSpace,
+				pList,
+				job->pos);
+
+	H5Dclose(dataset);
+
+	dataset = H5Dcreate(job->h5,
+						job->velName,
+						job->type,
+						fileSpace,
+						H5P_DEFAULT,
+						createProp,
+						H5P_DEFAULT);
+
+	H5Dwrite(	dataset,
+		 		H5T_NATIVE_DOUBLE,
+				memSpace,
+				fileSpace,
+				pList,
+				job->vel);
+
+	H5Dclose(dataset);
+
+	H5Pclose(createProp);
+	H5Pclose(pList);
+	H5Sclose(fileSpace);
+	H5Sclose(memSpace);
+
+	if(job->staged){
+		free(job->pos);
+		free(job->vel);
+	}
+	free(job);
+}
+
 void pWriteH5(Population *pop, const MpiInfo *mpiInfo, double posN, double velN){
 
+	if((long int)posN % pop->h5Interval) return;
+
 	int mpiRank = mpiInfo->mpiRank;
 	int mpiSize = mpiInfo->mpiSize;
 	int nSpecies = pop->nSpecies;
+	int nDims = pop->nDims;
 
-	pToGlobalFrame(pop,mpiInfo);
+	// Particles are copied when decimating, or to let the simulation continue
+	// while writing
+	bool stage = pop->h5Decimation>1 || h5AsyncActive();
 
-	/*
- 	 * HDF5 HYPERSLAB DEFINITION
-	 */
-	const int arrSize = 2;
-	hsize_t fileDims[arrSize];		// Size of data in file
-	hsize_t memDims[arrSize];		// Size of data in memory of this MPI node
-	hsize_t offset[arrSize];		// At which offset in file to store data of this MPI node
-	fileDims[1] = pop->nDims;
-	memDims[1] = pop->nDims;
-	offset[1] = 0;
+	pToGlobalFrame(pop,mpiInfo);
 
 	long int *offsetAllSubdomains = malloc((mpiSize+1)*sizeof(long int));
 	offsetAllSubdomains[0] = 0;
@@ -560,6 +851,15 @@ void pWriteH5(Population *pop, const MpiInfo *mpiInfo, double posN, double velN)
 	for(int s=0;s<nSpecies;s++){
 
 		long int nParticles = pop->iStop[s] - pop->iStart[s];
+		double *pos = &pop->pos[pop->iStart[s]*nDims];
+		double *vel = &pop->vel[pop->iStart[s]*nDims];
+
+		if(stage){
+			pos = malloc((nParticles*nDims+1)*sizeof(*pos));
+			vel = malloc((nParticles*nDims+1)*sizeof(*vel));
+			nParticles = pPickParticles(pop, s, (long int)posN, mpiRank, pos, vel);
+		}
+
 		MPI_Allgather(	&nParticles,
 						1,
 						MPI_LONG,
@@ -578,71 +878,33 @@ void pWriteH5(Population *pop, const MpiInfo *mpiInfo, double posN, double velN)
 		// on one MPI node. HDF5 may crash otherwise.
 		if(offsetAllSubdomains[mpiSize]){
 
-			fileDims[0] = offsetAllSubdomains[mpiSize];
-			memDims[0] = nParticles;
-			offset[0] = offsetAllSubdomains[mpiRank];
-
-			hid_t memSpace = H5Screate_simple(arrSize,memDims,NULL);
-			hid_t fileSpace = H5Screate_simple(arrSize,fileDims,NULL);
-
-			H5Sselect_hyperslab(fileSpace,
-								H5S_SELECT_SET,
-								offset,
-								NULL,
-								memDims,
-								NULL);
-
 			/*
-			 * STORE DATA COLLECTIVELY
+		 	 * HDF5 HYPERSLAB DEFINITION
 			 */
-			hid_t pList = H5Pcreate(H5P_DATASET_XFER);
-		    H5Pset_dxpl_mpio(pList, H5FD_MPIO_COLLECTIVE);
-
-			char name[64];
-			hid_t dataset;
-
-			sprintf(name,"/pos/specie %i/n=%.1f",s,posN);
-			dataset = H5Dcreate(pop->h5,
-								name,
-								H5T_IEEE_F64LE,
-								fileSpace,
-								H5P_DEFAULT,
-								H5P_DEFAULT,
-								H5P_DEFAULT);
-
-			H5Dwrite(	dataset,
-						H5T_NATIVE_DOUBLE,
-						memSpace,
-						fileSpace,
-						pList,
-						&pop->pos[pop->iStart[s]*pop->nDims]);
-
-			H5Dclose(dataset);
-
-			sprintf(name,"/vel/specie %i/n=%.1f",s,velN);
-			dataset = H5Dcreate(pop->h5,
-								name,
-								H5T_IEEE_F64LE,
-								fileSpace,
-								H5P_DEFAULT,
-								H5P_DEFAULT,
-								H5P_DEFAULT);
-
-			H5Dwrite(	dataset,
-				 		H5T_NATIVE_DOUBLE,
-						memSpace,
-						fileSpace,
-						pList,
-						&pop->vel[pop->iStart[s]*pop->nDims]);
-
-			H5Dclose(dataset);
-
-			H5Pclose(pList);
-			H5Sclose(fileSpace);
-			H5Sclose(memSpace);
+			PWriteJob *job = malloc(sizeof(*job));
+			job->h5 = pop->h5;
+			job->fileDims[0] = offsetAllSubdomains[mpiSize];
+			job->fileDims[1] = nDims;
+			job->memDims[0] = nParticles;
+			job->memDims[1] = nDims;
+			job->offset[0] = offsetAllSubdomains[mpiRank];
+			job->offset[1] = 0;
+			job->type = pop->h5Type;
+			job->deflate = pop->h5Deflate;
+			sprintf(job->posName,"/pos/specie %i/n=%.1f",s,posN);
+			sprintf(job->velName,"/vel/specie %i/n=%.1f",s,velN);
+			job->pos = pos;
+			job->vel = vel;
+			job->staged = stage;
+
+			h5AsyncSubmit(pWriteH5Job,job);
 
 		} else {
 			msg(WARNING,"No particles of specie %i to store in .h5-file",s);
+			if(stage){
+				free(pos);
+				free(vel);
+			}
 		}
 	}
  	free(offsetAllSubdomains);
@@ -651,9 +913,258 @@ void pWriteH5(Population *pop, const MpiInfo *mpiInfo, double posN, double velN)
 }
 
 void pCloseH5(Population *pop){
+	h5AsyncWait();
 	H5Fclose(pop->h5);
 }
 
+/*
+ * Sends n particles of specie s, given in global frame, to the MPI nodes whose
+ * subdomains they are in. There they are added in local frame.
+ */
+static void pRedistribute(Population *pop, int s, const double *pos,
+						  const double *vel, long int n, const MpiInfo *mpiInfo){
+
+	int nDims = pop->nDims;
+	int mpiSize = mpiInfo->mpiSize;
+	int *nSubdomains = mpiInfo->nSubdomains;
+	int *nSubdomainsProd = mpiInfo->nSubdomainsProd;
+	int *offset = mpiInfo->offset;
+	double *posToSubdomain = mpiInfo->posToSubdomain;
+
+	int *sendCounts = calloc(mpiSize,sizeof(*sendCounts));
+	int *recvCounts = malloc(mpiSize*sizeof(*recvCounts));
+	int *sendDispls = malloc((mpiSize+1)*sizeof(*sendDispls));
+	int *recvDispls = malloc((mpiSize+1)*sizeof(*recvDispls));
+	int *dest = malloc((n+1)*sizeof(*dest));
+
+	for(long int i=0;i<n;i++){
+		int r = 0;
+		for(int d=0;d<nDims;d++){
+			int J = (int)(posToSubdomain[d]*pos[i*nDims+d]);
+			if(J<0) J = 0;
+			if(J>=nSubdomains[d]) J = nSubdomains[d]-1;
+			r += J*nSubdomainsProd[d];
+		}
+		dest[i] = r;
+		sendCounts[r] += 2*nDims;
+	}
+
+	MPI_Alltoall(sendCounts,1,MPI_INT,recvCounts,1,MPI_INT,MPI_COMM_WORLD);
+
+	sendDispls[0] = 0;
+	recvDispls[0] = 0;
+	for(int r=0;r<mpiSize;r++){
+		sendDispls[r+1] = sendDispls[r]+sendCounts[r];
+		recvDispls[r+1] = recvDispls[r]+recvCounts[r];
+	}
+
+	// Pack position and velocity of each particle together, ordered by node
+	double *send = malloc((sendDispls[mpiSize]+1)*sizeof(*send));
+	double *recv = malloc((recvDispls[mpiSize]+1)*sizeof(*recv));
+	int *next = malloc(mpiSize*sizeof(*next));
+	for(int r=0;r<mpiSize;r++) next[r] = sendDispls[r];
+
+	for(long int i=0;i<n;i++){
+		double *p = &send[next[dest[i]]];
+		for(int d=0;d<nDims;d++){
+			p[d] = pos[i*nDims+d];
+			p[nDims+d] = vel[i*nDims+d];
+		}
+		next[dest[i]] += 2*nDims;
+	}
+
+	MPI_Alltoallv(	send,sendCounts,sendDispls,MPI_DOUBLE,
+					recv,recvCounts,recvDispls,MPI_DOUBLE,MPI_COMM_WORLD);
+
+	long int nRecv = recvDispls[mpiSize]/(2*nDims);
+	double *localPos = malloc(nDims*sizeof(*localPos));
+	for(long int i=0;i<nRecv;i++){
+		double *p = &recv[2*nDims*i];
+		for(int d=0;d<nDims;d++) localPos[d] = p[d]-offset[d];
+		pNew(pop,s,localPos,&p[nDims]);
+	}
+
+	free(localPos);
+	free(next);
+	free(send);
+	free(recv);
+	free(dest);
+	free(sendCounts);
+	free(recvCounts);
+	free(sendDispls);
+	free(recvDispls);
+}
+
+/*
+ * Reads specie s from the datasets posName and velName (global frame). The
+ * particles are read in blocks of PARTICLE_CHUNK, matching the chunks of
+ * .pop.h5-files, which are dealt out to the MPI nodes in turn. After each
+ * round the particles are sent to their subdomains by pRedistribute(), such
+ * that no node holds more than one block it does not own.
+ */
+static void pReadSpecie(Population *pop, int s, hid_t file, const char *posName,
+						const char *velName, const MpiInfo *mpiInfo){
+
+	int mpiRank = mpiInfo->mpiRank;
+	int mpiSize = mpiInfo->mpiSize;
+	int nDims = pop->nDims;
+	const int arrSize = 2;
+
+	hid_t posSet = H5Dopen(file,posName,H5P_DEFAULT);
+	hid_t velSet = H5Dopen(file,velName,H5P_DEFAULT);
+
+	hsize_t fileDims[arrSize];
+	hid_t fileSpace = H5Dget_space(posSet);
+	H5Sget_simple_extent_dims(fileSpace,fileDims,NULL);
+	if(fileDims[1]!=(hsize_t)nDims)
+		msg(ERROR,"%s has %i dimensions, expected %i",posName,(int)fileDims[1],nDims);
+
+	long int nTotal = (long int)fileDims[0];
+	long int nBlocks = (nTotal+PARTICLE_CHUNK-1)/PARTICLE_CHUNK;
+	long int nRounds = (nBlocks+mpiSize-1)/mpiSize;
+
+	hsize_t blockDims[] = {PARTICLE_CHUNK,nDims};
+	hid_t memSpace = H5Screate_simple(arrSize,blockDims,NULL);
+
+	hid_t pList = H5Pcreate(H5P_DATASET_XFER);
+	H5Pset_dxpl_mpio(pList, H5FD_MPIO_COLLECTIVE);
+
+	double *pos = malloc(PARTICLE_CHUNK*nDims*sizeof(*pos));
+	double *vel = malloc(PARTICLE_CHUNK*nDims*sizeof(*vel));
+
+	for(long int round=0;round<nRounds;round++){
+
+		// All nodes take part in every round, some possibly reading nothing
+		long int first = (round*mpiSize+mpiRank)*PARTICLE_CHUNK;
+		long int n = nTotal-first;
+		if(n<0) n = 0;
+		if(n>PARTICLE_CHUNK) n = PARTICLE_CHUNK;
+
+		hsize_t offset[] = {first,0};
+		hsize_t memOffset[] = {0,0};
+		hsize_t memDims[] = {n,nDims};
+		if(n){
+			H5Sselect_hyperslab(fileSpace,H5S_SELECT_SET,offset,NULL,memDims,NULL);
+			H5Sselect_hyperslab(memSpace,H5S_SELECT_SET,memOffset,NULL,memDims,NULL);
+		} else {
+			H5Sselect_none(fileSpace);
+			H5Sselect_none(memSpace);
+		}
+
+		H5Dread(posSet, H5T_NATIVE_DOUBLE, memSpace, fileSpace, pList, pos);
+		H5Dread(velSet, H5T_NATIVE_DOUBLE, memSpace, fileSpace, pList, vel);
+
+		pRedistribute(pop,s,pos,vel,n,mpiInfo);
+	}
+
+	free(pos);
+	free(vel);
+
+	H5Pclose(pList);
+	H5Sclose(memSpace);
+	H5Sclose(fileSpace);
+	H5Dclose(posSet);
+	H5Dclose(velSet);
+}
+
+void pWriteCheckpoint(Population *pop, const MpiInfo *mpiInfo, hid_t file){
+
+	int mpiRank = mpiInfo->mpiRank;
+	int mpiSize = mpiInfo->mpiSize;
+	int nSpecies = pop->nSpecies;
+	int nDims = pop->nDims;
+	const int arrSize = 2;
+
+	createH5Group(file,"/pos/");
+	createH5Group(file,"/vel/");
+
+	pToGlobalFrame(pop,mpiInfo);
+
+	long int *offsetAllSubdomains = malloc((mpiSize+1)*sizeof(long int));
+	offsetAllSubdomains[0] = 0;
+
+	for(int s=0;s<nSpecies;s++){
+
+		long int nParticles = pop->iStop[s] - pop->iStart[s];
+		MPI_Allgather(	&nParticles,1,MPI_LONG,
+						&offsetAllSubdomains[1],1,MPI_LONG,MPI_COMM_WORLD);
+		for(int r=1;r<=mpiSize;r++){
+			offsetAllSubdomains[r] += offsetAllSubdomains[r-1];
+		}
+
+		// Species without particles are left out
+		if(!offsetAllSubdomains[mpiSize]) continue;
+
+		hsize_t fileDims[] = {offsetAllSubdomains[mpiSize],nDims};
+		hsize_t memDims[] = {nParticles,nDims};
+		hsize_t offset[] = {offsetAllSubdomains[mpiRank],0};
+
+		hid_t memSpace = H5Screate_simple(arrSize,memDims,NULL);
+		hid_t fileSpace = H5Screate_simple(arrSize,fileDims,NULL);
+		H5Sselect_hyperslab(fileSpace,H5S_SELECT_SET,offset,NULL,memDims,NULL);
+
+		hid_t pList = H5Pcreate(H5P_DATASET_XFER);
+		H5Pset_dxpl_mpio(pList, H5FD_MPIO_COLLECTIVE);
+
+		char name[64];
+		hid_t dataset;
+
+		sprintf(name,"/pos/specie %i",s);
+		dataset = H5Dcreate(file,name,H5T_IEEE_F64LE,fileSpace,H5P_DEFAULT,H5P_DEFAULT,H5P_DEFAULT);
+		H5Dwrite(dataset,H5T_NATIVE_DOUBLE,memSpace,fileSpace,pList,&pop->pos[pop->iStart[s]*nDims]);
+		H5Dclose(dataset);
+
+		sprintf(name,"/vel/specie %i",s);
+		dataset = H5Dcreate(file,name,H5T_IEEE_F64LE,fileSpace,H5P_DEFAULT,H5P_DEFAULT,H5P_DEFAULT);
+		H5Dwrite(dataset,H5T_NATIVE_DOUBLE,memSpace,fileSpace,pList,&pop->vel[pop->iStart[s]*nDims]);
+		H5Dclose(dataset);
+
+		H5Pclose(pList);
+		H5Sclose(fileSpace);
+		H5Sclose(memSpace);
+	}
+	free(offsetAllSubdomains);
+
+	pToLocalFrame(pop,mpiInfo);
+}
+
+void pReadCheckpoint(Population *pop, const MpiInfo *mpiInfo, hid_t file){
+
+	int nSpecies = pop->nSpecies;
+
+	for(int s=0;s<nSpecies;s++){
+
+		pop->iStop[s] = pop->iStart[s];
+
+		char posName[64], velName[64];
+		sprintf(posName,"/pos/specie %i",s);
+		sprintf(velName,"/vel/specie %i",s);
+
+		if(H5Lexists(file,posName,H5P_DEFAULT))
+			pReadSpecie(pop,s,file,posName,velName,mpiInfo);
+	}
+}
+
+void pReadH5(Population *pop, const MpiInfo *mpiInfo, double posN, double velN){
+
+	h5AsyncWait();
+
+	int nSpecies = pop->nSpecies;
+
+	for(int s=0;s<nSpecies;s++){
+
+		pop->iStop[s] = pop->iStart[s];
+
+		char posName[64], velName[64];
+		sprintf(posName,"/pos/specie %i/n=%.1f",s,posN);
+		sprintf(velName,"/vel/specie %i/n=%.1f",s,velN);
+
+		// pWriteH5() leaves out species without particles
+		if(H5Lexists(pop->h5,posName,H5P_DEFAULT))
+			pReadSpecie(pop,s,pop->h5,posName,velName,mpiInfo);
+	}
+}
+
 
 void pCreateEnergyDatasets(hid_t xy, Population *pop){
 
@@ -36,19 +36,37 @@ void pFree(Population *pop);
  *
  * The amount of particles specified by population:nParticles in ini will be
  * generated with uniformly distributed random positions within the simulation
- * domain (global reference frame). In case of multiple subdomains only
- * particles residing in this MPI node's subdomain will be stored, and will be
- * transformed to its local reference frame. The rng should have the same seed
- * (be synchronized) on all MPI nodes when calling this function as that will
- * ensure that all nodes generates the same particles and discards particles
- * not belonging to their subdomain. Failure to do so may lead to the number of
- * particles generated being different than specified in ini.
+ * domain. Each MPI node only generates the particles in its own subdomain, in
+ * its local reference frame.
+ *
+ * The number of particles in each cell is multinomially distributed, as for
+ * independent positions. It is drawn by halving the domain recursively along
+ * its longest dimension, with a binomial rBinomial() split of the particles at
+ * each step, so each MPI node only draws the splits above its own cells. The
+ * positions within a cell are drawn by rUniform() with one stream per specie
+ * and global cell. The result is therefore the same regardless of the number
+ * of MPI nodes. The seeds are drawn from rngSync, which must have the same
+ * seed (be synchronized) on all MPI nodes.
  *
  * Beware that this function do not assign any velocity to the particles.
  * @see pVelMaxwell()
  */
 void pPosUniform(const dictionary *ini, Population *pop, const MpiInfo *mpiInfo, const gsl_rng *rngSync);
 
+/**
+ * @brief	Assign particles positions on a lattice
+ * @param			ini		Dictionary to input file
+ * @param[in,out]	pop		Population of particles
+ * @param			mpiInfo	MpiInfo
+ * @return			void
+ *
+ * Particle i of population:nParticles is placed at l*i along the first
+ * dimension, wrapping around into the next dimensions, where l is the
+ * particle-particle distance for a uniform density. Each MPI node only visits
+ * the ranges of i which end up in its own subdomain.
+ *
+ * Beware that this function do not assign any velocity to the particles.
+ */
 void pPosLattice(const dictionary *ini, Population *pop, const MpiInfo *mpiInfo);
 
 /**
@@ -86,16 +104,20 @@ void pSumKinEnergy(Population *pop);
  * @brief	Assign particles Maxwellian distributed velocities
  * @param			ini		Dictionary to input file
  * @param[in,out]	pop		Population of particles
- * @param			rng		Random number generator
+ * @param			mpiInfo	MpiInfo
+ * @param			rngSync	Synchronized random number generator
  * @return			void
  *
  * Iterates through all particles belonging to pop and assignes Maxwellian
  * distributed velocities to them, according to the temperature specified in
- * ini. Contrary to in posUniform() rng should at this point _not_ have the same
- * seed as that will lead to particles in different sub-domains having identical
- * velocities.
+ * ini.
+ *
+ * The velocities are drawn in one batch per specie by rGaussian(). As in
+ * pPosUniform() the seed is drawn from rngSync, which must have the same seed
+ * on all MPI nodes. Each MPI node and specie has its own stream,
+ * mpiRank*nSpecies+s, so that no two sub-domains get identical velocities.
  */
-void pVelMaxwell(const dictionary *ini, Population *pop, const gsl_rng *rng);
+void pVelMaxwell(const dictionary *ini, Population *pop, const MpiInfo *mpiInfo, const gsl_rng *rngSync);
 
 /**
  * @brief	Add new particle to population
@@ -148,6 +170,10 @@ void pCut(Population *pop, int s, long int p, double *pos, double *vel);
  * values, the output contains two attributes: The "Position denormalization
  * factor" and "Velocity denormalization factor". Upon multiplication by these,
  * the position/velocity will become physical values.
+ *
+ * How often and how many particles to write is read from the "files" section,
+ * see getH5Output() and pWriteH5(). The datasets are chunked, and compressed
+ * or stored in single precision as set by getH5Compression().
  */
 void pOpenH5(	const dictionary *ini, Population *pop, const Units *units,
 	   			const char *fName);
@@ -164,6 +190,11 @@ void pOpenH5(	const dictionary *ini, Population *pop, const Units *units,
  * reference frame. The function takes care of merging the particles from all
  * MPI nodes to one file.
  *
+ * Nothing is written unless posN is a multiple of the output interval set up
+ * by pOpenH5(). If the output stride of the population is larger than one,
+ * only one out of that many particles of each specie is written, picked
+ * either by stride or randomly as chosen by "files:particleSampling".
+ *
  * NB: pop is not constified because all particles are transformed to global
  * reference frame before writing to .h5-file. However, they are transferred
  * back to local reference frame after writing so pop should remain unchanged to
@@ -171,6 +202,24 @@ void pOpenH5(	const dictionary *ini, Population *pop, const Units *units,
  */
 void pWriteH5(Population *pop, const MpiInfo *mpiInfo, double posN, double velN);
 
+/**
+ * @brief	Reads particles from .pop.h5-file into Population
+ * @param	pop		Population
+ * @param	mpiInfo	MpiInfo
+ * @param	posN	Timestep of position data to be read
+ * @param	velN	Timestep of velocity data to be read
+ * @return			void
+ * @see pOpenH5(), pWriteH5()
+ *
+ * Replaces the particles in Population with those stored by pWriteH5(), or
+ * by an external program using the same layout, in the file opened by
+ * pOpenH5(). No MPI node reads the whole file. Instead, the nodes read
+ * blocks of the datasets in turn and exchange the particles such that each
+ * ends up with those in its own subdomain. Files written with decimation only
+ * contain a sample of the particles.
+ */
+void pReadH5(Population *pop, const MpiInfo *mpiInfo, double posN, double velN);
+
 /**
  * @brief	Closes .pop.h5-file
  * @param	pop		Population
@@ -178,6 +227,33 @@ void pWriteH5(Population *pop, const MpiInfo *mpiInfo, double posN, double velN)
  */
 void pCloseH5(Population *pop);
 
+/**
+ * @brief	Stores all particles in a checkpoint file
+ * @param	pop		Population
+ * @param	mpiInfo	MpiInfo
+ * @param	file	Open .h5-file
+ * @return			void
+ *
+ * Positions (global frame) and velocities of all particles are stored in the
+ * datasets "/pos/specie <s>" and "/vel/specie <s>", without the decimation or
+ * compression of pWriteH5(). Species without any particles are left out.
+ */
+void pWriteCheckpoint(Population *pop, const MpiInfo *mpiInfo, hid_t file);
+
+/**
+ * @brief	Replaces the particles by those stored by pWriteCheckpoint()
+ * @param	pop		Population
+ * @param	mpiInfo	MpiInfo
+ * @param	file	Open .h5-file
+ * @return			void
+ *
+ * Each MPI node reads an equal share of each specie, and the particles are
+ * then sent to the node whose subdomain they are in with one all-to-all
+ * exchange. The number of MPI nodes may therefore differ from when the
+ * checkpoint was written, as long as population:nAlloc leaves room.
+ */
+void pReadCheckpoint(Population *pop, const MpiInfo *mpiInfo, hid_t file);
+
 /**
  * @brief Transforms particles to local reference frame
  * @param	pop			Population of particles
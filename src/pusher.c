@@ -87,35 +87,33 @@ void puMove(Population *pop, Object *obj){
 
 	int nSpecies = pop->nSpecies;
 	long int *coll = pop->collisions;
-	int nColl = sizeof(pop->collisions) / sizeof(long int);
+	long int nColl = pop->nCollisions;
 
 	int nDims = pop->nDims;
 	double *pos = pop->pos;
 	double *vel = pop->vel;
 
+	// Collisions are sorted by particle index
+	long int n = 0;
+
 	for(int s=0; s<nSpecies; s++){
 
-		long int pStart = pop->iStart[s]*nDims;
-		long int pStop = pop->iStop[s]*nDims;
+		long int iStart = pop->iStart[s];
+		long int iStop = pop->iStop[s];
 
-		for(long int p=pStart;p<pStop;p++){
+		for(long int i=iStart;i<iStop;i++){
 
-			bool collided = false;
 			//code for particle/object collision, pos[p] += vel[p] if no intersection
-			for(long int n; n<nColl; n++){
-				if(p == coll[n]){
-					
-					oParticleCollision(pop, obj);
-					collided = true;
-				}
-			}
-
-			if(!collided){
-				pos[p] += vel[p];
+			if(n<nColl && coll[n]==i){
+				oParticleCollision(pop, obj, i);
+				n++;
+			} else {
+				for(int d=0;d<nDims;d++) pos[i*nDims+d] += vel[i*nDims+d];
 			}
-
 		}
 	}
+
+	pop->nCollisions = 0;
 }
 
 void puPeriodic(Population *pop, Grid *grid){
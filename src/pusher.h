@@ -14,8 +14,12 @@
 /**
  * @brief Moves particles one timestep forward
  * @param[in,out]	pop		Population
+ * @param			obj		Object
  * @return					void
  *
+ * Particles listed in pop->collisions by oFindParticleCollisions() are moved
+ * by oParticleCollision() instead.
+ *
  * No boundary conditions are enforced and particles may therefore travel out of
  * bounds. Other functions must be called subsequently to enforce boundary
  * conditions or transfer them to other sub-domains as appropriate. Otherwise
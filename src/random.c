@@ -0,0 +1,187 @@
+/**
+ * @file		random.c
+ * @brief		Counter-based random number generation.
+ *
+ * Implementation of the Philox4x32-10 generator and batches of uniform and
+ * normal numbers drawn from it.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include "core.h"
+#include <stdint.h>
+#include <math.h>
+
+#define PHILOX_M0 0xD2511F53U
+#define PHILOX_M1 0xCD9E8D57U
+#define PHILOX_W0 0x9E3779B9U
+#define PHILOX_W1 0xBB67AE85U
+
+/******************************************************************************
+ * LOCAL FUNCTION DECLARATIONS
+ *****************************************************************************/
+
+/**
+ * @brief	Computes the pair of uniform numbers with index 2*block and 2*block+1
+ * @param		seed	Seed
+ * @param		stream	Stream
+ * @param		block	Index of pair
+ * @param[out]	res		Uniform numbers in (0,1) (2 elements)
+ */
+static inline void rUniformPair(uint64_t seed, uint64_t stream, uint64_t block,
+								double *res);
+
+/**
+ * @brief	Tail of Stirling's series for log(k!)
+ * @param	k	Argument
+ * @return		log(k!) - (k+1/2)log(k+1) + (k+1) - log(2*pi)/2
+ */
+static double rStirlingTail(double k);
+
+/******************************************************************************
+ * GLOBAL FUNCTION DEFINITIONS
+ *****************************************************************************/
+
+void rPhilox(const uint32_t *counter, const uint32_t *key, uint32_t *res){
+
+	uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+	uint32_t k0 = key[0], k1 = key[1];
+
+	for(int round=0;round<10;round++){
+
+		uint64_t p0 = (uint64_t)PHILOX_M0*c0;
+		uint64_t p1 = (uint64_t)PHILOX_M1*c2;
+
+		c0 = (uint32_t)(p1>>32) ^ c1 ^ k0;
+		c1 = (uint32_t)p1;
+		c2 = (uint32_t)(p0>>32) ^ c3 ^ k1;
+		c3 = (uint32_t)p0;
+
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+	}
+
+	res[0] = c0;
+	res[1] = c1;
+	res[2] = c2;
+	res[3] = c3;
+}
+
+void rUniform(uint64_t seed, uint64_t stream, uint64_t first, double *res,
+			  long int n){
+
+	double pair[2];
+
+	for(long int i=0;i<n;){
+
+		uint64_t index = first+i;
+		rUniformPair(seed,stream,index/2,pair);
+
+		for(int h=index%2;h<2 && i<n;h++) res[i++] = pair[h];
+	}
+}
+
+void rGaussian(uint64_t seed, uint64_t stream, uint64_t first, double *res,
+			   long int n){
+
+	double pair[2];
+
+	for(long int i=0;i<n;){
+
+		uint64_t index = first+i;
+		rUniformPair(seed,stream,index/2,pair);
+
+		double r = sqrt(-2*log(pair[0]));
+		double theta = 2*M_PI*pair[1];
+		pair[0] = r*cos(theta);
+		pair[1] = r*sin(theta);
+
+		for(int h=index%2;h<2 && i<n;h++) res[i++] = pair[h];
+	}
+}
+
+long int rBinomial(uint64_t seed, uint64_t stream, double p, long int n){
+
+	if(p>0.5) return n-rBinomial(seed,stream,1-p,n);
+	if(n<=0 || p<=0) return 0;
+
+	double u[2];
+	uint64_t index = 0;
+
+	// Inversion: count the geometrically distributed waits between successes
+	if(n*p<10){
+		double logq = log1p(-p);
+		long int k = 0;
+		double sum = 0;
+		while(1){
+			rUniform(seed,stream,index++,u,1);
+			sum += ceil(log(u[0])/logq);
+			if(sum>n) return k;
+			k++;
+		}
+	}
+
+	// BTRS
+	double q = 1-p;
+	double spq = sqrt(n*p*q);
+	double b = 1.15+2.53*spq;
+	double a = -0.0873+0.0248*b+0.01*p;
+	double c = n*p+0.5;
+	double vr = 0.92-4.2/b;
+	double r = p/q;
+	double alpha = (2.83+5.1/b)*spq;
+	double m = floor((n+1)*p);
+
+	while(1){
+		rUniform(seed,stream,index,u,2);
+		index += 2;
+
+		double us = 0.5-fabs(u[0]-0.5);
+		double k = floor((2*a/us+b)*(u[0]-0.5)+c);
+		if(us>=0.07 && u[1]<=vr) return (long int)k;
+		if(k<0 || k>n) continue;
+
+		double v = log(u[1]*alpha/(a/(us*us)+b));
+		double bound =	(m+0.5)*log((m+1)/(r*(n-m+1))) +
+						(n+1)*log((n-m+1)/(n-k+1)) +
+						(k+0.5)*log(r*(n-k+1)/(k+1)) +
+						rStirlingTail(m)+rStirlingTail(n-m) -
+						rStirlingTail(k)-rStirlingTail(n-k);
+		if(v<=bound) return (long int)k;
+	}
+}
+
+/******************************************************************************
+ * LOCAL FUNCTION DEFINITIONS
+ *****************************************************************************/
+
+static inline void rUniformPair(uint64_t seed, uint64_t stream, uint64_t block,
+								double *res){
+
+	uint32_t counter[4] = {	(uint32_t)block, (uint32_t)(block>>32),
+							(uint32_t)stream, (uint32_t)(stream>>32)};
+	uint32_t key[2] = {(uint32_t)seed, (uint32_t)(seed>>32)};
+	uint32_t bits[4];
+
+	rPhilox(counter,key,bits);
+
+	// 53 bits each, offset by half a step to stay off 0 and 1
+	for(int h=0;h<2;h++){
+		uint64_t x = ((uint64_t)bits[2*h]<<32 | bits[2*h+1])>>11;
+		res[h] = (x+0.5)*(1.0/9007199254740992.0);
+	}
+}
+
+static double rStirlingTail(double k){
+
+	static const double table[10] = {
+		0.0810614667953272, 0.0413406959554092, 0.0276779256849983,
+		0.02079067210376509, 0.0166446911898211, 0.0138761288230707,
+		0.0118967099458917, 0.0104112652619720, 0.00925546218271273,
+		0.00833056343336287};
+
+	if(k<=9) return table[(int)k];
+
+	double kp1sq = (k+1)*(k+1);
+	return (1.0/12-(1.0/360-1.0/1260/kp1sq)/kp1sq)/(k+1);
+}
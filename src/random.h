@@ -0,0 +1,80 @@
+/**
+ * @file		random.h
+ * @brief		Counter-based random number generation.
+ *
+ * Core module for random numbers which only depend on a seed and a counter,
+ * not on a generator state. Any number in a sequence can be computed
+ * directly, so the same numbers are obtained regardless of how the work is
+ * divided between MPI nodes or threads, and in which order.
+ *
+ * A sequence is identified by a seed and a stream, and its numbers are
+ * addressed by their index. E.g. a stream can be the global index of a cell,
+ * and the index the particle number within it.
+ */
+
+#ifndef RANDOM_H
+#define RANDOM_H
+
+/**
+ * @brief	Philox4x32-10 block function
+ * @param		counter	Counter (4 elements)
+ * @param		key		Key (2 elements)
+ * @param[out]	res		Random bits (4 elements)
+ * @return		void
+ *
+ * Ten rounds of the Philox4x32 bijection of Salmon et al. (2011), "Parallel
+ * random numbers: as easy as 1, 2, 3". Each distinct counter gives 128
+ * independent random bits.
+ */
+void rPhilox(const uint32_t *counter, const uint32_t *key, uint32_t *res);
+
+/**
+ * @brief	Uniformly distributed random numbers
+ * @param		seed	Seed
+ * @param		stream	Stream
+ * @param		first	Index of first number in stream
+ * @param[out]	res		Random numbers (n elements)
+ * @param		n		Number of random numbers
+ * @return		void
+ *
+ * Stores numbers first to first+n-1 of the stream in res. The numbers are in
+ * the open interval (0,1) with 53 random bits. Number i does not depend on
+ * first or n, so a stream can be generated in parts. Each call of rPhilox()
+ * gives two numbers.
+ */
+void rUniform(uint64_t seed, uint64_t stream, uint64_t first, double *res,
+			  long int n);
+
+/**
+ * @brief	Normally distributed random numbers
+ * @param		seed	Seed
+ * @param		stream	Stream
+ * @param		first	Index of first number in stream
+ * @param[out]	res		Random numbers (n elements)
+ * @param		n		Number of random numbers
+ * @return		void
+ *
+ * Same as rUniform() but with zero mean and unit standard deviation. Each
+ * pair of uniform numbers is transformed to two normal numbers by the
+ * Box-Muller transform.
+ */
+void rGaussian(uint64_t seed, uint64_t stream, uint64_t first, double *res,
+			   long int n);
+
+/**
+ * @brief	Binomially distributed random number
+ * @param	seed	Seed
+ * @param	stream	Stream
+ * @param	p		Probability of success in each trial
+ * @param	n		Number of trials
+ * @return			Number of successes
+ *
+ * Uses the numbers of the stream from index 0, so the result only depends on
+ * seed, stream, p and n. Inversion is used when min(p,1-p)*n is below 10, and
+ * otherwise the transformed rejection with squeeze (BTRS) of Hörmann (1993),
+ * "The generation of binomial random variates". The expected number of
+ * uniform numbers used is bounded independently of n.
+ */
+long int rBinomial(uint64_t seed, uint64_t stream, double p, long int n);
+
+#endif // RANDOM_H
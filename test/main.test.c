@@ -19,6 +19,7 @@ int main(int argc, char *argv[]){
 	testPopulation();
 	testPusher();
 	testMultigrid();
+	testRandom();
 	utSummary();
 
 	MPI_Finalize();
@@ -58,6 +58,181 @@ static int testmgGS(){
 	return 0;
 }
 
+/*
+ * Puts charge 1 evenly on the nodes of a sphere, neutralized by a uniform
+ * background, and returns the sum of rho over the nodes where mask is set.
+ */
+static double setSphereCharge(Grid *rho, const Grid *sphere, const Grid *mask){
+
+	int *size = rho->size;
+	long int *sizeProd = rho->sizeProd;
+
+	long int nSphere = 0, nTrue = 0;
+	for(int l=1;l<size[3]-1;l++){
+		for(int k=1;k<size[2]-1;k++){
+			for(int j=1;j<size[1]-1;j++){
+				long int g = j*sizeProd[1] + k*sizeProd[2] + l*sizeProd[3];
+				if(sphere->val[g]>0.5) nSphere++;
+				nTrue++;
+			}
+		}
+	}
+
+	gZero(rho);
+	double sum = 0;
+	for(int l=1;l<size[3]-1;l++){
+		for(int k=1;k<size[2]-1;k++){
+			for(int j=1;j<size[1]-1;j++){
+				long int g = j*sizeProd[1] + k*sizeProd[2] + l*sizeProd[3];
+				rho->val[g] = -1./nTrue;
+				if(sphere->val[g]>0.5) rho->val[g] += 1./nSphere;
+				if(mask->val[g]>0.5) sum += rho->val[g];
+			}
+		}
+	}
+
+	return sum;
+}
+
+/*
+ * A charged floating sphere embedded in the multigrid solver by
+ * mgSetObjects(). The capacitance matrix method makes the nodes touching a
+ * cell with its lower corner in the sphere equipotential. oFillConductor()
+ * gives mgSetObjects() the same nodes, as in main.c, so the two compare.
+ */
+static int testmgObjects(){
+
+	dictionary *ini = iniGetDummy();
+
+	iniparser_set(ini, "grid:nSubdomains", "1,1,1");
+	iniparser_set(ini, "grid:trueSize", "16,16,16");
+	iniparser_set(ini, "grid:stepSize", "1,1,1");
+	iniparser_set(ini, "grid:nGhostLayers", "1,1,1,1,1,1");
+	iniparser_set(ini, "grid:boundaries", "PERIODIC");
+	iniparser_set(ini, "multigrid:mgLevels", "4");
+	iniparser_set(ini, "multigrid:mgCycles", "30");
+	iniparser_set(ini, "objects:capCache", "none");
+	iniparser_set(ini, "objects:capCompression", "0");
+
+	MpiInfo *mpiInfo = gAllocMpi(ini);
+
+	// Sphere of radius 3 nodes in the middle of the domain
+	Object *obj = oAlloc(ini);
+	Grid *domain = obj->domain;
+	int *size = domain->size;
+	long int *sizeProd = domain->sizeProd;
+
+	gZero(domain);
+	for(int l=1;l<size[3]-1;l++){
+		for(int k=1;k<size[2]-1;k++){
+			for(int j=1;j<size[1]-1;j++){
+				long int g = j*sizeProd[1] + k*sizeProd[2] + l*sizeProd[3];
+				int r2 = (j-9)*(j-9) + (k-9)*(k-9) + (l-9)*(l-9);
+				if(r2<=9) domain->val[g] = 1;
+			}
+		}
+	}
+
+	// Read it as objects are read in PINC
+	Units units;
+	units.length = 1;
+	char *fName = getH5FileName(ini,"objectTest","grid");
+	remove(fName);
+	free(fName);
+	oOpenH5(ini, obj, mpiInfo, &units, 1, "objectTest");
+	hid_t dataset = H5Dcreate(domain->h5, "Object", H5T_IEEE_F64LE, domain->h5FileSpace,
+							  H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+	H5Dwrite(dataset, H5T_NATIVE_DOUBLE, domain->h5MemSpace, domain->h5FileSpace,
+			 H5P_DEFAULT, domain->val);
+	H5Dclose(dataset);
+	oReadH5(obj, mpiInfo);
+
+	// The sphere together with its capacitance surface nodes, as in main.c
+	Grid *conductor = gAlloc(ini, SCALAR);
+	oFillConductor(conductor, obj, mpiInfo);
+
+	/*
+	 * EMBEDDED IN MULTIGRID
+	 */
+
+	Grid *rho = gAlloc(ini, SCALAR);
+	Grid *phi = gAlloc(ini, SCALAR);
+	gSetBndSlices(phi, mpiInfo);
+	MultigridSolver *solver = mgAllocSolver(ini, rho, phi);
+	mgSetObjects(solver, conductor, mpiInfo);
+
+	double charge = setSphereCharge(rho, domain, conductor);
+	gZero(phi);
+	mgSolve(solver, rho, phi, mpiInfo);
+
+	double phiObj = 0;
+	double maxDev = 0;
+	double flux = 0;
+	bool first = true;
+	for(int l=1;l<size[3]-1;l++){
+		for(int k=1;k<size[2]-1;k++){
+			for(int j=1;j<size[1]-1;j++){
+				long int g = j*sizeProd[1] + k*sizeProd[2] + l*sizeProd[3];
+				if(conductor->val[g]<0.5) continue;
+
+				if(first) phiObj = phi->val[g];
+				first = false;
+				if(fabs(phi->val[g]-phiObj)>maxDev) maxDev = fabs(phi->val[g]-phiObj);
+
+				flux += 6*phi->val[g];
+				for(int d=1;d<4;d++){
+					flux -= phi->val[g+sizeProd[d]] + phi->val[g-sizeProd[d]];
+				}
+			}
+		}
+	}
+
+	utAssert(maxDev<=1e-10*fabs(phiObj),
+		"object nodes differ by %g from the potential %g",maxDev,phiObj);
+	utAssert(fabs(flux-charge)<1e-8*fabs(charge),
+		"flux %g out of the object does not match its charge %g",flux,charge);
+
+	/*
+	 * CAPACITANCE MATRIX
+	 */
+
+	Grid *rhoCap = gAlloc(ini, SCALAR);
+	Grid *phiCap = gAlloc(ini, SCALAR);
+	gSetBndSlices(phiCap, mpiInfo);
+	MultigridSolver *capSolver = mgAllocSolver(ini, rhoCap, phiCap);
+	oComputeCapacitanceMatrix(obj, ini, mpiInfo);
+
+	setSphereCharge(rhoCap, domain, conductor);
+	gZero(phiCap);
+	mgSolve(capSolver, rhoCap, phiCap, mpiInfo);
+	oApplyCapacitanceMatrix(rhoCap, phiCap, obj, mpiInfo);
+	mgSolve(capSolver, rhoCap, phiCap, mpiInfo);
+
+	long int *surface = obj->lookupSurface;
+	long int nSurface = obj->lookupSurfaceOffset[1];
+	double phiCapObj = 0;
+	for(long int i=0;i<nSurface;i++) phiCapObj += phiCap->val[surface[i]];
+	phiCapObj /= nSurface;
+
+	// Both potentials have zero mean on the periodic domain
+	utAssert(fabs(phiCapObj-phiObj)<1e-2*fabs(phiObj),
+		"potential %g differs from %g with the capacitance matrix",phiObj,phiCapObj);
+
+	mgFreeSolver(capSolver);
+	mgFreeSolver(solver);
+	gFree(rhoCap);
+	gFree(phiCap);
+	gFree(rho);
+	gFree(phi);
+	gFree(conductor);
+	oCloseH5(obj);
+	oFree(obj);
+	gFreeMpi(mpiInfo);
+	iniparser_freedict(ini);
+
+	return 0;
+}
+
 // static int testRestrictor(){
 // 	/*
 // 	 * Set up a predefined fine grid, then checks the restrictor against a
@@ -111,5 +286,6 @@ static int testmgGS(){
 void testMultigrid(){
 	utRun(&testStructs);
 	utRun(&testmgGS);
+	utRun(&testmgObjects);
 	// utRun(&testRestrictor);
 }
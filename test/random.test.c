@@ -0,0 +1,100 @@
+/**
+ * @file		random.test.c
+ * @brief		Unit tests for random.c
+ */
+
+#include "pinc.h"
+#include "test.h"
+
+// Known-answer vectors of Philox4x32-10 from the Random123 distribution
+static int testRPhilox(){
+
+	uint32_t counter[3][4] = {
+		{0x00000000,0x00000000,0x00000000,0x00000000},
+		{0xffffffff,0xffffffff,0xffffffff,0xffffffff},
+		{0x243f6a88,0x85a308d3,0x13198a2e,0x03707344}};
+	uint32_t key[3][2] = {
+		{0x00000000,0x00000000},
+		{0xffffffff,0xffffffff},
+		{0xa4093822,0x299f31d0}};
+	uint32_t expected[3][4] = {
+		{0x6627e8d5,0xe169c58d,0xbc57ac4c,0x9b00dbd8},
+		{0x408f276d,0x41c83b0e,0xa20bc7c6,0x6d5451fd},
+		{0xd16cfe09,0x94fdcceb,0x5001e420,0x24126ea1}};
+
+	for(int v=0;v<3;v++){
+		uint32_t res[4];
+		rPhilox(counter[v],key[v],res);
+		for(int i=0;i<4;i++){
+			utAssert(res[i]==expected[v][i],
+				"vector %i word %i is %08x, expected %08x",
+				v,i,res[i],expected[v][i]);
+		}
+	}
+
+	return 0;
+}
+
+// A batch must not depend on where it is split
+static int testRBatch(){
+
+	double whole[7], part[7];
+
+	rUniform(42,3,5,whole,7);
+	rUniform(42,3,5,part,2);
+	rUniform(42,3,7,&part[2],5);
+	for(int i=0;i<7;i++){
+		utAssert(whole[i]==part[i],"rUniform differs at %i",i);
+		utAssert(whole[i]>0 && whole[i]<1,"rUniform out of range at %i",i);
+	}
+
+	rGaussian(42,3,5,whole,7);
+	rGaussian(42,3,5,part,3);
+	rGaussian(42,3,8,&part[3],4);
+	for(int i=0;i<7;i++){
+		utAssert(whole[i]==part[i],"rGaussian differs at %i",i);
+	}
+
+	return 0;
+}
+
+// Edge cases, and the mean and variance by inversion and by rejection
+static int testRBinomial(){
+
+	utAssert(rBinomial(42,0,0.3,0)==0,"no trials gave successes");
+	utAssert(rBinomial(42,0,0,100)==0,"p=0 gave successes");
+	utAssert(rBinomial(42,0,1,100)==100,"p=1 gave failures");
+	utAssert(rBinomial(42,5,0.3,1000)==rBinomial(42,5,0.3,1000),
+		"rBinomial is not reproducible");
+
+	long int n[3] = {20, 1000, 5000000000};
+	double p[3] = {0.2, 0.5, 0.7};
+	int nSamples = 10000;
+
+	for(int c=0;c<3;c++){
+
+		double sum = 0, sumSq = 0;
+		for(int i=0;i<nSamples;i++){
+			long int k = rBinomial(42,i,p[c],n[c]);
+			utAssert(k>=0 && k<=n[c],"%li successes of %li trials",k,n[c]);
+			sum += k;
+			sumSq += (double)k*k;
+		}
+
+		double mean = sum/nSamples;
+		double var = sumSq/nSamples-mean*mean;
+		double expVar = n[c]*p[c]*(1-p[c]);
+		utAssert(fabs(mean-n[c]*p[c])<5*sqrt(expVar/nSamples),
+			"mean %g, expected %g",mean,n[c]*p[c]);
+		utAssert(fabs(var/expVar-1)<0.1,"variance %g, expected %g",var,expVar);
+	}
+
+	return 0;
+}
+
+// All tests for random.c is contained in this function
+void testRandom(){
+	utRun(&testRPhilox);
+	utRun(&testRBatch);
+	utRun(&testRBinomial);
+}
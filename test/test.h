@@ -143,4 +143,12 @@ void testPusher();
  */
 void testMultigrid();
 
+/**
+ * @brief	Performs all tests in random.test.c
+ * @return	void
+ *
+ * This prevents many small global test functions.
+ */
+void testRandom();
+
 #endif // TEST_H